@@ -0,0 +1,321 @@
+#!/usr/bin/env python
+'''
+Benchmarks yajl (and optionally other JSON modules) on a corpus of
+documents generated locally from a fixed seed, so that runs on different
+machines, Pythons or versions of py-yajl time the very same input.
+
+For every document and operation it reports the throughput in MB/s and in
+decoded values per second (from the median of the timed repetitions, after
+some warmup), the peak memory traced while running it once and the number
+of memory blocks still allocated afterwards, i.e. held by its result.
+
+    python benchmarks/bench.py                       # time yajl
+    python benchmarks/bench.py -m json -m yajl       # ... against json
+    python benchmarks/bench.py -o before.json        # save the results
+    python benchmarks/bench.py -b before.json        # ... and diff later runs
+
+With --baseline the exit status is 1 if anything got slower by more than
+--threshold percent, unless the baseline comes from another Python version
+or platform, which is only warned about.
+'''
+from __future__ import print_function
+
+import gc
+import gzip
+import optparse
+import os
+import platform
+import random
+import sys
+import time
+
+try:
+    import tracemalloc
+except ImportError:
+    tracemalloc = None
+
+try:
+    import json as result_json
+except ImportError:
+    result_json = None
+
+if sys.version_info[0] >= 3:
+    unichr = chr
+
+timer = getattr(time, 'perf_counter', time.time)
+
+ISSUE_11 = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+        '..', 'test_data', 'issue_11.gz')
+
+
+def numeric_heavy(rng):
+    ''' Time series: rows of timestamps, counters and measurements '''
+    return [{'ts' : 1600000000 + i, 'count' : rng.randint(0, 1 << 40),
+                'values' : [rng.uniform(-1000.0, 1000.0) for j in range(24)],
+                'buckets' : [rng.randint(0, 1000) for j in range(24)]}
+            for i in range(4000)]
+
+def random_text(rng, length):
+    chars = []
+    for i in range(length):
+        kind = rng.random()
+        if kind < 0.85:
+            chars.append(unichr(rng.randint(0x20, 0x7E)))
+        elif kind < 0.9:
+            chars.append(rng.choice(['\n', '\t', '"', '\\']))
+        elif kind < 0.98:
+            chars.append(unichr(rng.randint(0xA0, 0x7FF)))
+        else:
+            chars.append(unichr(rng.randint(0x4E00, 0x9FFF)))
+    return u''.join(chars)
+
+def string_heavy(rng):
+    ''' Mostly text: short labels and longer free-form bodies '''
+    return [{'title' : random_text(rng, rng.randint(5, 40)),
+                'body' : random_text(rng, rng.randint(100, 1000)),
+                'labels' : [random_text(rng, 8) for j in range(4)]}
+            for i in range(1500)]
+
+def nest(rng, depth):
+    if depth == 0:
+        return rng.choice([None, True, 1, 2.5, u'leaf'])
+    if rng.random() < 0.5:
+        return {'depth' : depth, 'child' : nest(rng, depth - 1),
+                'sibling' : [rng.randint(0, 9)]}
+    return [nest(rng, depth - 1), depth]
+
+def deeply_nested(rng):
+    ''' Trees nested 60 levels deep, well within yajl's depth limit '''
+    return [nest(rng, 60) for i in range(1500)]
+
+def wide_records(rng):
+    ''' Rows of one shape with many columns, as exported from a table '''
+    keys = ['column_%02d' % i for i in range(60)]
+    rows = []
+    for i in range(2500):
+        row = {}
+        for j, key in enumerate(keys):
+            if j % 4 == 0:
+                row[key] = rng.randint(0, 100000)
+            elif j % 4 == 1:
+                row[key] = rng.random()
+            elif j % 4 == 2:
+                row[key] = random_text(rng, 10)
+            else:
+                row[key] = rng.choice([None, True, False])
+        rows.append(row)
+    return rows
+
+def ndjson_records(rng):
+    ''' Log-like records, built around the names in test_data/issue_11.gz '''
+    names = []
+    try:
+        stream = gzip.open(ISSUE_11)
+        try:
+            names = [line.decode('utf-8').strip() for line in stream]
+        finally:
+            stream.close()
+    except (IOError, OSError):
+        pass
+    if not names:
+        names = [random_text(rng, 20) for i in range(10000)]
+    return [{'id' : i, 'name' : name, 'score' : rng.random() * 100,
+                'tags' : [rng.choice(['a', 'b', 'c', 'd']) for j in range(3)],
+                'active' : rng.random() < 0.5}
+            for i, name in enumerate(names)]
+
+CORPUS = [
+    ('numeric', numeric_heavy),
+    ('strings', string_heavy),
+    ('nested', deeply_nested),
+    ('wide', wide_records),
+    ('ndjson', ndjson_records),
+]
+
+
+def count_values(obj):
+    ''' The number of values (containers and scalars) within `obj` '''
+    count = 0
+    pending = [obj]
+    while pending:
+        obj = pending.pop()
+        count += 1
+        if isinstance(obj, dict):
+            pending.extend(obj.values())
+        elif isinstance(obj, (list, tuple)):
+            pending.extend(obj)
+    return count
+
+
+def operations(module, name, doc):
+    '''
+    Returns (operation, callable, encoded size, values) tuples for `doc`;
+    NDJSON is handled a line at a time, the way it's consumed
+    '''
+    values = count_values(doc)
+    if name == 'ndjson':
+        lines = [module.dumps(record) for record in doc]
+        size = sum([len(line.encode('utf-8')) + 1 for line in lines])
+        def loads():
+            return [module.loads(line) for line in lines]
+        def dumps():
+            return '\n'.join([module.dumps(record) for record in doc])
+    else:
+        text = module.dumps(doc)
+        size = len(text.encode('utf-8'))
+        def loads():
+            return module.loads(text)
+        def dumps():
+            return module.dumps(doc)
+    return [('loads', loads, size, values), ('dumps', dumps, size, values)]
+
+
+def run_timed(func, warmup, repeat):
+    for i in range(warmup):
+        func()
+    times = []
+    for i in range(repeat):
+        gc.collect()
+        start = timer()
+        func()
+        times.append(timer() - start)
+    times.sort()
+    return times
+
+def run_traced(func):
+    '''
+    Returns the traced peak bytes and the memory blocks retained by the
+    result (rather than the number of allocations made along the way)
+    '''
+    peak = None
+    gc.collect()
+    blocks = getattr(sys, 'getallocatedblocks', lambda: None)()
+    if tracemalloc:
+        tracemalloc.start()
+    result = func()
+    if tracemalloc:
+        peak = tracemalloc.get_traced_memory()[1]
+        tracemalloc.stop()
+    gc.collect()
+    if blocks is not None:
+        blocks = sys.getallocatedblocks() - blocks
+    del result
+    return peak, blocks
+
+
+def benchmark(modules, names, warmup, repeat):
+    results = []
+    for doc_name, generate in CORPUS:
+        if names and doc_name not in names:
+            continue
+        doc = generate(random.Random(doc_name))
+        for module in modules:
+            for op, func, size, values in operations(module, doc_name, doc):
+                times = run_timed(func, warmup, repeat)
+                median = times[len(times) // 2]
+                peak, retained_blocks = run_traced(func)
+                results.append({
+                    'name' : '%s/%s/%s' % (module.__name__, doc_name, op),
+                    'bytes' : size,
+                    'values' : values,
+                    'best' : times[0],
+                    'median' : median,
+                    'mb_per_s' : size / median / 1e6,
+                    'values_per_s' : values / median,
+                    'peak_bytes' : peak,
+                    'retained_blocks' : retained_blocks,
+                })
+                report(results[-1])
+    return results
+
+def report(result):
+    ''' Memory figures are only available from Python 3.4 on '''
+    peak = retained = '-'
+    if result['peak_bytes'] is not None:
+        peak = '%.1f' % (result['peak_bytes'] / 1e6)
+    if result['retained_blocks'] is not None:
+        retained = result['retained_blocks']
+    print('%-24s %9.1f MB/s %11.0f values/s %9s MB peak %9s retained blocks' % (
+            result['name'], result['mb_per_s'], result['values_per_s'],
+            peak, retained))
+
+
+def mismatches(baseline):
+    ''' How the interpreter or platform of `baseline` differs from this run's '''
+    current = [('python', platform.python_version()), ('platform', platform.platform())]
+    return ['%s %s (now %s)' % (key, baseline.get(key), value)
+            for key, value in current if baseline.get(key) != value]
+
+def compare(results, baseline, threshold):
+    ''' Prints the change against `baseline`, returning the regressions '''
+    previous = dict([(result['name'], result) for result in baseline['results']])
+    regressions = []
+    print('\n%-24s %12s %12s %8s' % ('vs. baseline', 'MB/s before', 'MB/s now', 'change'))
+    for result in results:
+        before = previous.get(result['name'])
+        if not before:
+            continue
+        change = (result['mb_per_s'] / before['mb_per_s'] - 1.0) * 100
+        flag = ''
+        if change < -threshold:
+            flag = '  REGRESSION'
+            regressions.append(result['name'])
+        print('%-24s %12.1f %12.1f %+7.1f%%%s' % (result['name'],
+                before['mb_per_s'], result['mb_per_s'], change, flag))
+    return regressions
+
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options]', description=__doc__.split('\n\n')[0].strip())
+    parser.add_option('-m', '--module', action='append', dest='modules',
+            help='JSON module to benchmark, may be repeated (default: yajl)')
+    parser.add_option('-d', '--document', action='append', dest='documents',
+            help='only run the given document, one of %s' % ', '.join([c[0] for c in CORPUS]))
+    parser.add_option('-w', '--warmup', type='int', default=2,
+            help='untimed runs before timing (default: %default)')
+    parser.add_option('-r', '--repeat', type='int', default=7,
+            help='timed runs, of which the median counts (default: %default)')
+    parser.add_option('-o', '--output', help='write the results to this JSON file')
+    parser.add_option('-b', '--baseline', help='compare against results saved with --output')
+    parser.add_option('-t', '--threshold', type='float', default=5.0,
+            help='percentage slowdown reported as a regression (default: %default)')
+    options, args = parser.parse_args()
+
+    modules = [__import__(name) for name in (options.modules or ['yajl'])]
+    dumper = result_json or __import__('yajl')
+
+    print('Python %s on %s' % (platform.python_version(), platform.platform()))
+    results = benchmark(modules, options.documents, options.warmup, max(options.repeat, 1))
+
+    if options.output:
+        stream = open(options.output, 'w')
+        try:
+            stream.write(dumper.dumps({
+                'python' : platform.python_version(),
+                'platform' : platform.platform(),
+                'versions' : dict([(m.__name__, getattr(m, '__version__', None)) for m in modules]),
+                'results' : results,
+            }, indent=2))
+            stream.write('\n')
+        finally:
+            stream.close()
+
+    if options.baseline:
+        stream = open(options.baseline)
+        try:
+            baseline = dumper.loads(stream.read())
+        finally:
+            stream.close()
+        regressions = compare(results, baseline, options.threshold)
+        differences = mismatches(baseline)
+        if differences:
+            # timings from another interpreter or machine aren't comparable
+            sys.stderr.write('warning: the baseline was run with %s, so '
+                    'regressions are not counted\n' % ', '.join(differences))
+        elif regressions:
+            return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,485 @@
+/*
+ * Copyright 2010, R. Tyler Ballance <tyler@monkeypox.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  3. Neither the name of R. Tyler Ballance nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Times yajl's parser and generator on their own, and under the module's
+ * decoder and encoder, all from C so that none of the cost of calling in
+ * from Python is counted; the differences between the rows tell the cost
+ * of lexing apart from that of building (or walking) Python objects.
+ *
+ *     make -C benchmarks microbench
+ *     benchmarks/microbench [file.json [seconds]]
+ *
+ * Without a file a document of generated records is used.
+ */
+#include <Python.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <yajl/yajl_parse.h>
+#include <yajl/yajl_gen.h>
+
+#include "py_yajl.h"
+
+/* Located in yajl_hacks.c */
+extern yajl_gen_status yajl_gen_raw_string(yajl_gen g,
+        const unsigned char * str, unsigned int len);
+
+#ifdef IS_PYTHON3
+extern PyObject *PyInit_yajl(void);
+#define YAJL_INIT PyInit_yajl
+#else
+extern void inityajl(void);
+#define YAJL_INIT inityajl
+#endif
+
+#define RUNS 5
+
+typedef struct {
+    char *data;
+    size_t used;
+    size_t size;
+} buffer;
+
+static void append(buffer *b, const char *data, size_t len)
+{
+    if (b->used + len > b->size) {
+        while (b->used + len > b->size)
+            b->size = (b->size) ? b->size * 2 : 4096;
+        b->data = (char *)(realloc(b->data, b->size));
+        if (!b->data) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(b->data + b->used, data, len);
+    b->used += len;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Runs `bench` RUNS times for about `seconds` each, and prints the best
+ * throughput; returns it in MB/s
+ */
+typedef int (*benchfunc)(void *ctx);
+
+static double run(const char *name, benchfunc bench, void *ctx, size_t bytes,
+        double seconds, double reference)
+{
+    double best = 0, start, elapsed, rate;
+    long iterations;
+    int i;
+
+    for (i = 0; i < RUNS; i++) {
+        iterations = 0;
+        start = now();
+        do {
+            if (!bench(ctx)) {
+                fprintf(stderr, "%s failed\n", name);
+                if (PyErr_Occurred())
+                    PyErr_Print();
+                exit(1);
+            }
+            iterations++;
+            elapsed = now() - start;
+        } while (elapsed < seconds / RUNS);
+        rate = (double)(bytes) * iterations / elapsed / 1e6;
+        if (rate > best)
+            best = rate;
+    }
+    if (reference > 0)
+        printf("%-36s %9.1f MB/s %7.2fx\n", name, best, reference / best);
+    else
+        printf("%-36s %9.1f MB/s\n", name, best);
+    return best;
+}
+
+/* A document of `count` records, somewhat like a typical API response */
+static void generate(buffer *doc, int count)
+{
+    char record[256];
+    int i;
+
+    append(doc, "[", 1);
+    for (i = 0; i < count; i++) {
+        sprintf(record, "%s{\"id\": %d, \"name\": \"record %d\", "
+                "\"score\": %d.%03d, \"tags\": [\"alpha\", \"beta\\n\"], "
+                "\"active\": %s, \"parent\": null}",
+                (i) ? ", " : "", i, i * 7, i % 100, i % 1000,
+                (i % 2) ? "true" : "false");
+        append(doc, record, strlen(record));
+    }
+    append(doc, "]", 1);
+}
+
+static int load(buffer *doc, const char *path)
+{
+    char chunk[65536];
+    size_t len;
+    FILE *stream = fopen(path, "rb");
+
+    if (!stream)
+        return failure;
+    while ( (len = fread(chunk, 1, sizeof(chunk), stream)) > 0 )
+        append(doc, chunk, len);
+    fclose(stream);
+    return success;
+}
+
+
+/*
+ * Parsing
+ */
+static int noop_null(void *ctx) { return 1; }
+static int noop_boolean(void *ctx, int value) { return 1; }
+static int noop_number(void *ctx, const char *value, unsigned int len) { return 1; }
+static int noop_string(void *ctx, const unsigned char *value, unsigned int len) { return 1; }
+static int noop_container(void *ctx) { return 1; }
+
+static yajl_callbacks noop_callbacks = {
+    noop_null,
+    noop_boolean,
+    NULL,
+    NULL,
+    noop_number,
+    noop_string,
+    noop_container,
+    noop_string,
+    noop_container,
+    noop_container,
+    noop_container
+};
+
+typedef struct {
+    buffer *doc;
+    yajl_callbacks *callbacks;
+} parse_ctx;
+
+static int bench_parse(void *ctx)
+{
+    parse_ctx *parse = (parse_ctx *)(ctx);
+    yajl_parser_config config = { 1, 1 };
+    yajl_handle handle = yajl_alloc(parse->callbacks, &config, NULL, NULL);
+    yajl_status status;
+
+    status = yajl_parse(handle, (const unsigned char *)(parse->doc->data),
+            (unsigned int)(parse->doc->used));
+    if (status == yajl_status_ok)
+        status = yajl_parse_complete(handle);
+    yajl_free(handle);
+    return status == yajl_status_ok;
+}
+
+typedef struct {
+    buffer *doc;
+    PyObject *decoder;
+} decode_ctx;
+
+static int bench_decode(void *ctx)
+{
+    decode_ctx *decode = (decode_ctx *)(ctx);
+    PyObject *result = _internal_decode((_YajlDecoder *)(decode->decoder),
+            decode->doc->data, (unsigned int)(decode->doc->used));
+
+    Py_XDECREF(result);
+    return result != NULL;
+}
+
+
+/*
+ * Generating: the document's events are recorded once and then replayed
+ * into a generator, its strings either escaped by yajl_gen_string() or
+ * escaped up front for yajl_gen_raw_string(), as encoder.c does
+ */
+enum { ev_null, ev_true, ev_false, ev_number, ev_string, ev_map_open,
+    ev_map_close, ev_array_open, ev_array_close };
+
+typedef struct {
+    int kind;
+    /* offset and length in the recording's text */
+    size_t offset;
+    unsigned int len;
+    size_t escaped;
+    unsigned int escaped_len;
+} event;
+
+typedef struct {
+    event *events;
+    size_t count;
+    size_t size;
+    buffer text;
+    buffer output;
+} recording;
+
+static void record(recording *rec, int kind, const char *text, unsigned int len)
+{
+    static const char *hex = "0123456789abcdef";
+    event *ev;
+    char escape[7];
+    unsigned int i;
+
+    if (rec->count == rec->size) {
+        rec->size = (rec->size) ? rec->size * 2 : 1024;
+        rec->events = (event *)(realloc(rec->events, rec->size * sizeof(event)));
+        if (!rec->events) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    ev = &(rec->events[rec->count++]);
+    ev->kind = kind;
+    ev->offset = rec->text.used;
+    ev->len = len;
+    if (len)
+        append(&(rec->text), text, len);
+    if (kind != ev_string)
+        return;
+
+    ev->escaped = rec->text.used;
+    for (i = 0; i < len; i++) {
+        unsigned char ch = (unsigned char)(text[i]);
+
+        if ( (ch == '"') || (ch == '\\') ) {
+            escape[0] = '\\';
+            escape[1] = (char)(ch);
+            append(&(rec->text), escape, 2);
+        } else if (ch < 0x20) {
+            sprintf(escape, "\\u00%c%c", hex[ch >> 4], hex[ch & 0xF]);
+            append(&(rec->text), escape, 6);
+        } else {
+            append(&(rec->text), (const char *)(&ch), 1);
+        }
+    }
+    ev->escaped_len = (unsigned int)(rec->text.used - ev->escaped);
+}
+
+static int record_null(void *ctx)
+{
+    record((recording *)(ctx), ev_null, NULL, 0);
+    return 1;
+}
+
+static int record_boolean(void *ctx, int value)
+{
+    record((recording *)(ctx), (value) ? ev_true : ev_false, NULL, 0);
+    return 1;
+}
+
+static int record_number(void *ctx, const char *value, unsigned int len)
+{
+    record((recording *)(ctx), ev_number, value, len);
+    return 1;
+}
+
+static int record_string(void *ctx, const unsigned char *value, unsigned int len)
+{
+    record((recording *)(ctx), ev_string, (const char *)(value), len);
+    return 1;
+}
+
+#define RECORD_CONTAINER(name, kind) \
+    static int name(void *ctx) { record((recording *)(ctx), kind, NULL, 0); return 1; }
+RECORD_CONTAINER(record_map_open, ev_map_open)
+RECORD_CONTAINER(record_map_close, ev_map_close)
+RECORD_CONTAINER(record_array_open, ev_array_open)
+RECORD_CONTAINER(record_array_close, ev_array_close)
+
+static yajl_callbacks record_callbacks = {
+    record_null,
+    record_boolean,
+    NULL,
+    NULL,
+    record_number,
+    record_string,
+    record_map_open,
+    record_string,
+    record_map_close,
+    record_array_open,
+    record_array_close
+};
+
+static void printer(void *ctx, const char *str, unsigned int len)
+{
+    append((buffer *)(ctx), str, len);
+}
+
+static int replay(recording *rec, int raw)
+{
+    yajl_gen_config config = { 0, NULL };
+    yajl_gen generator;
+    yajl_gen_status status = yajl_gen_status_ok;
+    const unsigned char *text = (const unsigned char *)(rec->text.data);
+    event *ev;
+    size_t i;
+
+    rec->output.used = 0;
+    generator = yajl_gen_alloc2(printer, &config, NULL, &(rec->output));
+    for (i = 0; (i < rec->count) && (status == yajl_gen_status_ok); i++) {
+        ev = &(rec->events[i]);
+        switch (ev->kind) {
+            case ev_null: status = yajl_gen_null(generator); break;
+            case ev_true: status = yajl_gen_bool(generator, 1); break;
+            case ev_false: status = yajl_gen_bool(generator, 0); break;
+            case ev_number:
+                status = yajl_gen_number(generator, (const char *)(text + ev->offset), ev->len);
+                break;
+            case ev_string:
+                if (raw)
+                    status = yajl_gen_raw_string(generator, text + ev->escaped, ev->escaped_len);
+                else
+                    status = yajl_gen_string(generator, text + ev->offset, ev->len);
+                break;
+            case ev_map_open: status = yajl_gen_map_open(generator); break;
+            case ev_map_close: status = yajl_gen_map_close(generator); break;
+            case ev_array_open: status = yajl_gen_array_open(generator); break;
+            case ev_array_close: status = yajl_gen_array_close(generator); break;
+        }
+    }
+    yajl_gen_free(generator);
+    return status == yajl_gen_status_ok;
+}
+
+static int bench_gen_string(void *ctx)
+{
+    return replay((recording *)(ctx), 0);
+}
+
+static int bench_gen_raw(void *ctx)
+{
+    return replay((recording *)(ctx), 1);
+}
+
+typedef struct {
+    PyObject *encoder;
+    PyObject *object;
+} encode_ctx;
+
+static int bench_encode(void *ctx)
+{
+    encode_ctx *encode = (encode_ctx *)(ctx);
+    yajl_gen_config config = { 0, NULL };
+    PyObject *result = _internal_encode((_YajlEncoder *)(encode->encoder),
+            encode->object, config, 1, 0);
+
+    Py_XDECREF(result);
+    return result != NULL;
+}
+
+
+int main(int argc, char **argv)
+{
+    buffer doc = { NULL, 0, 0 };
+    recording rec;
+    parse_ctx parse;
+    decode_ctx decode;
+    encode_ctx encode;
+    PyObject *module = NULL;
+    double seconds = 5.0;
+    double lexing, generating;
+
+    if ( (argc > 1) && (!load(&doc, argv[1])) ) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (argc > 1) {
+        if (argc > 2)
+            seconds = atof(argv[2]);
+    } else {
+        generate(&doc, 20000);
+    }
+
+    PyImport_AppendInittab("yajl", YAJL_INIT);
+    Py_Initialize();
+    module = PyImport_ImportModule("yajl");
+    if (!module) {
+        PyErr_Print();
+        return 1;
+    }
+    decode.doc = &doc;
+    decode.decoder = PyObject_CallMethod(module, "Decoder", NULL);
+    encode.encoder = PyObject_CallMethod(module, "Encoder", NULL);
+    if ( (!decode.decoder) || (!encode.encoder) ) {
+        PyErr_Print();
+        return 1;
+    }
+    encode.object = _internal_decode((_YajlDecoder *)(decode.decoder),
+            doc.data, (unsigned int)(doc.used));
+    if (!encode.object) {
+        PyErr_Print();
+        return 1;
+    }
+
+    memset(&rec, 0, sizeof(recording));
+    {
+        yajl_parser_config config = { 1, 1 };
+        yajl_handle handle = yajl_alloc(&record_callbacks, &config, NULL, &rec);
+
+        yajl_parse(handle, (const unsigned char *)(doc.data), (unsigned int)(doc.used));
+        yajl_parse_complete(handle);
+        yajl_free(handle);
+    }
+
+    printf("%lu bytes, %lu events; the last column is the slowdown against\n"
+            "the first row of each group\n\n",
+            (unsigned long)(doc.used), (unsigned long)(rec.count));
+
+    parse.doc = &doc;
+    parse.callbacks = NULL;
+    lexing = run("yajl_parse, no callbacks", bench_parse, &parse, doc.used, seconds, 0);
+    parse.callbacks = &noop_callbacks;
+    run("yajl_parse, no-op callbacks", bench_parse, &parse, doc.used, seconds, lexing);
+    run("_internal_decode (decoder.c)", bench_decode, &decode, doc.used, seconds, lexing);
+    printf("\n");
+
+    generating = run("yajl_gen, yajl_gen_raw_string", bench_gen_raw, &rec, doc.used, seconds, 0);
+    run("yajl_gen, yajl_gen_string", bench_gen_string, &rec, doc.used, seconds, generating);
+    run("_internal_encode (encoder.c)", bench_encode, &encode, doc.used, seconds, generating);
+
+    Py_DECREF(encode.object);
+    Py_DECREF(encode.encoder);
+    Py_DECREF(decode.decoder);
+    Py_DECREF(module);
+    Py_Finalize();
+    free(doc.data);
+    free(rec.events);
+    free(rec.text.data);
+    free(rec.output.data);
+    return 0;
+}
@@ -33,6 +33,7 @@
 
 #include <Python.h>
 
+#include <limits.h>
 #include <string.h>
 
 #include <yajl/yajl_parse.h>
@@ -40,71 +41,642 @@
 
 #include "py_yajl.h"
 
-int _PlaceObject(_YajlDecoder *self, PyObject *parent, PyObject *child)
+static PyObject *NumberObject(const char *value, unsigned int length, int floaty)
 {
-    if ( (!self) || (!child) || (!parent) )
+    PyObject *object;
+#ifdef IS_PYTHON3
+    PyBytesObject *string;
+#else
+    PyObject *string;
+#endif
+
+#ifdef IS_PYTHON3
+    string = (PyBytesObject *)PyBytes_FromStringAndSize(value, length);
+    if (!string)
+        return NULL;
+    if (!floaty) {
+        object = PyLong_FromString(string->ob_sval, NULL, 10);
+    } else {
+        object = PyFloat_FromString((PyObject *)string);
+    }
+#else
+    string = PyString_FromStringAndSize(value, length);
+    if (!string)
+        return NULL;
+    if (!floaty) {
+        object = PyInt_FromString(PyString_AS_STRING(string), NULL, 10);
+    } else {
+        object = PyFloat_FromString(string, NULL);
+    }
+#endif
+    Py_XDECREF(string);
+    return object;
+}
+
+/* The int or float for the JSON number `value` */
+PyObject *_internal_number(const char *value, unsigned int length)
+{
+    unsigned int i;
+
+    for (i = 0; i < length; i++) {
+        switch (value[i]) {
+            case '.': case 'e': case 'E':
+                return NumberObject(value, length, 1);
+        }
+    }
+    return NumberObject(value, length, 0);
+}
+
+/*
+ * Columnar decoding, see yajl.loads_columnar()
+ *
+ * While inside the array of rows the rows' values never go onto the value
+ * stack, each one is appended to its column as soon as it's complete (or
+ * in the case of numbers, as soon as it's lexed) using the key on top of
+ * the value stack to pick the column
+ */
+
+/* The top frame is the array of rows */
+#define IN_ROWS(self) \
+    (py_yajl_ps_length((self)->frames) == (self)->columnar->target)
+/* The top frame is one of the rows */
+#define IN_ROW(self) \
+    (py_yajl_ps_length((self)->frames) == (self)->columnar->target + 1)
+
+/* The top frame is the array whose items are being iterated over */
+#define IN_ITEMS(self) \
+    (py_yajl_ps_length((self)->frames) == (self)->items->target)
+
+static int NotAnObjectRow(void)
+{
+    PyErr_SetString(PyExc_ValueError,
+            "Expected an array of objects at the given path");
+    return failure;
+}
+
+/*
+ * Parse the number yajl handed us without creating an object, returning 0
+ * if it won't fit in a long long (or double)
+ */
+static int ParseInteger(const char *value, unsigned int length, long long *result)
+{
+    long long number = 0;
+    unsigned int i = 0;
+    int negative = ( (length > 0) && (value[0] == '-') );
+    int digit;
+
+    if (negative)
+        i = 1;
+    if (i == length)
+        return 0;
+
+    /* accumulated as a negative number, LLONG_MIN having no positive match */
+    for (; i < length; i++) {
+        digit = value[i] - '0';
+        if (number < (LLONG_MIN + digit) / 10)
+            return 0;
+        number = (number * 10) - digit;
+    }
+    if (!negative) {
+        if (number == LLONG_MIN)
+            return 0;
+        number = -number;
+    }
+    *result = number;
+    return 1;
+}
+
+static int ParseDouble(const char *value, unsigned int length, double *result)
+{
+    char buffer[64];
+
+    if (length >= sizeof(buffer))
+        return 0;
+
+    memcpy(buffer, value, length);
+    buffer[length] = '\0';
+#if PY_VERSION_HEX >= 0x02070000
+    *result = PyOS_string_to_double(buffer, NULL, NULL);
+    if ( (*result == -1.0) && (PyErr_Occurred()) ) {
+        PyErr_Clear();
+        return 0;
+    }
+#else
+    *result = PyOS_ascii_atof(buffer);
+#endif
+    return 1;
+}
+
+/* Convert a column of raw numbers into a list of objects */
+static int ColumnBox(py_yajl_column *column)
+{
+    PyObject *item = NULL;
+    Py_ssize_t i;
+
+    column->objects = PyList_New(column->count);
+    if (!column->objects)
+        return failure;
+
+    for (i = 0; i < column->count; i++) {
+        if (column->kind == py_yajl_col_int)
+            item = PyLong_FromLongLong(((long long *)(column->numbers))[i]);
+        else
+            item = PyFloat_FromDouble(((double *)(column->numbers))[i]);
+        if (!item)
+            return failure;
+        PyList_SET_ITEM(column->objects, i, item);
+    }
+
+    free(column->numbers);
+    column->numbers = NULL;
+    column->size = 0;
+    column->kind = py_yajl_col_object;
+    return success;
+}
+
+static int ColumnAppendObject(py_yajl_column *column, PyObject *object)
+{
+    if ( (column->kind != py_yajl_col_object) && (!ColumnBox(column)) )
         return failure;
 
-    if (PyList_Check(parent)) {
-        PyList_Append(parent, child);
-        // child is now owned by parent!
-        if ((child) && (child != Py_None)) {
-            Py_XDECREF(child);
+    if (PyList_Append(column->objects, object))
+        return failure;
+    column->count++;
+    return success;
+}
+
+static int ColumnAppendNumber(py_yajl_column *column, const char *value,
+        unsigned int length, int floaty)
+{
+    PyObject *object = NULL;
+    long long integer = 0;
+    double number = 0.0;
+    int kind = floaty ? py_yajl_col_float : py_yajl_col_int;
+    int rc;
+
+    /* an empty numeric column takes on the kind of its first value */
+    if ( (column->kind != py_yajl_col_object) &&
+            ((column->count == 0) || (column->kind == kind)) ) {
+        if ( ((!floaty) && (ParseInteger(value, length, &integer))) ||
+                ((floaty) && (ParseDouble(value, length, &number))) ) {
+            if (column->count == column->size) {
+                Py_ssize_t newsize = column->size ? column->size * 2 : PY_YAJL_PS_INC;
+                void *numbers = realloc(column->numbers, 8 * newsize);
+
+                /* on failure the column keeps what it had */
+                if (!numbers) {
+                    PyErr_NoMemory();
+                    return failure;
+                }
+                column->numbers = numbers;
+                column->size = newsize;
+            }
+            if (floaty)
+                ((double *)(column->numbers))[column->count++] = number;
+            else
+                ((long long *)(column->numbers))[column->count++] = integer;
+            column->kind = kind;
+            return success;
         }
-        return success;
-    } else if (PyDict_Check(parent)) {
-        PyObject* key = py_yajl_ps_current(self->keys);
-        PyDict_SetItem(parent, key, child);
-        py_yajl_ps_pop(self->keys);
-        // child is now owned by parent!
-        Py_XDECREF(key);
-        if ((child) && (child != Py_None)) {
-            Py_XDECREF(child);
+    }
+
+    object = NumberObject(value, length, floaty);
+    if (!object)
+        return failure;
+    rc = ColumnAppendObject(column, object);
+    Py_DECREF(object);
+    return rc;
+}
+
+/*
+ * Find (or add) the column for the key on top of the value stack, popping
+ * the key off
+ */
+static py_yajl_column *ColumnForKey(_YajlDecoder *self)
+{
+    py_yajl_columnar *columnar = self->columnar;
+    py_yajl_column *column = NULL;
+    PyObject *key = py_yajl_ps_current(self->values);
+    PyObject *index = NULL;
+    Py_ssize_t i = columnar->next;
+    Py_ssize_t size;
+    int rc;
+
+    /* rows tend to list their keys in the same order */
+    if (i < columnar->ncolumns) {
+        rc = PyObject_RichCompareBool(columnar->columns[i].name, key, Py_EQ);
+        if (rc < 0)
+            return NULL;
+        if (!rc)
+            i = -1;
+    } else {
+        i = -1;
+    }
+
+    if (i < 0) {
+        index = PyDict_GetItem(columnar->index, key);
+        if (index) {
+            i = PyNumber_AsSsize_t(index, NULL);
+        } else {
+            if (columnar->ncolumns == columnar->size) {
+                size = columnar->size ? columnar->size * 2 : 16;
+                column = (py_yajl_column *)(realloc(columnar->columns,
+                            sizeof(py_yajl_column) * size));
+                if (!column) {
+                    PyErr_NoMemory();
+                    return NULL;
+                }
+                columnar->columns = column;
+                columnar->size = size;
+            }
+
+            i = columnar->ncolumns;
+            column = &columnar->columns[i];
+            memset(column, 0, sizeof(py_yajl_column));
+            column->name = key;
+            Py_INCREF(key);
+            columnar->ncolumns++;
+
+            /* rows before this one didn't have this key */
+            while (column->count < columnar->rows) {
+                if (!ColumnAppendObject(column, Py_None))
+                    return NULL;
+            }
+
+            index = PyLong_FromSsize_t(i);
+            if ( (!index) || (PyDict_SetItem(columnar->index, key, index)) ) {
+                Py_XDECREF(index);
+                return NULL;
+            }
+            Py_DECREF(index);
         }
-        return success;
     }
-    return failure;
+
+    columnar->next = i + 1;
+    column = &columnar->columns[i];
+
+    /* a repeated key within a row replaces the earlier value */
+    if (column->count > columnar->rows) {
+        column->count--;
+        if ( (column->kind == py_yajl_col_object) &&
+                (PyList_SetSlice(column->objects, column->count, column->count + 1, NULL)) ) {
+            return NULL;
+        }
+    }
+
+    py_yajl_ps_pop(self->values);
+    Py_DECREF(key);
+    return column;
+}
+
+static int ColumnPlaceObject(_YajlDecoder *self, PyObject *object)
+{
+    py_yajl_column *column = ColumnForKey(self);
+    int rc = failure;
+
+    if (column)
+        rc = ColumnAppendObject(column, object);
+    Py_DECREF(object);
+    return rc;
+}
+
+static int ColumnPlaceNumber(_YajlDecoder *self, const char *value,
+        unsigned int length, int floaty)
+{
+    py_yajl_column *column = ColumnForKey(self);
+
+    if (!column)
+        return failure;
+    return ColumnAppendNumber(column, value, length, floaty);
+}
+
+static int ColumnEndRow(_YajlDecoder *self)
+{
+    py_yajl_columnar *columnar = self->columnar;
+    Py_ssize_t i;
+
+    columnar->rows++;
+    columnar->next = 0;
+
+    /* fill in the keys this row didn't have */
+    for (i = 0; i < columnar->ncolumns; i++) {
+        if ( (columnar->columns[i].count < columnar->rows) &&
+                (!ColumnAppendObject(&columnar->columns[i], Py_None)) ) {
+            return failure;
+        }
+    }
+    return success;
+}
+
+/*
+ * Build the dict of columns, numeric columns becoming array.array objects
+ * and everything else lists
+ */
+static PyObject *ColumnsAsDict(py_yajl_columnar *columnar)
+{
+    PyObject *result = NULL;
+    PyObject *array = NULL;
+    PyObject *bytes = NULL;
+    PyObject *value = NULL;
+    py_yajl_column *column = NULL;
+    Py_ssize_t i;
+
+    result = PyDict_New();
+    if (!result)
+        return NULL;
+
+    for (i = 0; i < columnar->ncolumns; i++) {
+        column = &columnar->columns[i];
+
+#if PY_VERSION_HEX < 0x03030000
+        /* array.array('q') only exists from Python 3.3 onwards */
+        if ( (column->kind == py_yajl_col_int) && (!ColumnBox(column)) )
+            goto error;
+#endif
+        if (column->kind == py_yajl_col_object) {
+            value = column->objects;
+            Py_INCREF(value);
+        } else {
+            if ( (!array) && (!(array = PyImport_ImportModule("array"))) )
+                goto error;
+            bytes = PyString_FromStringAndSize((const char *)(column->numbers),
+                    (Py_ssize_t)(8 * column->count));
+            if (!bytes)
+                goto error;
+            value = PyObject_CallMethod(array, "array", "sO",
+                    (column->kind == py_yajl_col_int) ? "q" : "d", bytes);
+            Py_DECREF(bytes);
+        }
+
+        if ( (!value) || (PyDict_SetItem(result, column->name, value)) ) {
+            Py_XDECREF(value);
+            goto error;
+        }
+        Py_DECREF(value);
+    }
+
+    Py_XDECREF(array);
+    return result;
+
+  error:
+    Py_XDECREF(array);
+    Py_DECREF(result);
+    return NULL;
+}
+
+static void ReleaseColumnar(py_yajl_columnar *columnar)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < columnar->ncolumns; i++) {
+        Py_XDECREF(columnar->columns[i].name);
+        Py_XDECREF(columnar->columns[i].objects);
+        free(columnar->columns[i].numbers);
+    }
+    free(columnar->columns);
+    Py_XDECREF(columnar->segments);
+    Py_XDECREF(columnar->index);
+    Py_XDECREF(columnar->result);
+}
+
+/*
+ * Numeric arrays, see the decoder's `numeric_arrays` option
+ *
+ * The numbers in an array which is still a candidate for packing are kept
+ * raw on the number stack instead of the value stack, and only boxed and
+ * moved over once something other than a number of the same kind shows up
+ */
+static int SpillNumbers(_YajlDecoder *self, py_yajl_frame *frame)
+{
+    PyObject *object = NULL;
+    unsigned int i;
+
+    for (i = frame->numbers; i < py_yajl_ps_length(self->numbers); i++) {
+        if (frame->packing == py_yajl_pack_int)
+            object = PyLong_FromLongLong(py_yajl_ps_at(self->numbers, i).integer);
+        else
+            object = PyFloat_FromDouble(py_yajl_ps_at(self->numbers, i).number);
+        if (!object)
+            return failure;
+        if (!py_yajl_ps_push(self->values, object)) {
+            Py_DECREF(object);
+            return failure;
+        }
+    }
+    if (frame->packing == py_yajl_pack_int)
+        PY_YAJL_STAT(self->module, objects[py_yajl_stat_int],
+                py_yajl_ps_length(self->numbers) - frame->numbers);
+    else
+        PY_YAJL_STAT(self->module, objects[py_yajl_stat_float],
+                py_yajl_ps_length(self->numbers) - frame->numbers);
+    py_yajl_ps_truncate(self->numbers, frame->numbers);
+    frame->packing = py_yajl_pack_off;
+    return success;
+}
+
+/*
+ * Returns 1 if the number was packed, 0 if it should rather be placed as
+ * an object (the array having been spilled), -1 on error
+ */
+static int PackNumber(_YajlDecoder *self, py_yajl_frame *frame,
+        const char *value, unsigned int length, int floaty)
+{
+    py_yajl_number number;
+    int kind = floaty ? py_yajl_pack_float : py_yajl_pack_int;
+
+    if ( (frame->packing == py_yajl_pack_undecided) || (frame->packing == kind) ) {
+#if PY_VERSION_HEX < 0x03030000
+        /* array.array('q') only exists from Python 3.3 onwards */
+        if ( (floaty) && (ParseDouble(value, length, &number.number)) ) {
+#else
+        if ( ((floaty) && (ParseDouble(value, length, &number.number))) ||
+                ((!floaty) && (ParseInteger(value, length, &number.integer))) ) {
+#endif
+            if (!py_yajl_ps_push(self->numbers, number))
+                return -1;
+            frame->packing = kind;
+            return 1;
+        }
+    }
+    return SpillNumbers(self, frame) ? 0 : -1;
+}
+
+static PyObject *PackedArray(_YajlDecoder *self, py_yajl_frame *frame)
+{
+    PyObject *bytes = NULL;
+    PyObject *result = NULL;
+
+    bytes = PyString_FromStringAndSize(
+            (const char *)(&py_yajl_ps_at(self->numbers, frame->numbers)),
+            (Py_ssize_t)(sizeof(py_yajl_number) *
+                (py_yajl_ps_length(self->numbers) - frame->numbers)));
+    py_yajl_ps_truncate(self->numbers, frame->numbers);
+    if (!bytes)
+        return NULL;
+
+    result = PyObject_CallFunction(self->array_type, "sO",
+            (frame->packing == py_yajl_pack_int) ? "q" : "d", bytes);
+    Py_DECREF(bytes);
+    return result;
 }
 
 int PlaceObject(_YajlDecoder *self, PyObject *object)
 {
-    unsigned int length = py_yajl_ps_length(self->elements);
+    py_yajl_frame *frame = NULL;
+
+    if ( (!self) || (!object) )
+        return failure;
 
-    if (length == 0) {
+    if (py_yajl_ps_length(self->frames) == 0) {
         /*
-         * When the length is zero, and we're entering this code path
+         * When there's no open container, and we're entering this code path
          * we should only be handling "primitive types" i.e. strings and
-         * numbers, not dict/list.
+         * numbers, or a dict/list which was just closed
          */
         self->root = object;
         return success;
     }
-    return _PlaceObject(self, py_yajl_ps_current(self->elements), object);
+
+    if ( (self->items) && (self->items->target) && (IN_ITEMS(self)) ) {
+        /* an element of the array being iterated over, handed out as is */
+        int rc = PyList_Append(self->items->output, object);
+
+        Py_DECREF(object);
+        return (rc == 0) ? success : failure;
+    }
+
+    if ( (self->columnar) && (self->columnar->target) ) {
+        if (IN_ROW(self))
+            return ColumnPlaceObject(self, object);
+        if (IN_ROWS(self)) {
+            Py_DECREF(object);
+            return NotAnObjectRow();
+        }
+    }
+
+    frame = &(py_yajl_ps_at(self->frames, py_yajl_ps_length(self->frames) - 1));
+    if ( (frame->packing != py_yajl_pack_off) && (!SpillNumbers(self, frame)) ) {
+        Py_DECREF(object);
+        return failure;
+    }
+
+    /*
+     * The object is now owned by the value stack until its parent
+     * container is closed and built
+     */
+    if (!py_yajl_ps_push(self->values, object)) {
+        Py_DECREF(object);
+        return failure;
+    }
+    return success;
+}
+
+/*
+ * Drop any values (and frames) left over from a failed or aborted parse
+ */
+static void ReleaseScratch(_YajlDecoder *self)
+{
+    while (py_yajl_ps_length(self->values) > 0) {
+        Py_XDECREF(py_yajl_ps_current(self->values));
+        py_yajl_ps_pop(self->values);
+    }
+    while (py_yajl_ps_length(self->frames) > 0) {
+        Py_XDECREF(py_yajl_ps_current(self->frames).shape);
+        py_yajl_ps_pop(self->frames);
+    }
+    py_yajl_ps_truncate(self->numbers, 0);
 }
 
 
+/*
+ * Split a "/" separated path of object keys, e.g. "/data/items", into a
+ * tuple of those keys; "/" (or "") refers to the document itself
+ */
+PyObject *_internal_parse_path(PyObject *path)
+{
+    PyObject *upath = NULL;
+    PyObject *separator = NULL;
+    PyObject *parts = NULL;
+    PyObject *keys = NULL;
+    PyObject *result = NULL;
+    Py_ssize_t i;
+
+    upath = PyUnicode_FromObject(path);
+    separator = PyUnicode_FromString("/");
+    if ( (!upath) || (!separator) )
+        goto exit;
+
+    parts = PyUnicode_Split(upath, separator, -1);
+    keys = PyList_New(0);
+    if ( (!parts) || (!keys) )
+        goto exit;
+
+    for (i = 0; i < PyList_GET_SIZE(parts); i++) {
+        if ( (PyObject_Length(PyList_GET_ITEM(parts, i)) > 0) &&
+                (PyList_Append(keys, PyList_GET_ITEM(parts, i))) ) {
+            goto exit;
+        }
+    }
+    result = PyList_AsTuple(keys);
+
+  exit:
+    Py_XDECREF(upath);
+    Py_XDECREF(separator);
+    Py_XDECREF(parts);
+    Py_XDECREF(keys);
+    return result;
+}
+
+/*
+ * Whether a container opened now would sit at the path `keys`, i.e. every
+ * open container is an object whose current key matches the path
+ */
+static int AtPath(_YajlDecoder *self, PyObject *keys)
+{
+    unsigned int depth = py_yajl_ps_length(self->frames);
+    unsigned int i, position;
+    int rc;
+
+    if (depth != (unsigned int)(PyTuple_GET_SIZE(keys)))
+        return 0;
+
+    for (i = 0; i < depth; i++) {
+        if (!py_yajl_ps_at(self->frames, i).is_dict)
+            return 0;
+
+        /* an object's current key sits just below its current value */
+        if (i + 1 < depth)
+            position = py_yajl_ps_at(self->frames, i + 1).base - 1;
+        else
+            position = py_yajl_ps_length(self->values) - 1;
+
+        rc = PyObject_RichCompareBool(py_yajl_ps_at(self->values, position),
+                PyTuple_GET_ITEM(keys, i), Py_EQ);
+        if (rc <= 0)
+            return rc;
+    }
+    return 1;
+}
+
 static int handle_null(void *ctx)
 {
+    PY_YAJL_STAT(((_YajlDecoder *)(ctx))->module, objects[py_yajl_stat_null], 1);
     Py_INCREF(Py_None);
     return PlaceObject(ctx, Py_None);
 }
 
 static int handle_bool(void *ctx, int value)
 {
+    PY_YAJL_STAT(((_YajlDecoder *)(ctx))->module, objects[py_yajl_stat_bool], 1);
     return PlaceObject(ctx, PyBool_FromLong((long)(value)));
 }
 
 static int handle_number(void *ctx, const char *value, unsigned int length)
 {
     _YajlDecoder *self = (_YajlDecoder *)(ctx);
-    PyObject *object;
-#ifdef IS_PYTHON3
-    PyBytesObject *string;
-#else
-    PyObject *string;
-#endif
-
+    py_yajl_frame *frame = NULL;
     int floaty_char;
+    int rc;
 
     // take a moment here to scan the input string to see if there's
     // any chars which suggest this is a floating point number
@@ -115,112 +687,399 @@ static int handle_number(void *ctx, const char *value, unsigned int length)
     }
 
   floatin:
-#ifdef IS_PYTHON3
-    string = (PyBytesObject *)PyBytes_FromStringAndSize(value, length);
-    if (floaty_char >= length) {
-        object = PyLong_FromString(string->ob_sval, NULL, 10);
-    } else {
-        object = PyFloat_FromString((PyObject *)string);
+    if ( (self->columnar) && (self->columnar->target) && (IN_ROW(self)) )
+        return ColumnPlaceNumber(self, value, length, floaty_char < length);
+
+    if ( (self->numeric_arrays) && (py_yajl_ps_length(self->frames) > 0) ) {
+        frame = &(py_yajl_ps_at(self->frames, py_yajl_ps_length(self->frames) - 1));
+        if (frame->packing != py_yajl_pack_off) {
+            rc = PackNumber(self, frame, value, length, floaty_char < length);
+            if (rc < 0)
+                return failure;
+            if (rc)
+                return success;
+        }
     }
-#else
-    string = PyString_FromStringAndSize(value, length);
-    if (floaty_char >= length) {
-        object = PyInt_FromString(PyString_AS_STRING(string), NULL, 10);
-    } else {
-        object = PyFloat_FromString(string, NULL);
+    if (floaty_char < length)
+        PY_YAJL_STAT(self->module, objects[py_yajl_stat_float], 1);
+    else
+        PY_YAJL_STAT(self->module, objects[py_yajl_stat_int], 1);
+    return PlaceObject(self, NumberObject(value, length, floaty_char < length));
+}
+
+/*
+ * Look up (or create and remember) the string object for a short string
+ * value, returning a new reference
+ */
+static PyObject *InternedString(_YajlDecoder *self, const unsigned char *value,
+        unsigned int length)
+{
+    py_yajl_intern_slot *slot;
+    unsigned int hash = 2166136261U;
+    unsigned int i;
+
+    /* FNV-1a */
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ value[i]) * 16777619U;
+    }
+    slot = &self->interned[hash & (PY_YAJL_INTERN_SLOTS - 1)];
+
+    if ( (slot->value) && (slot->length == length) &&
+            (memcmp(slot->bytes, value, length) == 0) ) {
+        Py_INCREF(slot->value);
+        return slot->value;
+    }
+
+    Py_XDECREF(slot->value);
+    slot->value = PyUnicode_FromStringAndSize((const char *)value, length);
+    if (!slot->value)
+        return NULL;
+
+    slot->length = length;
+    memcpy(slot->bytes, value, length);
+    Py_INCREF(slot->value);
+    return slot->value;
+}
+
+static void ClearInterned(_YajlDecoder *self)
+{
+    unsigned int i;
+
+    if (!self->interned)
+        return;
+
+    for (i = 0; i < PY_YAJL_INTERN_SLOTS; i++) {
+        Py_XDECREF(self->interned[i].value);
+        self->interned[i].value = NULL;
     }
-#endif
-    Py_XDECREF(string);
-    return PlaceObject(self, object);
 }
 
 static int handle_string(void *ctx, const unsigned char *value, unsigned int length)
 {
+    _YajlDecoder *self = (_YajlDecoder *)(ctx);
+
+    PY_YAJL_STAT(self->module, objects[py_yajl_stat_str], 1);
+    if ( (self->interned) && (length <= PY_YAJL_INTERN_MAX_LEN) )
+        return PlaceObject(ctx, InternedString(self, value, length));
     return PlaceObject(ctx, PyUnicode_FromStringAndSize((char *)value, length));
 }
 
 static int handle_start_dict(void *ctx)
 {
-    PyObject *object = PyDict_New();
-    if (!object)
+    _YajlDecoder *self = (_YajlDecoder *)(ctx);
+
+    if (!py_yajl_fs_push(self->frames, py_yajl_ps_length(self->values), 1))
+        return failure;
+    return success;
+}
+
+static int handle_dict_key(void *ctx, const unsigned char *value, unsigned int length)
+{
+    PyObject *object = PyUnicode_FromStringAndSize((const char *) value, length);
+
+    if (object == NULL)
         return failure;
+    PY_YAJL_STAT(((_YajlDecoder *)(ctx))->module, objects[py_yajl_stat_key], 1);
 
-    py_yajl_ps_push(((_YajlDecoder *)(ctx))->elements, object);
+    /* keys sit on the value stack, interleaved with their values */
+    if (!py_yajl_ps_push(((_YajlDecoder *)(ctx))->values, object)) {
+        Py_DECREF(object);
+        return failure;
+    }
     return success;
 }
 
-static int handle_dict_key(void *ctx, const unsigned char *value, unsigned int length)
-{
-    PyObject *object = PyUnicode_FromStringAndSize((const char *) value, length);
+/*
+ * Build a yajl.Record out of the key/value pairs on the value stack from
+ * `base` to `used`, reusing the key tuple of the previous object in the
+ * same array when the keys match. Returns NULL without an exception set if
+ * the object should rather be decoded to a dict.
+ */
+static PyObject *BuildRecord(_YajlDecoder *self, py_yajl_frame *parent,
+        unsigned int base, unsigned int used)
+{
+    PyObject *shape = parent->shape;
+    PyObject *values[PY_YAJL_RECORD_MAX_KEYS];
+    Py_ssize_t count = (Py_ssize_t)((used - base) / 2);
+    Py_ssize_t i, j;
+    int rc;
+
+    for (i = 0; i < count; i++) {
+        values[i] = py_yajl_ps_at(self->values, base + (2 * i) + 1);
+    }
+
+    if ( (shape) && (PyTuple_GET_SIZE(shape) == count) ) {
+        for (i = 0; i < count; i++) {
+            rc = PyObject_RichCompareBool(PyTuple_GET_ITEM(shape, i),
+                    py_yajl_ps_at(self->values, base + (2 * i)), Py_EQ);
+            if (rc < 0)
+                return NULL;
+            if (!rc)
+                break;
+        }
+        if (i == count)
+            return yajlrecord_new(self->module->record_type, shape, values, count);
+    }
+
+    /* A new shape, which is only usable if none of its keys repeat */
+    for (i = 0; i < count; i++) {
+        for (j = i + 1; j < count; j++) {
+            rc = PyObject_RichCompareBool(py_yajl_ps_at(self->values, base + (2 * i)),
+                    py_yajl_ps_at(self->values, base + (2 * j)), Py_EQ);
+            if (rc < 0)
+                return NULL;
+            if (rc)
+                return NULL;
+        }
+    }
+
+    shape = PyTuple_New(count);
+    if (!shape)
+        return NULL;
+    for (i = 0; i < count; i++) {
+        Py_INCREF(py_yajl_ps_at(self->values, base + (2 * i)));
+        PyTuple_SET_ITEM(shape, i, py_yajl_ps_at(self->values, base + (2 * i)));
+    }
+    Py_XDECREF(parent->shape);
+    parent->shape = shape;
+
+    return yajlrecord_new(self->module->record_type, shape, values, count);
+}
+
+static int handle_end_dict(void *ctx)
+{
+    _YajlDecoder *self = (_YajlDecoder *)(ctx);
+    PyObject *object = NULL;
+    py_yajl_frame *parent = NULL;
+    unsigned int base, used, i;
+
+    if (py_yajl_ps_length(self->frames) == 0)
+        return failure;
+
+    if ( (self->columnar) && (self->columnar->target) && (IN_ROW(self)) ) {
+        py_yajl_ps_pop(self->frames);
+        return ColumnEndRow(self);
+    }
+
+    base = py_yajl_ps_current(self->frames).base;
+    used = py_yajl_ps_length(self->values);
+    py_yajl_ps_pop(self->frames);
+
+    if ( (self->records) && (py_yajl_ps_length(self->frames) > 0) &&
+            ((used - base) / 2 <= PY_YAJL_RECORD_MAX_KEYS) ) {
+        parent = &(py_yajl_ps_at(self->frames, py_yajl_ps_length(self->frames) - 1));
+        if (!parent->is_dict) {
+            object = BuildRecord(self, parent, base, used);
+            if ( (!object) && (PyErr_Occurred()) )
+                return failure;
+            if (object) {
+                PY_YAJL_STAT(self->module, objects[py_yajl_stat_record], 1);
+                goto place;
+            }
+        }
+    }
+
+    /*
+     * Now that all of the key/value pairs are known, the dict can be
+     * created with enough room for all of them up front
+     */
+#if PY_VERSION_HEX >= 0x02060000
+    object = _PyDict_NewPresized((Py_ssize_t)((used - base) / 2));
+#else
+    object = PyDict_New();
+#endif
+    if (!object)
+        return failure;
+    PY_YAJL_STAT(self->module, objects[py_yajl_stat_dict], 1);
+
+    for (i = base; i + 1 < used; i += 2) {
+        if (PyDict_SetItem(object, py_yajl_ps_at(self->values, i),
+                    py_yajl_ps_at(self->values, i + 1))) {
+            Py_DECREF(object);
+            return failure;
+        }
+    }
+
+  place:
+    // the container now holds its own references to the keys and values
+    for (i = base; i < used; i++) {
+        Py_DECREF(py_yajl_ps_at(self->values, i));
+    }
+    py_yajl_ps_truncate(self->values, base);
+
+    return PlaceObject(self, object);
+}
+
+static int handle_start_list(void *ctx)
+{
+    _YajlDecoder *self = (_YajlDecoder *)(ctx);
+    py_yajl_frame *frame = NULL;
+    int rc;
+
+    if (self->columnar) {
+        if ( (self->columnar->target) && (IN_ROWS(self)) )
+            return NotAnObjectRow();
+
+        if (!self->columnar->found) {
+            rc = AtPath(self, self->columnar->segments);
+            if (rc < 0)
+                return failure;
+            if (rc) {
+                self->columnar->found = 1;
+                self->columnar->target = py_yajl_ps_length(self->frames) + 1;
+            }
+        }
+    }
+
+    if ( (self->items) && (!self->items->found) ) {
+        rc = AtPath(self, self->items->segments);
+        if (rc < 0)
+            return failure;
+        if (rc) {
+            self->items->found = 1;
+            self->items->target = py_yajl_ps_length(self->frames) + 1;
+        }
+    }
 
-    if (object == NULL)
+    if (!py_yajl_fs_push(self->frames, py_yajl_ps_length(self->values), 0))
         return failure;
-
-    py_yajl_ps_push(((_YajlDecoder *)(ctx))->keys, object);
+    /* the items of an array being iterated over are never packed */
+    if ( (self->numeric_arrays) &&
+            ((!self->items) || (!self->items->target) || (!IN_ITEMS(self))) ) {
+        frame = &(py_yajl_ps_at(self->frames, py_yajl_ps_length(self->frames) - 1));
+        frame->packing = py_yajl_pack_undecided;
+        frame->numbers = py_yajl_ps_length(self->numbers);
+    }
     return success;
 }
 
-static int handle_end_dict(void *ctx)
+static int handle_end_list(void *ctx)
 {
     _YajlDecoder *self = (_YajlDecoder *)(ctx);
-    PyObject *last, *popped;
-    unsigned int length;
+    py_yajl_frame *frame = NULL;
+    PyObject *object;
+    unsigned int base, used, i;
 
-    length = py_yajl_ps_length(self->elements);
-    if (length == 1) {
-        /*
-         * If this is the last element in the stack
-         * then it's "root" and we should finish up
-         */
-        self->root = py_yajl_ps_current(self->elements);
-        py_yajl_ps_pop(self->elements);
-        return success;
-    } else if (length < 2) {
+    if (py_yajl_ps_length(self->frames) == 0)
         return failure;
+
+    if ( (self->columnar) && (self->columnar->target) && (IN_ROWS(self)) ) {
+        py_yajl_ps_pop(self->frames);
+        self->columnar->target = 0;
+        self->columnar->result = ColumnsAsDict(self->columnar);
+        if (!self->columnar->result)
+            return failure;
+        Py_INCREF(self->columnar->result);
+        return PlaceObject(self, self->columnar->result);
     }
 
-    /*
-     * If not, then we should properly add this dict
-     * to it's appropriate parent
-     */
-    popped = py_yajl_ps_current(self->elements);
-    py_yajl_ps_pop(self->elements);
-    last = py_yajl_ps_current(self->elements);
+    /* its items having been handed out, the array closes empty */
+    if ( (self->items) && (self->items->target) && (IN_ITEMS(self)) )
+        self->items->target = 0;
 
-    return _PlaceObject(self, last, popped);
-}
+    frame = &(py_yajl_ps_at(self->frames, py_yajl_ps_length(self->frames) - 1));
+    if ( (frame->packing == py_yajl_pack_int) || (frame->packing == py_yajl_pack_float) ) {
+        object = PackedArray(self, frame);
+        py_yajl_ps_pop(self->frames);
+        if (!object)
+            return failure;
+        PY_YAJL_STAT(self->module, objects[py_yajl_stat_array], 1);
+        return PlaceObject(self, object);
+    }
 
-static int handle_start_list(void *ctx)
-{
-    PyObject *object = PyList_New(0);
+    base = py_yajl_ps_current(self->frames).base;
+    used = py_yajl_ps_length(self->values);
+    Py_XDECREF(py_yajl_ps_current(self->frames).shape);
+    py_yajl_ps_pop(self->frames);
 
+    object = PyList_New((Py_ssize_t)(used - base));
     if (!object)
         return failure;
+    PY_YAJL_STAT(self->module, objects[py_yajl_stat_list], 1);
 
-    py_yajl_ps_push(((_YajlDecoder *)(ctx))->elements, object);
-    return success;
+    // the list steals the value stack's references
+    for (i = base; i < used; i++) {
+        PyList_SET_ITEM(object, (Py_ssize_t)(i - base), py_yajl_ps_at(self->values, i));
+    }
+    py_yajl_ps_truncate(self->values, base);
+
+    return PlaceObject(self, object);
 }
 
-static int handle_end_list(void *ctx)
+/* Whether the cyclic GC is enabled, disabling it if so */
+static int DisableGC(void)
 {
-    _YajlDecoder *self = (_YajlDecoder *)(ctx);
-    PyObject *last, *popped;
-    unsigned int length;
+#if PY_VERSION_HEX >= 0x030A0000
+    return PyGC_Disable();
+#else
+    PyObject *gc = PyImport_ImportModule("gc");
+    PyObject *result = NULL;
+    int enabled = 0;
 
-    length = py_yajl_ps_length(self->elements);
-    if (length == 1) {
-        self->root = py_yajl_ps_current(self->elements);
-        py_yajl_ps_pop(self->elements);
-        return success;
-    } else if (length < 2) {
-        return failure;
+    if (!gc) {
+        PyErr_Clear();
+        return 0;
+    }
+    result = PyObject_CallMethod(gc, "isenabled", NULL);
+    if (result) {
+        enabled = PyObject_IsTrue(result);
+        Py_DECREF(result);
     }
+    if (enabled == 1) {
+        result = PyObject_CallMethod(gc, "disable", NULL);
+        Py_XDECREF(result);
+    }
+    PyErr_Clear();
+    Py_DECREF(gc);
+    return enabled == 1;
+#endif
+}
+
+static void EnableGC(void)
+{
+#if PY_VERSION_HEX >= 0x030A0000
+    PyGC_Enable();
+#else
+    PyObject *gc = PyImport_ImportModule("gc");
+    PyObject *result = NULL;
+
+    if (gc) {
+        result = PyObject_CallMethod(gc, "enable", NULL);
+        Py_XDECREF(result);
+        Py_DECREF(gc);
+    }
+    PyErr_Clear();
+#endif
+}
 
-    popped = py_yajl_ps_current(self->elements);
-    py_yajl_ps_pop(self->elements);
-    last = py_yajl_ps_current(self->elements);
+/*
+ * Keep the cyclic GC from being triggered by the containers allocated while
+ * building the decoded tree. The collector's state is shared by every
+ * thread, so decodes running at the same time count their pauses and only
+ * the first disables the GC, the last restoring whatever state it found
+ */
+static void PauseGC(py_yajl_module_state *module)
+{
+#ifdef Py_GIL_DISABLED
+    PyMutex_Lock(&(module->gc_lock));
+#endif
+    if ((module->gc_pauses)++ == 0)
+        module->gc_was_enabled = DisableGC();
+#ifdef Py_GIL_DISABLED
+    PyMutex_Unlock(&(module->gc_lock));
+#endif
+}
 
-    return _PlaceObject(self, last, popped);
+static void ResumeGC(py_yajl_module_state *module)
+{
+#ifdef Py_GIL_DISABLED
+    PyMutex_Lock(&(module->gc_lock));
+#endif
+    if ( (--(module->gc_pauses) == 0) && (module->gc_was_enabled) )
+        EnableGC();
+#ifdef Py_GIL_DISABLED
+    PyMutex_Unlock(&(module->gc_lock));
+#endif
 }
 
 static yajl_callbacks decode_callbacks = {
@@ -242,25 +1101,40 @@ PyObject *_internal_decode(_YajlDecoder *self, char *buffer, unsigned int buflen
     yajl_handle parser = NULL;
     yajl_status yrc;
     yajl_parser_config config = { 1, 1 };
+    int gc_paused = 0;
+    long long start = PY_YAJL_CLOCK();
 
-    if (self->elements.used > 0) {
-        py_yajl_ps_free(self->elements);
-        py_yajl_ps_init(self->elements);
-    }
-    if (self->keys.used > 0) {
-        py_yajl_ps_free(self->keys);
-        py_yajl_ps_init(self->keys);
+    self->module = _internal_module_state(Py_TYPE(self));
+    if (!self->module)
+        return NULL;
+
+    if ( (self->disable_gc == 1) ||
+            ((self->disable_gc == -1) && (buflen >= PY_YAJL_GC_PAUSE_SZ)) ) {
+        PauseGC(self->module);
+        gc_paused = 1;
     }
 
+    /* the scratch stacks are kept around between calls for reuse */
+    ReleaseScratch(self);
+
     /* callbacks, config, allocfuncs */
     parser = yajl_alloc(&decode_callbacks, &config, NULL, (void *)(self));
     yrc = yajl_parse(parser, (const unsigned char *)(buffer), buflen);
     yajl_parse_complete(parser);
     yajl_free(parser);
 
+    ReleaseScratch(self);
+    ClearInterned(self);
+    if (gc_paused)
+        ResumeGC(self->module);
+
     if (yrc != yajl_status_ok) {
-        PyErr_SetObject(PyExc_ValueError,
-                PyUnicode_FromString(yajl_status_to_string(yrc)));
+        Py_XDECREF(self->root);
+        self->root = NULL;
+        /* callbacks may have already raised something more specific */
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ValueError, yajl_status_to_string(yrc));
+        }
         return NULL;
     }
 
@@ -272,36 +1146,364 @@ PyObject *_internal_decode(_YajlDecoder *self, char *buffer, unsigned int buflen
 
     // Callee now owns memory, we'll leave refcnt at one and
     // null out our pointer.
+    PY_YAJL_STAT(self->module, decoded_documents, 1);
+    PY_YAJL_STAT(self->module, decoded_bytes, buflen);
+    PY_YAJL_LATENCY(self->module, decode_latency, start);
+
     PyObject *root = self->root;
     self->root = NULL;
     return root;
 }
 
-PyObject *py_yajldecoder_decode(PYARGS)
+/*
+ * Decoding a chunk at a time: the decoder holds on to its parser, and the
+ * partly decoded document, from one call to the next until the document
+ * is complete. _internal_decode_begin() starts a new document, dropping
+ * any other
+ */
+int _internal_decode_begin(_YajlDecoder *self)
 {
-    _YajlDecoder *decoder = (_YajlDecoder *)(self);
-    char *buffer = NULL;
-    PyObject *pybuffer = NULL;
+    yajl_parser_config config = { 1, 1 };
+
+    self->module = _internal_module_state(Py_TYPE(self));
+    if (!self->module)
+        return failure;
+
+    _internal_decode_end(self);
+    self->parser = yajl_alloc(&decode_callbacks, &config, NULL, (void *)(self));
+    return success;
+}
+
+/*
+ * Parse the next `buflen` bytes of the document, an empty chunk marking its
+ * end; returns failure with an exception set if the document is invalid
+ * (or incomplete at its end). Once complete it's held by `root`
+ */
+static yajl_status ParseChunk(_YajlDecoder *self, const char *buffer,
+        unsigned int buflen)
+{
+    yajl_status yrc;
+
+    if (buflen)
+        yrc = yajl_parse(self->parser, (const unsigned char *)(buffer), buflen);
+    else
+        yrc = yajl_parse_complete(self->parser);
+
+    if (yrc == yajl_status_error) {
+        _internal_parse_error(self->parser, buffer, buflen);
+    } else if (yrc == yajl_status_client_canceled) {
+        /* callbacks may have already raised something more specific */
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, yajl_status_to_string(yrc));
+    }
+    return yrc;
+}
+
+int _internal_decode_chunk(_YajlDecoder *self, const char *buffer,
+        unsigned int buflen)
+{
+    yajl_status yrc = ParseChunk(self, buffer, buflen);
+
+    if ( (yrc == yajl_status_error) || (yrc == yajl_status_client_canceled) )
+        return failure;
+    PY_YAJL_STAT(self->module, decoded_bytes, buflen);
+
+    if (!buflen) {
+        if ( (yrc != yajl_status_ok) || (!self->root) ) {
+            PyErr_SetString(PyExc_ValueError, "The document is incomplete");
+            return failure;
+        }
+        PY_YAJL_STAT(self->module, decoded_documents, 1);
+    }
+    return success;
+}
+
+/* Drop the parser, and whatever's been decoded, of a chunked decode */
+void _internal_decode_end(_YajlDecoder *self)
+{
+    if (self->parser) {
+        yajl_free(self->parser);
+        self->parser = NULL;
+    }
+    ReleaseScratch(self);
+    ClearInterned(self);
+    Py_CLEAR(self->root);
+    self->partial = 0;
+}
+
+/*
+ * Feed the next `buflen` bytes of a stream of documents to the decoder,
+ * an empty chunk marking the end of the stream; returns a list of the
+ * documents the chunk completed, see Decoder.feed(). yajl stops after one
+ * document, so each one gets a parser of its own
+ */
+PyObject *_internal_decode_feed(_YajlDecoder *self, const char *buffer,
+        unsigned int buflen)
+{
+    PyObject *result = PyList_New(0);
+    unsigned int offset = 0;
+    yajl_status yrc;
+    int rc;
+
+    if (!result)
+        return NULL;
+
+    while ( (!buflen) || (offset < buflen) ) {
+        if ( (!self->parser) && (!_internal_decode_begin(self)) )
+            goto error;
+        yrc = ParseChunk(self, buffer + offset, buflen - offset);
+        if ( (yrc == yajl_status_error) || (yrc == yajl_status_client_canceled) )
+            goto error;
+        if (!self->root)
+            break;
+
+        rc = PyList_Append(result, self->root);
+        Py_CLEAR(self->root);
+        if (rc < 0)
+            goto error;
+        PY_YAJL_STAT(self->module, decoded_documents, 1);
+        self->partial = 0;
+        if (!buflen)
+            break;
+        offset += yajl_get_bytes_consumed(self->parser);
+        _internal_decode_end(self);
+    }
+
+    /* whatever's left has been taken in by the parser, and unless it's
+       just whitespace it starts a document which isn't complete yet */
+    for (; (offset < buflen) && (!self->partial); offset++) {
+        switch (buffer[offset]) {
+            case ' ':
+            case '\t':
+            case '\n':
+            case '\r':
+                break;
+            default:
+                self->partial = 1;
+        }
+    }
+    PY_YAJL_STAT(self->module, decoded_bytes, buflen);
+
+    if (!buflen) {
+        if (self->partial) {
+            PyErr_SetString(PyExc_ValueError, "The document is incomplete");
+            goto error;
+        }
+        _internal_decode_end(self);
+    }
+    return result;
+
+  error:
+    /* the stream can't be picked up from here, so start over */
+    Py_DECREF(result);
+    _internal_decode_end(self);
+    return NULL;
+}
+
+PyObject *_internal_decode_columnar(_YajlDecoder *self, char *buffer,
+        unsigned int buflen, PyObject *path)
+{
+    py_yajl_columnar columnar;
+    PyObject *root = NULL;
     PyObject *result = NULL;
-    Py_ssize_t buflen = 0;
 
-    if (!PyArg_ParseTuple(args, "O", &pybuffer))
+    memset(&columnar, 0, sizeof(py_yajl_columnar));
+    columnar.segments = _internal_parse_path(path);
+    columnar.index = PyDict_New();
+    if ( (!columnar.segments) || (!columnar.index) ) {
+        ReleaseColumnar(&columnar);
         return NULL;
+    }
+
+    self->columnar = &columnar;
+    root = _internal_decode(self, buffer, buflen);
+    self->columnar = NULL;
+
+    if (root) {
+        if (columnar.result) {
+            result = columnar.result;
+            Py_INCREF(result);
+        } else {
+            PyErr_SetString(PyExc_ValueError, "No array found at the given path");
+        }
+        Py_DECREF(root);
+    }
+
+    ReleaseColumnar(&columnar);
+    return result;
+}
 
-    Py_INCREF(pybuffer);
+/*
+ * Validation only needs to know how deep the parser is and whether the
+ * document has been completed; nothing is built and the GIL isn't needed
+ */
+typedef struct {
+    int depth;
+    int max_depth;
+    int exceeded;
+    int complete;
+} py_yajl_validator;
+
+static int validate_value(void *ctx)
+{
+    py_yajl_validator *v = (py_yajl_validator *)(ctx);
+
+    if (!v->depth)
+        v->complete = 1;
+    return 1;
+}
+
+static int validate_bool(void *ctx, int value)
+{
+    return validate_value(ctx);
+}
+
+static int validate_number(void *ctx, const char *value, unsigned int length)
+{
+    return validate_value(ctx);
+}
+
+static int validate_string(void *ctx, const unsigned char *value, unsigned int length)
+{
+    return validate_value(ctx);
+}
+
+static int validate_start(void *ctx)
+{
+    py_yajl_validator *v = (py_yajl_validator *)(ctx);
+
+    if ( (v->max_depth >= 0) && (v->depth >= v->max_depth) ) {
+        v->exceeded = 1;
+        return 0;
+    }
+    v->depth++;
+    return 1;
+}
+
+static int validate_end(void *ctx)
+{
+    py_yajl_validator *v = (py_yajl_validator *)(ctx);
+
+    v->depth--;
+    return validate_value(ctx);
+}
+
+static yajl_callbacks validate_callbacks = {
+    validate_value,
+    validate_bool,
+    NULL,
+    NULL,
+    validate_number,
+    validate_string,
+    validate_start,
+    NULL,
+    validate_end,
+    validate_start,
+    validate_end
+};
+
+/*
+ * Raise ValueError with yajl's description of the error `parser` ran into
+ * while parsing `buffer`
+ */
+void _internal_parse_error(yajl_handle parser, const char *buffer, unsigned int buflen)
+{
+    unsigned char *message = yajl_get_error(parser, 0,
+            (const unsigned char *)(buffer), buflen);
+    size_t length;
+
+    if (!message) {
+        PyErr_SetString(PyExc_ValueError, yajl_status_to_string(yajl_status_error));
+        return;
+    }
+    /* yajl ends its messages with a newline */
+    length = strlen((const char *)(message));
+    while ( (length > 0) && (message[length - 1] == '\n') )
+        message[--length] = '\0';
+    PyErr_SetString(PyExc_ValueError, (const char *)(message));
+    yajl_free_error(parser, message);
+}
+
+/*
+ * yajl stops at the end of the first document, leaving the rest of the
+ * input unparsed; returns failure with ValueError set unless the `buflen`
+ * bytes left over are just whitespace
+ */
+int _internal_check_trailing(const char *buffer, unsigned int buflen)
+{
+    unsigned int i;
+
+    for (i = 0; i < buflen; i++) {
+        switch (buffer[i]) {
+            case ' ':
+            case '\t':
+            case '\n':
+            case '\r':
+                break;
+            default:
+                PyErr_Format(PyExc_ValueError,
+                        "Extra data after the end of the document, at byte %u", i);
+                return failure;
+        }
+    }
+    return success;
+}
+
+/*
+ * Check that `buffer` holds a single well-formed JSON document whose
+ * objects and arrays nest no deeper than `max_depth` (if not negative);
+ * returns failure with a ValueError set otherwise
+ */
+int _internal_validate(char *buffer, unsigned int buflen, int max_depth)
+{
+    yajl_handle parser = NULL;
+    yajl_status yrc;
+    yajl_parser_config config = { 1, 1 };
+    py_yajl_validator validator = { 0, 0, 0, 0 };
+    unsigned int consumed = 0;
+    int rc = failure;
+
+    validator.max_depth = max_depth;
+
+    Py_BEGIN_ALLOW_THREADS
+    parser = yajl_alloc(&validate_callbacks, &config, NULL, (void *)(&validator));
+    yrc = yajl_parse(parser, (const unsigned char *)(buffer), buflen);
+    consumed = yajl_get_bytes_consumed(parser);
+    /* a number at the end of the document is only finished off here */
+    if ( (yrc == yajl_status_ok) || (yrc == yajl_status_insufficient_data) )
+        yrc = yajl_parse_complete(parser);
+    Py_END_ALLOW_THREADS
+
+    if (validator.exceeded) {
+        PyErr_Format(PyExc_ValueError, "Maximum depth of %d exceeded", max_depth);
+    } else if (yrc == yajl_status_error) {
+        _internal_parse_error(parser, buffer, buflen);
+    } else if ( (yrc != yajl_status_ok) || (!validator.complete) ) {
+        PyErr_SetString(PyExc_ValueError, "The document is incomplete");
+    } else if (consumed < buflen) {
+        rc = _internal_check_trailing(buffer + consumed, buflen - consumed);
+    } else {
+        rc = success;
+    }
+    yajl_free(parser);
+    return rc;
+}
 
+/*
+ * The UTF-8 bytes of the str or bytes `pybuffer`, as a new reference to
+ * the object holding them
+ */
+static PyObject *DocumentBytes(PyObject *pybuffer, char **buffer, Py_ssize_t *buflen)
+{
     if (PyUnicode_Check(pybuffer)) {
-        if (!(result = PyUnicode_AsUTF8String(pybuffer))) {
-            Py_DECREF(pybuffer);
+        if (!(pybuffer = PyUnicode_AsUTF8String(pybuffer)))
             return NULL;
-        }
-        Py_DECREF(pybuffer);
-        pybuffer = result;
-        result = NULL;
+    } else {
+        Py_INCREF(pybuffer);
     }
 
     if (PyString_Check(pybuffer)) {
-        if (PyString_AsStringAndSize(pybuffer, &buffer, &buflen)) {
+        if (PyString_AsStringAndSize(pybuffer, buffer, buflen)) {
             Py_DECREF(pybuffer);
             return NULL;
         }
@@ -312,38 +1514,192 @@ PyObject *py_yajldecoder_decode(PYARGS)
         PyErr_SetString(PyExc_ValueError, "string or unicode expected");
         return NULL;
     }
+    return pybuffer;
+}
+
+PyObject *py_yajldecoder_decode(PYARGS)
+{
+    _YajlDecoder *decoder = (_YajlDecoder *)(self);
+    char *buffer = NULL;
+    PyObject *pybuffer = NULL;
+    PyObject *result = NULL;
+    Py_ssize_t buflen = 0;
+
+    if (!PyArg_ParseTuple(args, "O", &pybuffer))
+        return NULL;
+
+    if (!(pybuffer = DocumentBytes(pybuffer, &buffer, &buflen)))
+        return NULL;
 
     if (!buflen) {
+        Py_DECREF(pybuffer);
         PyErr_SetObject(PyExc_ValueError,
                 PyUnicode_FromString("Cannot parse an empty buffer"));
         return NULL;
     }
 
-    result = _internal_decode(decoder, buffer, (unsigned int)buflen);
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (decoder->partial) {
+        /* decoding reuses the state the fed documents are held in */
+        PyErr_SetString(PyExc_ValueError,
+                "Cannot decode() in the middle of feed(), close() the decoder first");
+    } else {
+        result = _internal_decode(decoder, buffer, (unsigned int)buflen);
+    }
+    Py_END_CRITICAL_SECTION();
+    Py_DECREF(pybuffer);
+    return result;
+}
+
+PyObject *py_yajldecoder_feed(PYARGS)
+{
+    _YajlDecoder *decoder = (_YajlDecoder *)(self);
+    char *buffer = NULL;
+    PyObject *pybuffer = NULL;
+    PyObject *result = NULL;
+    Py_ssize_t buflen = 0;
+
+    if (!PyArg_ParseTuple(args, "O", &pybuffer))
+        return NULL;
+
+    if (!(pybuffer = DocumentBytes(pybuffer, &buffer, &buflen)))
+        return NULL;
+
+    /* an empty chunk would end the stream, which is up to close() */
+    if (!buflen) {
+        Py_DECREF(pybuffer);
+        return PyList_New(0);
+    }
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    result = _internal_decode_feed(decoder, buffer, (unsigned int)buflen);
+    Py_END_CRITICAL_SECTION();
     Py_DECREF(pybuffer);
     return result;
 }
 
+PyObject *py_yajldecoder_close(PyObject *self, PyObject *unused)
+{
+    PyObject *result = NULL;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    result = _internal_decode_feed((_YajlDecoder *)(self), NULL, 0);
+    Py_END_CRITICAL_SECTION();
+    return result;
+}
+
 int yajldecoder_init(PYARGS)
 {
     _YajlDecoder *me = (_YajlDecoder *)(self);
-    py_yajl_ps_init(me->elements);
-    py_yajl_ps_init(me->keys);
-    me->root = NULL;
+    PyObject *disable_gc = Py_None;
+    PyObject *intern_values = Py_False;
+    PyObject *records = Py_False;
+    PyObject *numeric_arrays = Py_False;
+    PyObject *array = NULL;
+    PyObject *array_type = NULL;
+    py_yajl_intern_slot *interned = NULL;
+    int gc = -1, intern, packed, rows;
+    static char *kwlist[] = {"disable_gc", "intern_values", "records",
+        "numeric_arrays", NULL};
+
+    if ( (args) && (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OOOO", kwlist,
+                    &disable_gc, &intern_values, &records, &numeric_arrays)) ) {
+        return -1;
+    }
+
+    rows = PyObject_IsTrue(records);
+    if (rows < 0)
+        return -1;
+
+    packed = PyObject_IsTrue(numeric_arrays);
+    if (packed < 0)
+        return -1;
+    if (packed) {
+        array = PyImport_ImportModule("array");
+        if (!array)
+            return -1;
+        array_type = PyObject_GetAttrString(array, "array");
+        Py_DECREF(array);
+        if (!array_type)
+            return -1;
+    }
+
+    if (disable_gc != Py_None) {
+        gc = PyObject_IsTrue(disable_gc);
+        if (gc < 0)
+            goto error;
+    }
+
+    intern = PyObject_IsTrue(intern_values);
+    if (intern < 0)
+        goto error;
+    if (intern) {
+        interned = (py_yajl_intern_slot *)(calloc(PY_YAJL_INTERN_SLOTS,
+                    sizeof(py_yajl_intern_slot)));
+        if (!interned) {
+            PyErr_NoMemory();
+            goto error;
+        }
+    }
+
+    /*
+     * The decoder may be re-initialized in the middle of feed(), or while
+     * another thread is decoding with it, so whatever it's holding on to is
+     * dropped along with the options, as when it's deallocated
+     */
+    Py_BEGIN_CRITICAL_SECTION(self);
+    _internal_decode_end(me);
+    py_yajl_ps_free(me->values);
+    py_yajl_ps_init(me->values);
+    py_yajl_ps_free(me->frames);
+    py_yajl_ps_init(me->frames);
+    py_yajl_ps_free(me->numbers);
+    py_yajl_ps_init(me->numbers);
+    free(me->interned);
+    me->interned = interned;
+    me->records = rows;
+    me->numeric_arrays = packed;
+    if (array_type) {
+        Py_XDECREF(me->array_type);
+        me->array_type = array_type;
+    }
+    me->disable_gc = gc;
+    Py_END_CRITICAL_SECTION();
 
     return 0;
+
+  error:
+    Py_XDECREF(array_type);
+    return -1;
 }
 
 void yajldecoder_dealloc(_YajlDecoder *self)
 {
-    py_yajl_ps_free(self->elements);
-    py_yajl_ps_init(self->elements);
-    py_yajl_ps_free(self->keys);
-    py_yajl_ps_init(self->keys);
+    if (self->parser)
+        yajl_free(self->parser);
+    ReleaseScratch(self);
+    py_yajl_ps_free(self->values);
+    py_yajl_ps_init(self->values);
+    py_yajl_ps_free(self->frames);
+    py_yajl_ps_init(self->frames);
+    py_yajl_ps_free(self->numbers);
+    py_yajl_ps_init(self->numbers);
+    Py_XDECREF(self->array_type);
+    self->array_type = NULL;
+    ClearInterned(self);
+    free(self->interned);
+    self->interned = NULL;
     if (self->root) {
         Py_XDECREF(self->root);
     }
-#ifdef IS_PYTHON3
+#ifdef PY_YAJL_HEAP_TYPES
+    {
+        PyTypeObject *type = Py_TYPE(self);
+
+        type->tp_free((PyObject*)self);
+        Py_DECREF(type);
+    }
+#elif defined(IS_PYTHON3)
     Py_TYPE(self)->tp_free((PyObject*)self);
 #else
     self->ob_type->tp_free((PyObject*)self);
@@ -30,6 +30,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 #include <Python.h>
+#include <datetime.h>
 
 #include <yajl/yajl_parse.h>
 #include <yajl/yajl_gen.h>
@@ -44,11 +45,905 @@ static const char *hexdigit = "0123456789abcdef";
 extern yajl_gen_status yajl_gen_raw_string(yajl_gen g,
         const unsigned char * str, unsigned int len);
 
-static yajl_gen_status ProcessObject(_YajlEncoder *self, PyObject *object)
+/* Append the ASCII character `ch`, escaped if need be */
+static unsigned int EscapeASCII(char *buffer, unsigned int offset, unsigned char ch)
+{
+    /* Escape escape characters */
+    switch (ch) {
+        case '\t':
+            buffer[offset++] = '\\';
+            buffer[offset++] = 't';
+            return offset;
+        case '\n':
+            buffer[offset++] = '\\';
+            buffer[offset++] = 'n';
+            return offset;
+        case '\r':
+            buffer[offset++] = '\\';
+            buffer[offset++] = 'r';
+            return offset;
+        case '\f':
+            buffer[offset++] = '\\';
+            buffer[offset++] = 'f';
+            return offset;
+        case '\b':
+            buffer[offset++] = '\\';
+            buffer[offset++] = 'b';
+            return offset;
+        case '\\':
+            buffer[offset++] = '\\';
+            buffer[offset++] = '\\';
+            return offset;
+        case '\"':
+            buffer[offset++] = '\\';
+            buffer[offset++] = '\"';
+            return offset;
+        default:
+            break;
+    }
+
+    /* Map non-printable US ASCII to '\u00hh' */
+    if ( (ch < 0x20) || (ch == 0x7F) ) {
+        buffer[offset++] = '\\';
+        buffer[offset++] = 'u';
+        buffer[offset++] = '0';
+        buffer[offset++] = '0';
+        buffer[offset++] = hexdigit[(ch >> 4) & 0x0F];
+        buffer[offset++] = hexdigit[ch & 0x0F];
+        return offset;
+    }
+
+    buffer[offset++] = (char)(ch);
+    return offset;
+}
+
+/* Append '\uxxxx' for the UTF-16 code unit `unit` */
+static unsigned int EscapeUTF16(char *buffer, unsigned int offset, unsigned long unit)
+{
+    buffer[offset++] = '\\';
+    buffer[offset++] = 'u';
+    buffer[offset++] = hexdigit[(unit >> 12) & 0x000F];
+    buffer[offset++] = hexdigit[(unit >> 8) & 0x000F];
+    buffer[offset++] = hexdigit[(unit >> 4) & 0x000F];
+    buffer[offset++] = hexdigit[unit & 0x000F];
+    return offset;
+}
+
+/*
+ * Append the code point `ch` as ASCII, characters outside of the BMP
+ * becoming a surrogate pair
+ */
+static unsigned int EscapeCodePoint(char *buffer, unsigned int offset, unsigned long ch)
+{
+    if (ch < 0x80)
+        return EscapeASCII(buffer, offset, (unsigned char)(ch));
+    if (ch < 0x10000)
+        return EscapeUTF16(buffer, offset, ch);
+
+    ch -= 0x10000;
+    offset = EscapeUTF16(buffer, offset, 0xD800 | (ch >> 10));
+    return EscapeUTF16(buffer, offset, 0xDC00 | (ch & 0x3FF));
+}
+
+/*
+ * Escape the given unicode object into a newly malloc()'d buffer suitable
+ * for yajl_gen_raw_string(), storing the number of bytes used in `length`;
+ * unless `ensure_ascii` is set, non-ASCII characters are copied as UTF-8
+ */
+static char *EscapeUnicode(PyObject *object, unsigned int *length, int ensure_ascii)
+{
+    char *buffer = NULL;
+    unsigned int offset = 0;
+    Py_ssize_t count, i;
+
+    if (!ensure_ascii) {
+        /* multi-byte sequences never contain bytes which need escaping */
+        PyObject *encoded = NULL;
+        const char *utf8 = NULL;
+
+#if PY_VERSION_HEX >= 0x03030000
+        utf8 = PyUnicode_AsUTF8AndSize(object, &count);
+        if (!utf8)
+            return NULL;
+#else
+        encoded = PyUnicode_AsUTF8String(object);
+        if (!encoded)
+            return NULL;
+        utf8 = PyString_AS_STRING(encoded);
+        count = PyString_GET_SIZE(encoded);
+#endif
+        buffer = (char *)(malloc(sizeof(char) * (1 + count * 6)));
+        for (i = 0; (buffer) && (i < count); i++) {
+            if ((unsigned char)(utf8[i]) >= 0x80)
+                buffer[offset++] = utf8[i];
+            else
+                offset = EscapeASCII(buffer, offset, (unsigned char)(utf8[i]));
+        }
+        Py_XDECREF(encoded);
+    } else {
+#if PY_VERSION_HEX >= 0x03030000
+        int kind;
+        const void *data;
+
+#if PY_VERSION_HEX < 0x030C0000
+        if (PyUnicode_READY(object))
+            return NULL;
+#endif
+        kind = PyUnicode_KIND(object);
+        data = PyUnicode_DATA(object);
+        count = PyUnicode_GET_LENGTH(object);
+
+        /* twelve bytes for a surrogate pair, six for anything else */
+        buffer = (char *)(malloc(sizeof(char) *
+                    (1 + count * ((kind == PyUnicode_4BYTE_KIND) ? 12 : 6))));
+        for (i = 0; (buffer) && (i < count); i++) {
+            offset = EscapeCodePoint(buffer, offset, PyUnicode_READ(kind, data, i));
+        }
+#else
+        Py_UNICODE *raw_unicode = PyUnicode_AS_UNICODE(object);
+        count = PyUnicode_GET_SIZE(object);
+
+        /* narrow builds already hold surrogate pairs */
+        buffer = (char *)(malloc(sizeof(char) *
+                    (1 + count * ((Py_UNICODE_SIZE == 4) ? 12 : 6))));
+        for (i = 0; (buffer) && (i < count); i++) {
+            offset = EscapeCodePoint(buffer, offset, (unsigned long)(raw_unicode[i]));
+        }
+#endif
+    }
+
+    if (!buffer) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    buffer[offset] = '\0';
+    *length = offset;
+    return buffer;
+}
+
+/* Big enough for any 64-bit integer, sign included */
+#define PY_YAJL_INTEGER_BUFSZ 24
+
+/*
+ * Write the digits of `value` (with a minus sign if `negative`) backwards
+ * from `end`, returning where they start
+ */
+static char *FormatInteger(char *end, unsigned long long value, int negative)
+{
+    do {
+        *--end = (char)('0' + (value % 10));
+        value /= 10;
+    } while (value);
+
+    if (negative)
+        *--end = '-';
+    return end;
+}
+
+static yajl_gen_status GenInteger(yajl_gen handle, long long number)
+{
+    char buffer[PY_YAJL_INTEGER_BUFSZ];
+    char *end = buffer + sizeof(buffer);
+    char *start;
+
+    if (number < 0)
+        start = FormatInteger(end, 0ULL - (unsigned long long)(number), 1);
+    else
+        start = FormatInteger(end, (unsigned long long)(number), 0);
+    return yajl_gen_number(handle, start, (unsigned int)(end - start));
+}
+
+static yajl_gen_status GenUnsigned(yajl_gen handle, unsigned long long number)
+{
+    char buffer[PY_YAJL_INTEGER_BUFSZ];
+    char *end = buffer + sizeof(buffer);
+    char *start = FormatInteger(end, number, 0);
+
+    return yajl_gen_number(handle, start, (unsigned int)(end - start));
+}
+
+#if PY_VERSION_HEX >= 0x02060000
+/*
+ * Returns the struct module style type code of a buffer's items if they
+ * are native numbers we know how to encode, 0 otherwise
+ */
+static char NumericFormat(const char *format)
+{
+    /* no format means unsigned bytes */
+    if (!format)
+        return 'B';
+    if (format[0] == '@')
+        format++;
+    if ( (format[0] == '\0') || (format[1] != '\0') )
+        return 0;
+    if (!strchr("bBhHiIlLqQfd", format[0]))
+        return 0;
+    return format[0];
+}
+
+#define BUFFER_ITEM(type, gen, cast) {          \
+        type value;                             \
+        memcpy(&value, data, sizeof(type));     \
+        return gen(handle, (cast)(value));      \
+    }
+
+static yajl_gen_status BufferItem(yajl_gen handle, char format, const char *data)
+{
+    switch (format) {
+        case 'b': BUFFER_ITEM(signed char, GenInteger, long long);
+        case 'B': BUFFER_ITEM(unsigned char, GenInteger, long long);
+        case 'h': BUFFER_ITEM(short, GenInteger, long long);
+        case 'H': BUFFER_ITEM(unsigned short, GenInteger, long long);
+        case 'i': BUFFER_ITEM(int, GenInteger, long long);
+        case 'I': BUFFER_ITEM(unsigned int, GenUnsigned, unsigned long long);
+        case 'l': BUFFER_ITEM(long, GenInteger, long long);
+        case 'L': BUFFER_ITEM(unsigned long, GenUnsigned, unsigned long long);
+        case 'q': BUFFER_ITEM(long long, GenInteger, long long);
+        case 'Q': BUFFER_ITEM(unsigned long long, GenUnsigned, unsigned long long);
+        case 'f': BUFFER_ITEM(float, yajl_gen_double, double);
+        case 'd': BUFFER_ITEM(double, yajl_gen_double, double);
+    }
+    return yajl_gen_in_error_state;
+}
+
+/* Emit dimension `dim` onwards of the buffer starting at `data` */
+static yajl_gen_status BufferItems(yajl_gen handle, Py_buffer *view,
+        char format, const char *data, int dim)
+{
+    yajl_gen_status status;
+    Py_ssize_t i;
+
+    if (dim == view->ndim)
+        return BufferItem(handle, format, data);
+
+    status = yajl_gen_array_open(handle);
+    for (i = 0; (status == yajl_gen_status_ok) && (i < view->shape[dim]); i++) {
+        status = BufferItems(handle, view, format, data + (i * view->strides[dim]), dim + 1);
+    }
+    if (status != yajl_gen_status_ok)
+        return status;
+    return yajl_gen_array_close(handle);
+}
+
+/*
+ * Encode an object exposing a buffer of native numbers (array.array,
+ * memoryview and the like) as an array, straight from its memory; sets
+ * `handled` to 0 if the object has some other kind of buffer
+ */
+static yajl_gen_status ProcessBuffer(py_yajl_encstate *state, PyObject *object,
+        int *handled)
+{
+    yajl_gen_status status;
+    Py_buffer view;
+    char format;
+
+    *handled = 0;
+    if (PyObject_GetBuffer(object, &view, PyBUF_RECORDS_RO)) {
+        PyErr_Clear();
+        return yajl_gen_in_error_state;
+    }
+
+    format = NumericFormat(view.format);
+    if (format) {
+        *handled = 1;
+        status = BufferItems((yajl_gen)(state->generator), &view, format,
+                (const char *)(view.buf), 0);
+    }
+    PyBuffer_Release(&view);
+    return format ? status : yajl_gen_in_error_state;
+}
+#endif
+
+/*
+ * datetime, date and time objects are encoded as ISO 8601 strings the way
+ * their isoformat() methods would, UUIDs as their canonical string form and
+ * Decimals as (exact) numbers
+ */
+static void FormatDigits(char *buffer, int value, int digits)
+{
+    while (digits-- > 0) {
+        buffer[digits] = (char)('0' + (value % 10));
+        value /= 10;
+    }
+}
+
+/* Append "HH:MM:SS[.ffffff]" to `buffer`, returning the new offset */
+static int FormatTime(char *buffer, int offset, int hour, int minute,
+        int second, int microsecond)
+{
+    FormatDigits(buffer + offset, hour, 2);
+    buffer[offset + 2] = ':';
+    FormatDigits(buffer + offset + 3, minute, 2);
+    buffer[offset + 5] = ':';
+    FormatDigits(buffer + offset + 6, second, 2);
+    offset += 8;
+
+    if (microsecond) {
+        buffer[offset++] = '.';
+        FormatDigits(buffer + offset, microsecond, 6);
+        offset += 6;
+    }
+    return offset;
+}
+
+/*
+ * Append the "+HH:MM[:SS[.ffffff]]" UTC offset of an aware datetime or
+ * time, returning the new offset or -1 on error
+ */
+static int FormatUTCOffset(char *buffer, int offset, PyObject *object)
+{
+    PyObject *delta = PyObject_CallMethod(object, "utcoffset", NULL);
+    long long total;
+    int seconds, microseconds;
+
+    if (!delta)
+        return -1;
+    if (delta == Py_None) {
+        Py_DECREF(delta);
+        return offset;
+    }
+    if (!PyDelta_Check(delta)) {
+        Py_DECREF(delta);
+        PyErr_SetString(PyExc_TypeError, "utcoffset() must return a timedelta");
+        return -1;
+    }
+
+    total = (((long long)(((PyDateTime_Delta *)(delta))->days) * 86400) +
+            ((PyDateTime_Delta *)(delta))->seconds) * 1000000 +
+            ((PyDateTime_Delta *)(delta))->microseconds;
+    Py_DECREF(delta);
+
+    buffer[offset++] = (total < 0) ? '-' : '+';
+    if (total < 0)
+        total = -total;
+    microseconds = (int)(total % 1000000);
+    seconds = (int)((total / 1000000) % 86400);
+
+    FormatDigits(buffer + offset, seconds / 3600, 2);
+    buffer[offset + 2] = ':';
+    FormatDigits(buffer + offset + 3, (seconds / 60) % 60, 2);
+    offset += 5;
+    if ( (seconds % 60) || (microseconds) ) {
+        buffer[offset++] = ':';
+        FormatDigits(buffer + offset, seconds % 60, 2);
+        offset += 2;
+        if (microseconds) {
+            buffer[offset++] = '.';
+            FormatDigits(buffer + offset, microseconds, 6);
+            offset += 6;
+        }
+    }
+    return offset;
+}
+
+static yajl_gen_status ProcessDateTime(yajl_gen handle, PyObject *object)
+{
+    /* "YYYY-MM-DDTHH:MM:SS.ffffff+HH:MM:SS.ffffff" */
+    char buffer[48];
+    int offset = 0;
+
+    if (PyDate_Check(object)) {
+        FormatDigits(buffer, PyDateTime_GET_YEAR(object), 4);
+        buffer[4] = '-';
+        FormatDigits(buffer + 5, PyDateTime_GET_MONTH(object), 2);
+        buffer[7] = '-';
+        FormatDigits(buffer + 8, PyDateTime_GET_DAY(object), 2);
+        offset = 10;
+    }
+
+    if (PyDateTime_Check(object)) {
+        buffer[offset++] = 'T';
+        offset = FormatTime(buffer, offset,
+                PyDateTime_DATE_GET_HOUR(object), PyDateTime_DATE_GET_MINUTE(object),
+                PyDateTime_DATE_GET_SECOND(object), PyDateTime_DATE_GET_MICROSECOND(object));
+        if (((PyDateTime_DateTime *)(object))->hastzinfo)
+            offset = FormatUTCOffset(buffer, offset, object);
+    } else if (PyTime_Check(object)) {
+        offset = FormatTime(buffer, offset,
+                PyDateTime_TIME_GET_HOUR(object), PyDateTime_TIME_GET_MINUTE(object),
+                PyDateTime_TIME_GET_SECOND(object), PyDateTime_TIME_GET_MICROSECOND(object));
+        if (((PyDateTime_Time *)(object))->hastzinfo)
+            offset = FormatUTCOffset(buffer, offset, object);
+    }
+
+    if (offset < 0)
+        return yajl_gen_in_error_state;
+    return yajl_gen_raw_string(handle, (const unsigned char *)(buffer), (unsigned int)(offset));
+}
+
+static yajl_gen_status ProcessUUID(yajl_gen handle, PyObject *object)
+{
+    /* "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx" */
+    char buffer[36];
+    PyObject *number = NULL;
+    PyObject *shift = NULL;
+    PyObject *high = NULL;
+    unsigned long long halves[2];
+    int i, digit;
+
+    number = PyObject_GetAttrString(object, "int");
+    shift = PyLong_FromLong(64);
+    if ( (number) && (shift) )
+        high = PyNumber_Rshift(number, shift);
+    Py_XDECREF(shift);
+    if (!high) {
+        Py_XDECREF(number);
+        return yajl_gen_in_error_state;
+    }
+
+    halves[0] = PyLong_AsUnsignedLongLongMask(high);
+    halves[1] = PyLong_AsUnsignedLongLongMask(number);
+    Py_DECREF(high);
+    Py_DECREF(number);
+    if (PyErr_Occurred())
+        return yajl_gen_in_error_state;
+
+    for (i = 0, digit = 0; i < 36; i++) {
+        if ( (i == 8) || (i == 13) || (i == 18) || (i == 23) ) {
+            buffer[i] = '-';
+            continue;
+        }
+        buffer[i] = hexdigit[(halves[digit / 16] >> (4 * (15 - (digit % 16)))) & 0xF];
+        digit++;
+    }
+    return yajl_gen_raw_string(handle, (const unsigned char *)(buffer), 36);
+}
+
+static yajl_gen_status ProcessDecimal(yajl_gen handle, PyObject *object)
 {
-    yajl_gen handle = (yajl_gen)(self->_generator);
     yajl_gen_status status = yajl_gen_in_error_state;
-    PyObject *iterator, *item;
+    PyObject *string = NULL;
+    PyObject *encoded = NULL;
+    char *buffer = NULL;
+    Py_ssize_t length = 0;
+
+    string = PyObject_Str(object);
+    if (!string)
+        return yajl_gen_in_error_state;
+#ifdef IS_PYTHON3
+    encoded = PyUnicode_AsUTF8String(string);
+    Py_DECREF(string);
+#else
+    encoded = string;
+#endif
+    if ( (!encoded) || (PyString_AsStringAndSize(encoded, &buffer, &length)) ) {
+        Py_XDECREF(encoded);
+        return yajl_gen_in_error_state;
+    }
+
+    /* NaN, sNaN and Infinity have no JSON representation */
+    if ( (length > 0) && (buffer[0] == '-') ) {
+        if ( (length > 1) && (buffer[1] >= '0') && (buffer[1] <= '9') )
+            status = yajl_gen_number(handle, buffer, (unsigned int)(length));
+    } else if ( (length > 0) && (buffer[0] >= '0') && (buffer[0] <= '9') ) {
+        status = yajl_gen_number(handle, buffer, (unsigned int)(length));
+    }
+    Py_DECREF(encoded);
+    return status;
+}
+
+/*
+ * Returns the (borrowed) class `name` from `module` if the module has been
+ * imported; there can't be any instances of it otherwise
+ */
+static PyObject *ImportedClass(PyObject **cache, const char *module, const char *name)
+{
+    PyObject *imported = NULL;
+
+    if (*cache)
+        return *cache;
+
+    imported = PyDict_GetItemString(PyImport_GetModuleDict(), module);
+    if (!imported)
+        return NULL;
+    *cache = PyObject_GetAttrString(imported, name);
+    if ( (*cache) && (!PyType_Check(*cache)) )
+        Py_CLEAR(*cache);
+    PyErr_Clear();
+    return *cache;
+}
+
+/*
+ * Encode datetimes, dates, times, UUIDs and Decimals, setting `handled` to
+ * 0 for objects of any other type
+ */
+static yajl_gen_status ProcessNativeType(py_yajl_encstate *state, PyObject *object,
+        int *handled)
+{
+    yajl_gen handle = (yajl_gen)(state->generator);
+    PyObject *type = NULL;
+
+    *handled = 1;
+    if (!PyDateTimeAPI) {
+        PyDateTime_IMPORT;
+        PyErr_Clear();
+    }
+    if ( (PyDateTimeAPI) && ((PyDate_Check(object)) || (PyTime_Check(object))) )
+        return ProcessDateTime(handle, object);
+
+    type = ImportedClass(&(state->uuid_type), "uuid", "UUID");
+    if ( (type) && (PyObject_TypeCheck(object, (PyTypeObject *)(type))) )
+        return ProcessUUID(handle, object);
+
+    type = ImportedClass(&(state->decimal_type), "decimal", "Decimal");
+    if ( (type) && (PyObject_TypeCheck(object, (PyTypeObject *)(type))) )
+        return ProcessDecimal(handle, object);
+
+    *handled = 0;
+    return yajl_gen_in_error_state;
+}
+
+static yajl_gen_status ProcessKey(py_yajl_encstate *state, PyObject *key);
+static yajl_gen_status ProcessObject(py_yajl_encstate *state, PyObject *object);
+
+/* Returns a new reference to a tuple of the dataclass' field names */
+static PyObject *DataclassFields(PyObject *type)
+{
+    PyObject *dataclasses = NULL;
+    PyObject *fields = NULL;
+    PyObject *names = NULL;
+    PyObject *name = NULL;
+    Py_ssize_t i;
+
+    dataclasses = PyImport_ImportModule("dataclasses");
+    if (!dataclasses)
+        return NULL;
+    fields = PyObject_CallMethod(dataclasses, "fields", "O", type);
+    Py_DECREF(dataclasses);
+    if (!fields)
+        return NULL;
+
+    names = PyTuple_New(PyTuple_GET_SIZE(fields));
+    for (i = 0; (names) && (i < PyTuple_GET_SIZE(fields)); i++) {
+        name = PyObject_GetAttrString(PyTuple_GET_ITEM(fields, i), "name");
+        if (!name) {
+            Py_CLEAR(names);
+            break;
+        }
+        PyTuple_SET_ITEM(names, i, name);
+    }
+    Py_DECREF(fields);
+    return names;
+}
+
+/* Remember the slot `name` unless it's one of the special ones */
+static int AppendSlot(PyObject *names, PyObject *name)
+{
+#ifdef IS_PYTHON3
+    if ( (PyUnicode_Check(name)) &&
+            ((!PyUnicode_CompareWithASCIIString(name, "__weakref__")) ||
+             (!PyUnicode_CompareWithASCIIString(name, "__dict__"))) ) {
+        return 0;
+    }
+#else
+    if ( (PyString_Check(name)) &&
+            ((!strcmp(PyString_AS_STRING(name), "__weakref__")) ||
+             (!strcmp(PyString_AS_STRING(name), "__dict__"))) ) {
+        return 0;
+    }
+#endif
+    return PyList_Append(names, name);
+}
+
+/*
+ * Returns a new reference to a tuple of the slots declared throughout the
+ * class hierarchy, base classes first, or to None if the instances have a
+ * __dict__ or there are no __slots__ at all
+ */
+static PyObject *SlotNames(PyTypeObject *type)
+{
+    PyObject *names = NULL;
+    PyObject *dict = NULL;
+    PyObject *slots = NULL;
+    PyObject *iterator = NULL;
+    PyObject *item = NULL;
+    PyObject *result = NULL;
+    Py_ssize_t i;
+    int found = 0;
+    int rc;
+
+    if ( (type->tp_dictoffset != 0) || (!type->tp_mro) ) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    names = PyList_New(0);
+    if (!names)
+        return NULL;
+
+    for (i = PyTuple_GET_SIZE(type->tp_mro) - 1; i >= 0; i--) {
+        /* the tp_dict of builtin types is per interpreter as of 3.12 */
+#if PY_VERSION_HEX >= 0x030C0000
+        dict = PyType_GetDict((PyTypeObject *)(PyTuple_GET_ITEM(type->tp_mro, i)));
+        slots = PyDict_GetItemString(dict, "__slots__");
+        Py_XINCREF(slots);
+        Py_DECREF(dict);
+#else
+        dict = ((PyTypeObject *)(PyTuple_GET_ITEM(type->tp_mro, i)))->tp_dict;
+        slots = PyDict_GetItemString(dict, "__slots__");
+        Py_XINCREF(slots);
+#endif
+        if (!slots)
+            continue;
+        found = 1;
+
+        /* a lone string is the name of a single slot */
+        if ( (PyUnicode_Check(slots)) || (PyString_Check(slots)) ) {
+            rc = AppendSlot(names, slots);
+            Py_DECREF(slots);
+            if (rc)
+                goto exit;
+            continue;
+        }
+
+        iterator = PyObject_GetIter(slots);
+        Py_DECREF(slots);
+        if (!iterator)
+            goto exit;
+        while ((item = PyIter_Next(iterator))) {
+            rc = AppendSlot(names, item);
+            Py_DECREF(item);
+            if (rc)
+                break;
+        }
+        Py_DECREF(iterator);
+        if (PyErr_Occurred())
+            goto exit;
+    }
+
+    if (found) {
+        result = PyList_AsTuple(names);
+    } else {
+        Py_INCREF(Py_None);
+        result = Py_None;
+    }
+
+  exit:
+    Py_DECREF(names);
+    return result;
+}
+
+/*
+ * Returns a new reference to the tuple of field names to encode `object`
+ * with, or to None if it isn't a dataclass, namedtuple or __slots__ object
+ */
+static PyObject *ObjectFields(py_yajl_encstate *state, PyObject *object)
+{
+    PyObject *cache = state->module->fieldcache;
+    PyObject *type = (PyObject *)(Py_TYPE(object));
+    PyObject *fields = NULL;
+    PyObject *names = NULL;
+
+#ifdef Py_GIL_DISABLED
+    /* another thread may clear the cache before a borrowed one is used */
+    if (PyDict_GetItemRef(cache, type, &fields) < 0)
+        return NULL;
+    if (fields)
+        return fields;
+#else
+    fields = PyDict_GetItem(cache, type);
+    if (fields) {
+        Py_INCREF(fields);
+        return fields;
+    }
+#endif
+
+    if (PyObject_HasAttrString(type, "__dataclass_fields__")) {
+        fields = DataclassFields(type);
+    } else if ( (PyTuple_Check(object)) && (PyObject_HasAttrString(type, "_fields")) ) {
+        names = PyObject_GetAttrString(type, "_fields");
+        if (names) {
+            fields = PySequence_Tuple(names);
+            Py_DECREF(names);
+        }
+    } else {
+        fields = SlotNames((PyTypeObject *)(type));
+    }
+    if (!fields)
+        return NULL;
+
+    /* classes created on the fly shouldn't grow the cache forever */
+    if (PyDict_Size(cache) >= PY_YAJL_FIELDCACHE_MAX)
+        PyDict_Clear(cache);
+    if (PyDict_SetItem(cache, type, fields)) {
+        Py_DECREF(fields);
+        return NULL;
+    }
+    return fields;
+}
+
+/*
+ * Containers are encoded iteratively rather than recursively: opening one
+ * pushes a frame for it onto the frame stack of the encode, and EncodeObject()
+ * keeps handing the children of the innermost open container to
+ * ProcessObject() until it's exhausted and can be closed
+ */
+static yajl_gen_status PushContainer(py_yajl_encstate *state, PyObject *object,
+        PyObject *extra, int kind)
+{
+    yajl_gen handle = (yajl_gen)(state->generator);
+    py_yajl_encframestack *frames = &(state->frames);
+    py_yajl_encframe frame;
+    yajl_gen_status status;
+    unsigned int i;
+
+    /*
+     * A container which is already open is being nested within itself,
+     * which would otherwise only fail once yajl's depth limit is reached
+     */
+    for (i = 0; i < py_yajl_ps_length(*frames); i++) {
+        if (py_yajl_ps_at(*frames, i).object == object) {
+            Py_XDECREF(extra);
+            PyErr_SetString(PyExc_ValueError, "Circular reference detected");
+            return yajl_gen_in_error_state;
+        }
+    }
+
+    if ( (kind == py_yajl_enc_sequence) || (kind == py_yajl_enc_iterator) )
+        status = yajl_gen_array_open(handle);
+    else
+        status = yajl_gen_map_open(handle);
+    if (status != yajl_gen_status_ok) {
+        Py_XDECREF(extra);
+        return status;
+    }
+
+    frame.object = object;
+    frame.extra = extra;
+    frame.position = 0;
+    frame.kind = kind;
+    if (!py_yajl_ps_push(*frames, frame)) {
+        Py_XDECREF(extra);
+        return yajl_gen_in_error_state;
+    }
+    Py_INCREF(object);
+    return yajl_gen_status_ok;
+}
+
+/*
+ * Emit the key of the next child of the container `frame` (for containers
+ * with keys) and return a new reference to the child; returns NULL once
+ * the container is exhausted, or on error with an exception set or a
+ * `status` other than yajl_gen_status_ok
+ */
+static PyObject *NextChild(py_yajl_encstate *state, py_yajl_encframe *frame,
+        yajl_gen_status *status)
+{
+    PyObject *key = NULL;
+    PyObject *value = NULL;
+    _YajlRecord *record = NULL;
+
+    switch (frame->kind) {
+        case py_yajl_enc_sequence:
+            if (PyList_Check(frame->object)) {
+                if (frame->position >= PyList_GET_SIZE(frame->object))
+                    return NULL;
+                value = PyList_GET_ITEM(frame->object, frame->position++);
+            } else {
+                if (frame->position >= PyTuple_GET_SIZE(frame->object))
+                    return NULL;
+                value = PyTuple_GET_ITEM(frame->object, frame->position++);
+            }
+            Py_INCREF(value);
+            return value;
+
+        case py_yajl_enc_iterator:
+            return PyIter_Next(frame->extra);
+
+        case py_yajl_enc_dict:
+            if (!PyDict_Next(frame->object, &frame->position, &key, &value))
+                return NULL;
+            break;
+
+        case py_yajl_enc_record:
+            record = (_YajlRecord *)(frame->object);
+            if (frame->position >= Py_SIZE(record))
+                return NULL;
+            key = PyTuple_GET_ITEM(record->keys, frame->position);
+            value = record->values[frame->position++];
+            break;
+
+        case py_yajl_enc_fields:
+            /* unset slots are left out */
+            while (frame->position < PyTuple_GET_SIZE(frame->extra)) {
+                key = PyTuple_GET_ITEM(frame->extra, frame->position);
+                if (PyTuple_Check(frame->object)) {
+                    if (frame->position >= PyTuple_GET_SIZE(frame->object))
+                        return NULL;
+                    value = PyTuple_GET_ITEM(frame->object, frame->position++);
+                    Py_INCREF(value);
+                } else {
+                    frame->position++;
+                    value = PyObject_GetAttr(frame->object, key);
+                    if (!value) {
+                        if (!PyErr_ExceptionMatches(PyExc_AttributeError))
+                            return NULL;
+                        PyErr_Clear();
+                        continue;
+                    }
+                }
+                *status = ProcessKey(state, key);
+                if (*status != yajl_gen_status_ok) {
+                    Py_DECREF(value);
+                    return NULL;
+                }
+                return value;
+            }
+            return NULL;
+    }
+
+    /* dicts and records, whose keys and values are borrowed */
+    Py_INCREF(key);
+    Py_INCREF(value);
+    *status = ProcessKey(state, key);
+    Py_DECREF(key);
+    if (*status != yajl_gen_status_ok) {
+        Py_DECREF(value);
+        return NULL;
+    }
+    return value;
+}
+
+static void PopContainer(py_yajl_encstate *state)
+{
+    py_yajl_encframestack *frames = &(state->frames);
+
+    Py_DECREF(py_yajl_ps_current(*frames).object);
+    Py_XDECREF(py_yajl_ps_current(*frames).extra);
+    py_yajl_ps_pop(*frames);
+}
+
+static yajl_gen_status EncodeObject(py_yajl_encstate *state, PyObject *object)
+{
+    yajl_gen handle = (yajl_gen)(state->generator);
+    py_yajl_encframestack *frames = &(state->frames);
+    py_yajl_encframe *frame = NULL;
+    yajl_gen_status status;
+    PyObject *child = NULL;
+    int kind;
+
+    status = ProcessObject(state, object);
+    while ( (status == yajl_gen_status_ok) && (py_yajl_ps_length(*frames) > 0) ) {
+        /* processing a child may have moved the stack */
+        frame = &(py_yajl_ps_at(*frames, py_yajl_ps_length(*frames) - 1));
+
+        child = NextChild(state, frame, &status);
+        if (child) {
+            status = ProcessObject(state, child);
+            Py_DECREF(child);
+            continue;
+        }
+        if (status != yajl_gen_status_ok)
+            break;
+        if (PyErr_Occurred()) {
+            status = yajl_gen_in_error_state;
+            break;
+        }
+
+        kind = py_yajl_ps_current(*frames).kind;
+        PopContainer(state);
+        if ( (kind == py_yajl_enc_sequence) || (kind == py_yajl_enc_iterator) )
+            status = yajl_gen_array_close(handle);
+        else
+            status = yajl_gen_map_close(handle);
+    }
+
+    /* drop whatever was left open by an error */
+    while (py_yajl_ps_length(*frames) > 0) {
+        PopContainer(state);
+    }
+    return status;
+}
+
+/*
+ * Emit `object` if it's a scalar, or open it and push a frame for it if
+ * it's a container
+ */
+static yajl_gen_status ProcessObject(py_yajl_encstate *state, PyObject *object)
+{
+    yajl_gen handle = (yajl_gen)(state->generator);
+    yajl_gen_status status = yajl_gen_in_error_state;
+    PyObject *iterator = NULL;
 
     if (object == Py_None) {
         return yajl_gen_null(handle);
@@ -60,89 +955,12 @@ static yajl_gen_status ProcessObject(_YajlEncoder *self, PyObject *object)
         return yajl_gen_bool(handle, 0);
     }
     if (PyUnicode_Check(object)) {
-        Py_ssize_t length = PyUnicode_GET_SIZE(object);
-        Py_UNICODE *raw_unicode = PyUnicode_AS_UNICODE(object);
-        /*
-         * Create a buffer with enough space for code-points, preceeding and
-         * following quotes and a null termination character
-         */
-        char *buffer = (char *)(malloc(sizeof(char) * (1 + length * 6)));
-        unsigned int offset = 0;
-
-        while (length-- > 0) {
-            Py_UNICODE ch = *raw_unicode++;
-
-            /* Escape escape characters */
-            switch (ch) {
-                case '\t':
-                    buffer[offset++] = '\\';
-                    buffer[offset++] = 't';
-                    continue;
-                    break;
-                case '\n':
-                    buffer[offset++] = '\\';
-                    buffer[offset++] = 'n';
-                    continue;
-                    break;
-                case '\r':
-                    buffer[offset++] = '\\';
-                    buffer[offset++] = 'r';
-                    continue;
-                    break;
-                case '\f':
-                    buffer[offset++] = '\\';
-                    buffer[offset++] = 'f';
-                    continue;
-                    break;
-                case '\b':
-                    buffer[offset++] = '\\';
-                    buffer[offset++] = 'b';
-                    continue;
-                    break;
-                case '\\':
-                    buffer[offset++] = '\\';
-                    buffer[offset++] = '\\';
-                    continue;
-                    break;
-                case '\"':
-                    buffer[offset++] = '\\';
-                    buffer[offset++] = '\"';
-                    continue;
-                    break;
-                default:
-                    break;
-            }
+        unsigned int length = 0;
+        char *buffer = EscapeUnicode(object, &length, state->encoder->ensure_ascii);
 
-            /* Map 16-bit characters to '\uxxxx' */
-            if (ch >= 256) {
-                buffer[offset++] = '\\';
-                buffer[offset++] = 'u';
-                buffer[offset++] = hexdigit[(ch >> 12) & 0x000F];
-                buffer[offset++] = hexdigit[(ch >> 8) & 0x000F];
-                buffer[offset++] = hexdigit[(ch >> 4) & 0x000F];
-                buffer[offset++] = hexdigit[ch & 0x000F];
-                continue;
-            }
-
-            /* Map non-printable US ASCII to '\u00hh' */
-            if ( (ch < 0x20) || (ch >= 0x7F) ) {
-                buffer[offset++] = '\\';
-                buffer[offset++] = 'u';
-                buffer[offset++] = '0';
-                buffer[offset++] = '0';
-                buffer[offset++] = hexdigit[(ch >> 4) & 0x0F];
-                buffer[offset++] = hexdigit[ch & 0x0F];
-                continue;
-            }
-
-            /* Handle proper ascii chars */
-            if ( (ch >= 0x20) && (ch < 0x7F) ) {
-                buffer[offset++] = (char)(ch);
-                continue;
-            }
-        }
-        buffer[offset] = '\0';
-        status = yajl_gen_raw_string(handle, (const unsigned char *)(buffer), (unsigned int)(offset));
+        if (!buffer)
+            return yajl_gen_in_error_state;
+        status = yajl_gen_raw_string(handle, (const unsigned char *)(buffer), length);
         free(buffer);
         return status;
     }
@@ -154,7 +972,24 @@ static yajl_gen_status ProcessObject(_YajlEncoder *self, PyObject *object)
         const unsigned char *buffer = NULL;
         Py_ssize_t length;
 #ifdef IS_PYTHON3
+        Py_ssize_t i;
+
         PyBytes_AsStringAndSize(object, (char **)&buffer, &length);
+        for (i = 0; (i < length) && (!(buffer[i] & 0x80)); i++)
+            ;
+        if (i < length) {
+            /*
+             * The output can't be built as an ASCII str after all, and has
+             * to be valid UTF-8 whether it's returned as str or bytes
+             */
+            PyObject *decoded = PyUnicode_DecodeUTF8((const char *)(buffer) + i,
+                    length - i, "strict");
+
+            if (!decoded)
+                return yajl_gen_in_error_state;
+            Py_DECREF(decoded);
+            state->nonascii = 1;
+        }
 #else
         PyString_AsStringAndSize(object, (char **)&buffer, &length);
 #endif
@@ -171,109 +1006,230 @@ static yajl_gen_status ProcessObject(_YajlEncoder *self, PyObject *object)
 #endif
     if (PyLong_Check(object)) {
         long long number = PyLong_AsLongLong(object);
-        char *buffer = NULL;
 
         if ( (number == -1) && (PyErr_Occurred()) ) {
             return yajl_gen_in_error_state;;
         }
-
-        /*
-         * Nifty trick for getting the buffer length of a long long, going
-         * to convert this long long into a buffer to be handled by
-         * yajl_gen_number()
-         */
-        unsigned int length = (unsigned int)(snprintf(NULL, 0, "%lld", number)) + 1;
-        buffer = (char *)(malloc(length));
-        snprintf(buffer, length, "%lld", number);
-        return yajl_gen_number(handle, buffer, length - 1);
+        return GenInteger(handle, number);
     }
     if (PyFloat_Check(object)) {
         return yajl_gen_double(handle, PyFloat_AsDouble(object));
     }
+    if ( (PyList_CheckExact(object)) || (PyTuple_CheckExact(object)) ) {
+        return PushContainer(state, object, NULL, py_yajl_enc_sequence);
+    }
+    if (PyDict_Check(object)) {
+        return PushContainer(state, object, NULL, py_yajl_enc_dict);
+    }
+    if (state->encoder->native_types) {
+        int handled = 0;
+
+        status = ProcessNativeType(state, object, &handled);
+        if (handled)
+            return status;
+    }
+    if (state->encoder->native_objects) {
+        PyObject *fields = ObjectFields(state, object);
+
+        if (!fields)
+            return yajl_gen_in_error_state;
+        if (fields != Py_None)
+            return PushContainer(state, object, fields, py_yajl_enc_fields);
+        Py_DECREF(fields);
+    }
     if (PyList_Check(object)||PyGen_Check(object)||PyTuple_Check(object)) {
-        /*
-         * Recurse and handle the list
-         */
         iterator = PyObject_GetIter(object);
         if (iterator == NULL)
-            goto exit;
-        status = yajl_gen_array_open(handle);
-        if (status == yajl_max_depth_exceeded) {
-            Py_XDECREF(iterator);
-            goto exit;
-        }
-        while ((item = PyIter_Next(iterator))) {
-            status = ProcessObject(self, item);
-            Py_XDECREF(item);
-        }
-        Py_XDECREF(iterator);
-        yajl_gen_status close_status = yajl_gen_array_close(handle);
-        if (status == yajl_gen_in_error_state)
+            return yajl_gen_in_error_state;
+        return PushContainer(state, object, iterator, py_yajl_enc_iterator);
+    }
+#if PY_VERSION_HEX >= 0x02060000
+    /* bytearrays are binary data rather than numbers */
+    if ( (PyObject_CheckBuffer(object)) && (!PyByteArray_Check(object)) ) {
+        int handled = 0;
+
+        status = ProcessBuffer(state, object, &handled);
+        if (handled)
             return status;
-        return close_status;
     }
-    if (PyDict_Check(object)) {
-        PyObject *key, *value;
-        Py_ssize_t position = 0;
+#endif
+    if (PyObject_TypeCheck(object, state->module->record_type)) {
+        return PushContainer(state, object, NULL, py_yajl_enc_record);
+    }
 
-        status = yajl_gen_map_open(handle);
-        if (status == yajl_max_depth_exceeded) goto exit;
-        while (PyDict_Next(object, &position, &key, &value)) {
-            PyObject *newKey = key;
+    /* default() returning objects it'll be called with again must not loop */
+    if (Py_EnterRecursiveCall(" while encoding a JSON object"))
+        return yajl_gen_in_error_state;
+    PY_YAJL_STAT(state->module, default_calls, 1);
+    object = PyObject_CallMethod((PyObject *)(state->encoder), "default", "O", object);
+    if (object) {
+        status = ProcessObject(state, object);
+        Py_DECREF(object);
+    }
+    Py_LeaveRecursiveCall();
+    return status;
+}
+
+/*
+ * Keys which can be safely looked up in the per-encode key cache; floats
+ * and int subclasses (i.e. bool) are left out since they compare equal to
+ * ints while stringifying differently
+ */
+#ifdef IS_PYTHON3
+#define IS_CACHEABLE_KEY(key) (PyUnicode_CheckExact(key) || PyLong_CheckExact(key))
+#else
+#define IS_CACHEABLE_KEY(key) (PyUnicode_CheckExact(key) || PyLong_CheckExact(key) \
+        || PyInt_CheckExact(key))
+#endif
 
-            if ( (PyFloat_Check(key)) ||
+/*
+ * Emit a dict key, reusing the escaped form of keys we've already seen
+ * during this encode, which saves repeatedly escaping (and for numeric keys
+ * stringifying) the same keys when encoding lists of similar dicts
+ */
+static yajl_gen_status ProcessKey(py_yajl_encstate *state, PyObject *key)
+{
+    yajl_gen handle = (yajl_gen)(state->generator);
+    yajl_gen_status status;
+    PyObject *cache = state->keycache;
+    PyObject *newKey = key;
+    PyObject *escaped = NULL;
+    unsigned int length = 0;
+    unsigned int frames = 0;
+    char *buffer = NULL;
+
+    if ( (cache) && (IS_CACHEABLE_KEY(key)) ) {
+        escaped = PyDict_GetItem(cache, key);
+        if (escaped) {
+            return yajl_gen_raw_string(handle,
+                    (const unsigned char *)(PyString_AS_STRING(escaped)),
+                    (unsigned int)(PyString_GET_SIZE(escaped)));
+        }
+    }
+
+    if ( (PyFloat_Check(key)) ||
 #ifndef IS_PYTHON3
-                (PyInt_Check(key)) ||
+        (PyInt_Check(key)) ||
 #endif
-                (PyLong_Check(key)) ) {
+        (PyLong_Check(key)) ) {
 
-                /*
-                 * Performing the conversion separately for Python 2
-                 * and Python 3 to ensure we consistently generate
-                 * unicode strings in both versions
-                 */
+        /*
+         * Performing the conversion separately for Python 2
+         * and Python 3 to ensure we consistently generate
+         * unicode strings in both versions
+         */
 #ifdef IS_PYTHON3
-                newKey = PyObject_Str(key);
+        newKey = PyObject_Str(key);
 #else
-                newKey = PyObject_Unicode(key);
+        newKey = PyObject_Unicode(key);
 #endif
-            }
-
-            status = ProcessObject(self, newKey);
-            if (key != newKey) {
-                Py_XDECREF(newKey);
-            }
-            if (status == yajl_gen_in_error_state) return status;
-            if (status == yajl_max_depth_exceeded) goto exit;
+        if (!newKey)
+            return yajl_gen_in_error_state;
+    }
 
-            status = ProcessObject(self, value);
-            if (status == yajl_gen_in_error_state) return status;
-            if (status == yajl_max_depth_exceeded) goto exit;
+    if (!PyUnicode_Check(newKey)) {
+        frames = py_yajl_ps_length(state->frames);
+        status = ProcessObject(state, newKey);
+        if (key != newKey) {
+            Py_XDECREF(newKey);
         }
-        return yajl_gen_map_close(handle);
-    }
-    else {
-        object =  PyObject_CallMethod((PyObject *)self, "default", "O", object);
-        if (object==NULL)
-            goto exit;
-        status = ProcessObject(self, object);
+        /* yajl should've refused to open a container as a key */
+        if (py_yajl_ps_length(state->frames) != frames)
+            return yajl_gen_keys_must_be_strings;
         return status;
     }
 
+    buffer = EscapeUnicode(newKey, &length, state->encoder->ensure_ascii);
+    if (key != newKey) {
+        Py_XDECREF(newKey);
+    }
+    if (!buffer)
+        return yajl_gen_in_error_state;
 
+    if ( (cache) && (IS_CACHEABLE_KEY(key)) &&
+            (PyDict_Size(cache) < PY_YAJL_KEYCACHE_MAX) ) {
+        escaped = PyString_FromStringAndSize(buffer, (Py_ssize_t)(length));
+        if ( (!escaped) || (PyDict_SetItem(cache, key, escaped)) ) {
+            /* the cache is only an optimization, carry on without it */
+            PyErr_Clear();
+        }
+        Py_XDECREF(escaped);
+    }
 
-    exit:
-        return yajl_gen_in_error_state;
+    status = yajl_gen_raw_string(handle, (const unsigned char *)(buffer), length);
+    free(buffer);
+    return status;
 }
 
-yajl_alloc_funcs *y_allocs = NULL;
 /* a structure used to pass context to our printer function */
 struct StringAndUsedCount
 {
     PyObject * str;
     size_t used;
+    /* the contents of `str` and their size, kept to spare the lookups */
+    char * buffer;
+    size_t size;
+    /* `str` is a compact ASCII str being filled in place, rather than bytes */
+    int ascii_str;
+    /* non-ASCII bytes were output, set once the encode is done */
+    int nonascii;
+    /*
+     * When encoding into a caller's buffer `str` is NULL and `buffer` points
+     * `offset` bytes into it; a bytearray `target` is grown as need be,
+     * anything else overflowing just has `used` go on counting
+     */
+    PyObject * target;
+    Py_ssize_t offset;
+    /* the state of the encoder's module */
+    py_yajl_module_state * module;
 };
 
+/* Point `buffer` and `size` at the contents of `str`, once it's (re)allocated */
+static void TrackOutput(struct StringAndUsedCount *sauc)
+{
+    if (!sauc->str) {
+        sauc->buffer = NULL;
+        return;
+    }
+#if PY_VERSION_HEX >= 0x03030000
+    if (sauc->ascii_str) {
+        sauc->buffer = (char *)(PyUnicode_1BYTE_DATA(sauc->str));
+        sauc->size = (size_t)(PyUnicode_GET_LENGTH(sauc->str));
+        return;
+    }
+#endif
+#ifdef IS_PYTHON3
+    sauc->buffer = PyBytes_AS_STRING(sauc->str);
+#else
+    sauc->buffer = PyString_AS_STRING(sauc->str);
+#endif
+    sauc->size = (size_t)(Py_SIZE(sauc->str));
+}
+
+#if PY_VERSION_HEX >= 0x02060000
+/*
+ * Make room for `len` more bytes in a caller's bytearray, which default()
+ * may have resized behind our back in the meantime
+ */
+static void TrackByteArray(struct StringAndUsedCount *sauc, unsigned int len)
+{
+    Py_ssize_t size = PyByteArray_GET_SIZE(sauc->target);
+
+    if ( (size < sauc->offset) ||
+            ((size_t)(size - sauc->offset) < sauc->used + len) ) {
+        if (PyByteArray_Resize(sauc->target,
+                    sauc->offset + (Py_ssize_t)(sauc->used + len)) < 0) {
+            sauc->buffer = NULL;
+            return;
+        }
+        PY_YAJL_STAT(sauc->module, buffer_resizes, 1);
+        size = PyByteArray_GET_SIZE(sauc->target);
+    }
+    sauc->buffer = PyByteArray_AS_STRING(sauc->target) + sauc->offset;
+    sauc->size = (size_t)(size - sauc->offset);
+}
+#endif
+
 static void py_yajl_printer(void * ctx,
                             const char * str,
                             unsigned int len)
@@ -281,28 +1237,46 @@ static void py_yajl_printer(void * ctx,
     struct StringAndUsedCount * sauc = (struct StringAndUsedCount *) ctx;
     size_t newsize;
 
-    if (!sauc || !sauc->str) return;
+    if (!sauc || !sauc->buffer) return;
+
+#if PY_VERSION_HEX >= 0x02060000
+    if (sauc->target) {
+        TrackByteArray(sauc, len);
+        if (!sauc->buffer)
+            return;
+    }
+#endif
 
     /* resize our string if necc */
-    newsize = Py_SIZE(sauc->str);
-    while (sauc->used + len > newsize) newsize *= 2;
-    if (newsize != Py_SIZE(sauc->str)) {
+    if (sauc->used + len > sauc->size) {
+        if (!sauc->str) {
+            /* out of room in the caller's buffer */
+            sauc->used += len;
+            return;
+        }
+        newsize = sauc->size;
+        while (sauc->used + len > newsize) newsize *= 2;
+#if PY_VERSION_HEX >= 0x03030000
+        if (sauc->ascii_str) {
+            /* a failed resize has already disposed of the str */
+            if (PyUnicode_Resize(&(sauc->str), newsize) < 0)
+                sauc->str = NULL;
+        } else
+#endif
 #ifdef IS_PYTHON3
         _PyBytes_Resize(&(sauc->str), newsize);
 #else
         _PyString_Resize(&(sauc->str), newsize);
 #endif
+        TrackOutput(sauc);
         if (!sauc->str)
             return;
+        PY_YAJL_STAT(sauc->module, buffer_resizes, 1);
     }
 
     /* and append data if available */
     if (len && str) {
-#ifdef IS_PYTHON3
-        memcpy((void *)(((PyBytesObject *)sauc->str)->ob_sval + sauc->used), str, len);
-#else
-        memcpy((void *) (((PyStringObject *) sauc->str)->ob_sval + sauc->used), str, len);
-#endif
+        memcpy((void *)(sauc->buffer + sauc->used), str, len);
         sauc->used += len;
     }
 }
@@ -311,10 +1285,8 @@ static void py_yajl_printer(void * ctx,
 static PyObject * lowLevelStringAlloc(Py_ssize_t size)
 {
 #ifdef IS_PYTHON3
-    PyBytesObject * op = (PyBytesObject *)PyObject_MALLOC(sizeof(PyBytesObject) + size);
-    if (op) {
-        PyObject_INIT_VAR(op, &PyBytes_Type, size);
-    }
+    /* these may be handed out as they are, so need a proper (unset) hash */
+    PyObject * op = PyBytes_FromStringAndSize(NULL, size);
 #else
     PyStringObject * op = (PyStringObject *)PyObject_MALLOC(sizeof(PyStringObject) + size);
     if (op) {
@@ -326,34 +1298,67 @@ static PyObject * lowLevelStringAlloc(Py_ssize_t size)
     return (PyObject *) op;
 }
 
-PyObject *_internal_encode(_YajlEncoder *self, PyObject *obj, yajl_gen_config genconfig)
+/*
+ * The output buffer starts out at `size_hint` bytes if given, and otherwise
+ * a little over the size this encoder's output has been averaging
+ */
+static Py_ssize_t OutputSize(_YajlEncoder *self, Py_ssize_t size_hint)
 {
-    yajl_gen generator = NULL;
-    yajl_gen_status status;
-    struct StringAndUsedCount sauc;
-#ifdef IS_PYTHON3
-    PyObject *result = NULL;
-#endif
+    Py_ssize_t size = size_hint;
+    Py_ssize_t estimate = PY_YAJL_LOAD_ESTIMATE(&(self->_size_estimate));
 
-    /* initialize context for our printer function which
-     * performs low level string appending, using the python
-     * string implementation as a chunked growth buffer */
-    sauc.used = 0;
-    sauc.str = lowLevelStringAlloc(PY_YAJL_CHUNK_SZ);
+    if (size == 0) {
+        size = estimate + (estimate / 8);
+        if (size > PY_YAJL_ESTIMATE_MAX)
+            size = PY_YAJL_ESTIMATE_MAX;
+    }
+    if (size < PY_YAJL_CHUNK_SZ)
+        size = PY_YAJL_CHUNK_SZ;
+    return size;
+}
 
-    generator = yajl_gen_alloc2(py_yajl_printer, &genconfig, NULL, (void *) &sauc);
+/* Count an encode of `used` bytes which began at `start` */
+static void CountEncode(py_yajl_module_state *module, size_t used, long long start)
+{
+    PY_YAJL_STAT(module, encoded_documents, 1);
+    PY_YAJL_STAT(module, encoded_bytes, (long long)(used));
+    PY_YAJL_LATENCY(module, encode_latency, start);
+}
 
-    self->_generator = generator;
+/*
+ * Generate `obj` through the printer context `sauc`, whose `module` must
+ * be set; returns failure with an exception set if it couldn't be encoded
+ */
+static int RunEncode(_YajlEncoder *self, PyObject *obj, yajl_gen_config genconfig,
+        struct StringAndUsedCount *sauc)
+{
+    yajl_gen_status status;
+    py_yajl_encstate state;
+    Py_ssize_t estimate;
 
-    status = ProcessObject(self, obj);
+    state.encoder = self;
+    state.module = sauc->module;
+    state.generator = yajl_gen_alloc2(py_yajl_printer, &genconfig, NULL, (void *) sauc);
+    state.keycache = PyDict_New();
+    py_yajl_ps_init(state.frames);
+    state.nonascii = 0;
+    state.uuid_type = NULL;
+    state.decimal_type = NULL;
 
-    yajl_gen_free(generator);
-    self->_generator = NULL;
+    status = EncodeObject(&state, obj);
+    sauc->nonascii = state.nonascii;
 
-    /* if resize failed inside our printer function we'll have a null sauc.str */
-    if (!sauc.str) {
-        PyErr_SetObject(PyExc_ValueError, PyUnicode_FromString("Allocation failure"));
-        return NULL;
+    yajl_gen_free((yajl_gen)(state.generator));
+    py_yajl_ps_free(state.frames);
+    Py_XDECREF(state.keycache);
+    Py_XDECREF(state.uuid_type);
+    Py_XDECREF(state.decimal_type);
+
+    /* if resize failed inside our printer function we'll have a null sauc->buffer */
+    if (!sauc->buffer) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, "Allocation failure");
+        return failure;
     }
 
     if ( (status == yajl_gen_in_error_state) ||
@@ -363,29 +1368,155 @@ PyObject *_internal_encode(_YajlEncoder *self, PyObject *obj, yajl_gen_config ge
          * instead
          */
         if (!PyErr_Occurred()) {
-            PyErr_SetObject(PyExc_TypeError, PyUnicode_FromString("Object is not JSON serializable"));
+            PyErr_SetString(PyExc_TypeError, "Object is not JSON serializable");
         }
+        return failure;
+    }
+
+    estimate = PY_YAJL_LOAD_ESTIMATE(&(self->_size_estimate));
+    if (estimate == 0)
+        estimate = (Py_ssize_t)(sauc->used);
+    else
+        estimate += ((Py_ssize_t)(sauc->used) - estimate) / 4;
+    PY_YAJL_STORE_ESTIMATE(&(self->_size_estimate), estimate);
+    return success;
+}
+
+/*
+ * Encode `obj`, returning bytes if `as_bytes` is set and a str otherwise;
+ * on Python 3.3+ an ASCII str is generated in place unless non-ASCII
+ * output is expected or turns up, in which case it's decoded as UTF-8
+ */
+PyObject *_internal_encode(_YajlEncoder *self, PyObject *obj, yajl_gen_config genconfig,
+        int as_bytes, Py_ssize_t size_hint)
+{
+    struct StringAndUsedCount sauc;
+    PyObject *result = NULL;
+    long long start = PY_YAJL_CLOCK();
+
+    if (size_hint < 0) {
+        PyErr_SetString(PyExc_ValueError, "size_hint must not be negative");
+        return NULL;
+    }
+    sauc.module = _internal_module_state(Py_TYPE(self));
+    if (!sauc.module)
+        return NULL;
+
+    /* initialize context for our printer function which
+     * performs low level string appending, using the python
+     * string implementation as a chunked growth buffer */
+    sauc.used = 0;
+    sauc.ascii_str = 0;
+    sauc.target = NULL;
+    sauc.offset = 0;
+#if PY_VERSION_HEX >= 0x03030000
+    sauc.ascii_str = ( (!as_bytes) && (self->ensure_ascii) );
+    if (sauc.ascii_str)
+        sauc.str = PyUnicode_New(OutputSize(self, size_hint), 127);
+    else
+#endif
+        sauc.str = lowLevelStringAlloc(OutputSize(self, size_hint));
+    TrackOutput(&sauc);
+
+    if (!RunEncode(self, obj, genconfig, &sauc)) {
         Py_XDECREF(sauc.str);
         return NULL;
     }
 
 #ifdef IS_PYTHON3
-    result = PyUnicode_DecodeUTF8(((PyBytesObject *)sauc.str)->ob_sval, sauc.used, "strict");
-    Py_XDECREF(sauc.str);
-    return result;
+    if (as_bytes) {
+        _PyBytes_Resize(&sauc.str, sauc.used);
+        result = sauc.str;
+#if PY_VERSION_HEX >= 0x03030000
+    } else if ( (sauc.ascii_str) && (!sauc.nonascii) ) {
+        if (PyUnicode_Resize(&sauc.str, sauc.used) == 0)
+            result = sauc.str;
+#endif
+    } else {
+        result = PyUnicode_DecodeUTF8(sauc.buffer, sauc.used, "strict");
+        Py_XDECREF(sauc.str);
+    }
 #else
     /* truncate to used size, and resize will handle the null plugging */
     _PyString_Resize(&sauc.str, sauc.used);
-    return sauc.str;
+    result = sauc.str;
 #endif
+
+    if (result)
+        CountEncode(sauc.module, sauc.used, start);
+    return result;
+}
+
+#if PY_VERSION_HEX >= 0x02060000
+/*
+ * Encode `obj` as UTF-8 into the writable buffer `target`, starting
+ * `offset` bytes in; bytearrays are grown to fit, other buffers running
+ * out of room raise ValueError. Returns the number of bytes written, or
+ * -1 on error
+ */
+Py_ssize_t _internal_encode_into(_YajlEncoder *self, PyObject *obj,
+        yajl_gen_config genconfig, PyObject *target, Py_ssize_t offset)
+{
+    struct StringAndUsedCount sauc;
+    Py_buffer view;
+    int is_bytearray = PyByteArray_Check(target);
+    int rc;
+    long long start = PY_YAJL_CLOCK();
+
+    sauc.module = _internal_module_state(Py_TYPE(self));
+    if (!sauc.module)
+        return -1;
+    sauc.str = NULL;
+    sauc.used = 0;
+    sauc.ascii_str = 0;
+    sauc.target = NULL;
+    sauc.offset = offset;
+
+    if (is_bytearray) {
+        /* holding on to a view would keep us from resizing it */
+        view.len = PyByteArray_GET_SIZE(target);
+        sauc.target = target;
+    } else if (PyObject_GetBuffer(target, &view, PyBUF_WRITABLE)) {
+        return -1;
+    }
+
+    if ( (offset < 0) || (offset > view.len) ) {
+        PyErr_SetString(PyExc_ValueError, "offset is out of the buffer's range");
+        if (!is_bytearray)
+            PyBuffer_Release(&view);
+        return -1;
+    }
+
+    if (is_bytearray) {
+        sauc.buffer = PyByteArray_AS_STRING(target) + offset;
+    } else {
+        sauc.buffer = (char *)(view.buf) + offset;
+    }
+    sauc.size = (size_t)(view.len - offset);
+
+    rc = RunEncode(self, obj, genconfig, &sauc);
+    if (!is_bytearray)
+        PyBuffer_Release(&view);
+    if (!rc)
+        return -1;
+
+    if (sauc.used > sauc.size) {
+        PyErr_Format(PyExc_ValueError,
+                "Encoding needs %zd bytes, but only %zd are available in the buffer",
+                (Py_ssize_t)(sauc.used), (Py_ssize_t)(sauc.size));
+        return -1;
+    }
+    CountEncode(sauc.module, sauc.used, start);
+    return (Py_ssize_t)(sauc.used);
 }
+#endif
 
 PyObject *py_yajlencoder_default(PYARGS)
 {
     PyObject *value;
     if (!PyArg_ParseTuple(args, "O", &value))
         return NULL;
-    PyErr_SetObject(PyExc_TypeError, PyUnicode_FromString("Not serializable to JSON"));
+    PyErr_SetString(PyExc_TypeError, "Not serializable to JSON");
     return NULL;
 }
 
@@ -394,24 +1525,89 @@ PyObject *py_yajlencoder_encode(PYARGS)
     _YajlEncoder *encoder = (_YajlEncoder *)(self);
     yajl_gen_config config = {0, NULL};
     PyObject *value;
+    Py_ssize_t size_hint = 0;
+    static char *kwlist[] = {"obj", "size_hint", NULL};
 
-    if (!PyArg_ParseTuple(args, "O", &value))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|n", kwlist, &value, &size_hint))
         return NULL;
-    return _internal_encode(encoder, value, config);
+    return _internal_encode(encoder, value, config, 0, size_hint);
+}
+
+PyObject *py_yajlencoder_encodeb(PYARGS)
+{
+    _YajlEncoder *encoder = (_YajlEncoder *)(self);
+    yajl_gen_config config = {0, NULL};
+    PyObject *value;
+    Py_ssize_t size_hint = 0;
+    static char *kwlist[] = {"obj", "size_hint", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|n", kwlist, &value, &size_hint))
+        return NULL;
+    return _internal_encode(encoder, value, config, 1, size_hint);
+}
+
+/*
+ * The defaults are set here rather than in __init__(), which subclasses
+ * may well not call
+ */
+PyObject *yajlencoder_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    _YajlEncoder *me = (_YajlEncoder *)(PyType_GenericNew(type, args, kwargs));
+    PyObject *method = NULL;
+
+    if (!me)
+        return NULL;
+
+    me->ensure_ascii = 1;
+
+    /*
+     * Subclasses overriding default() get to decide how to encode
+     * datetimes and the like themselves
+     */
+    method = PyObject_GetAttrString((PyObject *)(me), "default");
+    if (!method) {
+        Py_DECREF(me);
+        return NULL;
+    }
+    me->native_types = ( (PyCFunction_Check(method)) &&
+            (PyCFunction_GET_FUNCTION(method) == (PyCFunction)(py_yajlencoder_default)) );
+    Py_DECREF(method);
+    return (PyObject *)(me);
 }
 
 int yajlencoder_init(PYARGS)
 {
     _YajlEncoder *me = (_YajlEncoder *)(self);
+    PyObject *native_objects = Py_False;
+    PyObject *ensure_ascii = Py_True;
+    static char *kwlist[] = {"native_objects", "ensure_ascii", NULL};
 
     if (!me)
         return 1;
+
+    if ( (args) && (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO", kwlist,
+                    &native_objects, &ensure_ascii)) ) {
+        return -1;
+    }
+
+    me->ensure_ascii = PyObject_IsTrue(ensure_ascii);
+    if (me->ensure_ascii < 0)
+        return -1;
+
+    me->native_objects = PyObject_IsTrue(native_objects);
+    if (me->native_objects < 0)
+        return -1;
     return 0;
 }
 
 void yajlencoder_dealloc(_YajlEncoder *self)
 {
-#ifdef IS_PYTHON3
+#ifdef PY_YAJL_HEAP_TYPES
+    PyTypeObject *type = Py_TYPE(self);
+
+    type->tp_free((PyObject*)self);
+    Py_DECREF(type);
+#elif defined(IS_PYTHON3)
     Py_TYPE(self)->tp_free((PyObject*)self);
 #else
     self->ob_type->tp_free((PyObject*)self);
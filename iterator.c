@@ -0,0 +1,538 @@
+/*
+ * Copyright 2010, R. Tyler Ballance <tyler@monkeypox.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  3. Neither the name of R. Tyler Ballance nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Iterating over a document parsed a chunk at a time: what the parser (or
+ * decoder) makes of each chunk is queued in a list, from which it's returned one
+ * item (or one batch of items) at a time, so only about a chunk's worth
+ * of it is ever held at once
+ */
+
+#include <Python.h>
+
+#include <string.h>
+
+#include <yajl/yajl_parse.h>
+
+#include "py_yajl.h"
+
+#define ITERATOR(ctx) ((_YajlIterator *)(ctx))
+
+/*
+ * Events, see yajl.parse_events(). Prefixes are as ijson's: the object
+ * keys leading to the value joined by dots, with "item" standing for the
+ * elements of arrays
+ */
+
+/* The prefix of the value about to be parsed, a borrowed reference */
+static PyObject *CurrentPrefix(_YajlIterator *self)
+{
+    Py_ssize_t depth = PyList_GET_SIZE(self->prefixes);
+
+    return (depth) ? PyList_GET_ITEM(self->prefixes, depth - 1) : self->empty;
+}
+
+static PyObject *JoinPrefix(_YajlIterator *self, PyObject *prefix, PyObject *name)
+{
+    PyObject *dotted = NULL;
+    PyObject *joined = NULL;
+
+    if (PyObject_Length(prefix) == 0) {
+        Py_INCREF(name);
+        return name;
+    }
+    dotted = PyUnicode_Concat(prefix, self->dot);
+    if (!dotted)
+        return NULL;
+    joined = PyUnicode_Concat(dotted, name);
+    Py_DECREF(dotted);
+    return joined;
+}
+
+/* Queue the event `kind` at `prefix`, stealing the reference to `value` */
+static int Emit(_YajlIterator *self, PyObject *prefix, int kind, PyObject *value)
+{
+    PyObject *event = NULL;
+    int rc;
+
+    if (!value)
+        return failure;
+    event = PyTuple_Pack(3, prefix, self->names[kind], value);
+    Py_DECREF(value);
+    if (!event)
+        return failure;
+    rc = PyList_Append(self->pending, event);
+    Py_DECREF(event);
+    if (rc < 0)
+        return failure;
+
+    if (!PyList_GET_SIZE(self->prefixes))
+        self->complete = 1;
+    return success;
+}
+
+static int EmitValue(_YajlIterator *self, int kind, PyObject *value)
+{
+    return Emit(self, CurrentPrefix(self), kind, value);
+}
+
+/* Push the prefixes of a container opened at `prefix`, and of its children */
+static int EmitStart(_YajlIterator *self, int kind, int is_array)
+{
+    PyObject *prefix = CurrentPrefix(self);
+    PyObject *child = NULL;
+    int rc;
+
+    Py_INCREF(prefix);
+    if (is_array) {
+        child = JoinPrefix(self, prefix, self->item);
+    } else {
+        /* replaced by the first key */
+        child = prefix;
+        Py_INCREF(child);
+    }
+
+    rc = ( (child) && (PyList_Append(self->prefixes, prefix) == 0) &&
+            (PyList_Append(self->prefixes, child) == 0) );
+    Py_XDECREF(child);
+    if (rc) {
+        Py_INCREF(Py_None);
+        rc = Emit(self, prefix, kind, Py_None);
+    }
+    Py_DECREF(prefix);
+    return rc;
+}
+
+static int EmitEnd(_YajlIterator *self, int kind)
+{
+    Py_ssize_t depth = PyList_GET_SIZE(self->prefixes);
+    PyObject *prefix = PyList_GET_ITEM(self->prefixes, depth - 2);
+    int rc = failure;
+
+    Py_INCREF(prefix);
+    if (PyList_SetSlice(self->prefixes, depth - 2, depth, NULL) == 0) {
+        Py_INCREF(Py_None);
+        rc = Emit(self, prefix, kind, Py_None);
+    }
+    Py_DECREF(prefix);
+    return rc;
+}
+
+static int event_null(void *ctx)
+{
+    Py_INCREF(Py_None);
+    return EmitValue(ITERATOR(ctx), py_yajl_event_null, Py_None);
+}
+
+static int event_boolean(void *ctx, int value)
+{
+    return EmitValue(ITERATOR(ctx), py_yajl_event_boolean, PyBool_FromLong((long)(value)));
+}
+
+static int event_number(void *ctx, const char *value, unsigned int length)
+{
+    return EmitValue(ITERATOR(ctx), py_yajl_event_number, _internal_number(value, length));
+}
+
+static int event_string(void *ctx, const unsigned char *value, unsigned int length)
+{
+    return EmitValue(ITERATOR(ctx), py_yajl_event_string,
+            PyUnicode_FromStringAndSize((const char *)(value), length));
+}
+
+static int event_map_key(void *ctx, const unsigned char *value, unsigned int length)
+{
+    _YajlIterator *self = ITERATOR(ctx);
+    Py_ssize_t depth = PyList_GET_SIZE(self->prefixes);
+    PyObject *prefix = PyList_GET_ITEM(self->prefixes, depth - 2);
+    PyObject *key = PyUnicode_FromStringAndSize((const char *)(value), length);
+    PyObject *child = NULL;
+
+    if (!key)
+        return failure;
+    child = JoinPrefix(self, prefix, key);
+    if ( (!child) || (PyList_SetItem(self->prefixes, depth - 1, child) < 0) ) {
+        Py_DECREF(key);
+        return failure;
+    }
+    return Emit(self, prefix, py_yajl_event_map_key, key);
+}
+
+static int event_start_map(void *ctx)
+{
+    return EmitStart(ITERATOR(ctx), py_yajl_event_start_map, 0);
+}
+
+static int event_end_map(void *ctx)
+{
+    return EmitEnd(ITERATOR(ctx), py_yajl_event_end_map);
+}
+
+static int event_start_array(void *ctx)
+{
+    return EmitStart(ITERATOR(ctx), py_yajl_event_start_array, 1);
+}
+
+static int event_end_array(void *ctx)
+{
+    return EmitEnd(ITERATOR(ctx), py_yajl_event_end_array);
+}
+
+static yajl_callbacks event_callbacks = {
+    event_null,
+    event_boolean,
+    NULL,
+    NULL,
+    event_number,
+    event_string,
+    event_start_map,
+    event_map_key,
+    event_end_map,
+    event_start_array,
+    event_end_array
+};
+
+static const char *event_names[py_yajl_event_kinds] = {
+    "null",
+    "boolean",
+    "number",
+    "string",
+    "map_key",
+    "start_map",
+    "end_map",
+    "start_array",
+    "end_array"
+};
+
+/*
+ * Create an iterator over the document held by the str or bytes `document`,
+ * or read from `reader` if that's NULL
+ */
+static _YajlIterator *NewIterator(PyTypeObject *type, PyObject *document,
+        PyObject *reader, Py_ssize_t batch)
+{
+    _YajlIterator *self = NULL;
+    int i;
+
+    self = PyObject_GC_New(_YajlIterator, type);
+    if (!self)
+        return NULL;
+
+    self->parser = NULL;
+    self->document = document;
+    Py_XINCREF(document);
+    self->offset = 0;
+    self->reader = reader;
+    Py_XINCREF(reader);
+    self->position = 0;
+    self->batch = batch;
+    self->complete = 0;
+    self->done = 0;
+    self->running = 0;
+    self->decoder = NULL;
+    memset(&(self->items), 0, sizeof(py_yajl_items));
+    self->pending = PyList_New(0);
+    self->prefixes = NULL;
+    self->item = NULL;
+    self->dot = NULL;
+    self->empty = NULL;
+    for (i = 0; i < py_yajl_event_kinds; i++) {
+        self->names[i] = NULL;
+    }
+    PyObject_GC_Track((PyObject *)(self));
+
+    if (!self->pending) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return self;
+}
+
+PyObject *_internal_iter_events(PyTypeObject *type, PyObject *document,
+        PyObject *reader, Py_ssize_t batch)
+{
+    yajl_parser_config config = { 1, 1 };
+    _YajlIterator *self = NewIterator(type, document, reader, batch);
+    int i;
+
+    if (!self)
+        return NULL;
+
+    self->prefixes = PyList_New(0);
+    self->item = PyUnicode_FromString("item");
+    self->dot = PyUnicode_FromString(".");
+    self->empty = PyUnicode_FromString("");
+    for (i = 0; i < py_yajl_event_kinds; i++) {
+#ifdef IS_PYTHON3
+        self->names[i] = PyUnicode_InternFromString(event_names[i]);
+#else
+        self->names[i] = PyString_InternFromString(event_names[i]);
+#endif
+        if (!self->names[i])
+            break;
+    }
+    if ( (i < py_yajl_event_kinds) || (!self->prefixes) || (!self->item) ||
+            (!self->dot) || (!self->empty) ) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    self->parser = yajl_alloc(&event_callbacks, &config, NULL, (void *)(self));
+    return (PyObject *)(self);
+}
+
+/*
+ * Items, see yajl.iter_items(): the elements of the array at `path` are
+ * handed out by `decoder` as each one is decoded
+ */
+PyObject *_internal_iter_items(PyTypeObject *type, PyObject *decoder,
+        PyObject *document, PyObject *reader, PyObject *path)
+{
+    _YajlIterator *self = NewIterator(type, document, reader, 0);
+
+    if (!self)
+        return NULL;
+
+    self->items.segments = _internal_parse_path(path);
+    if ( (!self->items.segments) ||
+            (!_internal_decode_begin((_YajlDecoder *)(decoder))) ) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    self->items.output = self->pending;
+    self->decoder = decoder;
+    Py_INCREF(decoder);
+    ((_YajlDecoder *)(decoder))->items = &(self->items);
+    return (PyObject *)(self);
+}
+
+/*
+ * Once the document is complete yajl leaves the rest of the chunk (and any
+ * later ones) unparsed, which had better be nothing but whitespace
+ */
+static int CheckTrailing(yajl_handle parser, char *buffer, Py_ssize_t length)
+{
+    unsigned int consumed = yajl_get_bytes_consumed(parser);
+
+    return _internal_check_trailing(buffer + consumed,
+            (unsigned int)(length) - consumed);
+}
+
+static int ParseEvents(_YajlIterator *self, char *buffer, Py_ssize_t length)
+{
+    yajl_status yrc;
+
+    if (length)
+        yrc = yajl_parse(self->parser, (const unsigned char *)(buffer), (unsigned int)(length));
+    else
+        yrc = yajl_parse_complete(self->parser);
+
+    if (yrc == yajl_status_error) {
+        _internal_parse_error(self->parser, buffer, (unsigned int)(length));
+        return failure;
+    }
+    if (yrc == yajl_status_client_canceled) {
+        /* a callback failed, raising something */
+        return failure;
+    }
+    if ( (self->done) && ((yrc != yajl_status_ok) || (!self->complete)) ) {
+        PyErr_SetString(PyExc_ValueError, "The document is incomplete");
+        return failure;
+    }
+    if ( (length) && (yrc == yajl_status_ok) && (self->complete) )
+        return CheckTrailing(self->parser, buffer, length);
+    return success;
+}
+
+static int DecodeItems(_YajlIterator *self, char *buffer, Py_ssize_t length)
+{
+    _YajlDecoder *decoder = (_YajlDecoder *)(self->decoder);
+    int rc = _internal_decode_chunk(decoder, buffer, (unsigned int)(length));
+
+    if ( (rc) && (length) && (decoder->root) )
+        rc = CheckTrailing(decoder->parser, buffer, length);
+    if ( (rc) && (self->done) && (!self->items.found) ) {
+        PyErr_SetString(PyExc_ValueError, "No array found at the given path");
+        rc = failure;
+    }
+    /* what's left of the document is of no interest */
+    if ( (!rc) || (self->done) )
+        _internal_decode_end(decoder);
+    return rc;
+}
+
+/*
+ * Parse the next chunk of the document, queueing what comes of it; at the
+ * end of the document the parse is completed and `done` set. Returns
+ * failure with an exception set if the document turns out to be invalid
+ */
+static int ParseChunk(_YajlIterator *self)
+{
+    PyObject *chunk = NULL;
+    char *buffer = NULL;
+    Py_ssize_t length = 0;
+    int rc;
+
+    if (self->reader) {
+        if (!_internal_read_chunk(self->reader, &chunk))
+            return failure;
+        PyString_AsStringAndSize(chunk, &buffer, &length);
+    } else {
+        buffer = PyString_AS_STRING(self->document) + self->offset;
+        length = PyString_GET_SIZE(self->document) - self->offset;
+        if (length > PY_YAJL_READ_SZ)
+            length = PY_YAJL_READ_SZ;
+        self->offset += length;
+    }
+
+    if (!length)
+        self->done = 1;
+    if (self->decoder)
+        rc = DecodeItems(self, buffer, length);
+    else
+        rc = ParseEvents(self, buffer, length);
+    Py_XDECREF(chunk);
+    return rc;
+}
+
+PyObject *yajliterator_next(PyObject *self)
+{
+    _YajlIterator *it = ITERATOR(self);
+    Py_ssize_t wanted = (it->batch) ? it->batch : 1;
+    Py_ssize_t available = 0;
+    PyObject *result = NULL;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (!it->pending)
+        goto exit;
+    if (it->running) {
+        PyErr_SetString(PyExc_ValueError, "iterator already executing");
+        goto exit;
+    }
+    it->running = 1;
+
+    while ( (!it->done) &&
+            (PyList_GET_SIZE(it->pending) - it->position < wanted) ) {
+        if (!ParseChunk(it)) {
+            /* whatever was parsed up to the error is dropped */
+            it->done = 1;
+            PyList_SetSlice(it->pending, 0, PyList_GET_SIZE(it->pending), NULL);
+            it->position = 0;
+            it->running = 0;
+            goto exit;
+        }
+    }
+    it->running = 0;
+
+    available = PyList_GET_SIZE(it->pending) - it->position;
+    if (available <= 0)
+        goto exit;
+
+    if (it->batch) {
+        if (available > it->batch)
+            available = it->batch;
+        result = PyList_GetSlice(it->pending, it->position, it->position + available);
+    } else {
+        available = 1;
+        result = PyList_GET_ITEM(it->pending, it->position);
+        Py_INCREF(result);
+    }
+    it->position += available;
+
+    /* drop what's been returned once the whole lot has been */
+    if (it->position == PyList_GET_SIZE(it->pending)) {
+        PyList_SetSlice(it->pending, 0, it->position, NULL);
+        it->position = 0;
+    }
+
+  exit:
+    Py_END_CRITICAL_SECTION();
+    return result;
+}
+
+int yajliterator_traverse(PyObject *self, visitproc visit, void *arg)
+{
+    _YajlIterator *it = ITERATOR(self);
+
+#ifdef PY_YAJL_HEAP_TYPES
+    Py_VISIT(Py_TYPE(self));
+#endif
+    Py_VISIT(it->reader);
+    Py_VISIT(it->pending);
+    Py_VISIT(it->decoder);
+    return 0;
+}
+
+int yajliterator_clear(PyObject *self)
+{
+    _YajlIterator *it = ITERATOR(self);
+
+    if (it->decoder) {
+        ((_YajlDecoder *)(it->decoder))->items = NULL;
+        _internal_decode_end((_YajlDecoder *)(it->decoder));
+    }
+    Py_CLEAR(it->decoder);
+    Py_CLEAR(it->reader);
+    Py_CLEAR(it->pending);
+    it->items.output = NULL;
+    return 0;
+}
+
+void yajliterator_dealloc(PyObject *self)
+{
+    _YajlIterator *it = ITERATOR(self);
+    int i;
+
+    PyObject_GC_UnTrack(self);
+    if (it->parser)
+        yajl_free(it->parser);
+    yajliterator_clear(self);
+    Py_XDECREF(it->document);
+    Py_XDECREF(it->items.segments);
+    Py_XDECREF(it->prefixes);
+    Py_XDECREF(it->item);
+    Py_XDECREF(it->dot);
+    Py_XDECREF(it->empty);
+    for (i = 0; i < py_yajl_event_kinds; i++) {
+        Py_XDECREF(it->names[i]);
+    }
+#ifdef PY_YAJL_HEAP_TYPES
+    {
+        PyTypeObject *type = Py_TYPE(self);
+
+        PyObject_GC_Del(self);
+        Py_DECREF(type);
+    }
+#else
+    PyObject_GC_Del(self);
+#endif
+}
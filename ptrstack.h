@@ -41,8 +41,16 @@
 #include <Python.h>
 #include "assert.h"
 
+/* the initial size of a stack, which then doubles whenever it fills up */
 #define PY_YAJL_PS_INC 128
 
+/* unused inline functions don't make for warnings the way static ones do */
+#if defined(__GNUC__) || defined(_MSC_VER)
+#define PY_YAJL_INLINE static __inline
+#else
+#define PY_YAJL_INLINE static
+#endif
+
 typedef struct py_yajl_bytestack_t
 {
     PyObject ** stack;
@@ -50,7 +58,56 @@ typedef struct py_yajl_bytestack_t
     unsigned int used;
 } py_yajl_bytestack;
 
-/* initialize a bytestack */
+/*
+ * What the children of an open array are being kept as, see the decoder's
+ * `numeric_arrays` option; arrays start out undecided, and anything but a
+ * run of numbers of one kind turns them back into regular arrays
+ */
+enum {
+    py_yajl_pack_off,
+    py_yajl_pack_undecided,
+    py_yajl_pack_int,
+    py_yajl_pack_float
+};
+
+/*
+ * A frame marks an open container, `base` being the index in the value
+ * stack of the container's first child; `shape` is available for holding
+ * a reference to the keys of the container's last object child, and
+ * `numbers` is the index in the number stack of the container's first
+ * child while those are being packed
+ */
+typedef struct py_yajl_frame_t
+{
+    unsigned int base;
+    int is_dict;
+    PyObject * shape;
+    int packing;
+    unsigned int numbers;
+} py_yajl_frame;
+
+typedef struct py_yajl_framestack_t
+{
+    py_yajl_frame * stack;
+    unsigned int size;
+    unsigned int used;
+} py_yajl_framestack;
+
+/* a number which hasn't been turned into an object */
+typedef union py_yajl_number_t
+{
+    long long integer;
+    double number;
+} py_yajl_number;
+
+typedef struct py_yajl_numberstack_t
+{
+    py_yajl_number * stack;
+    unsigned int size;
+    unsigned int used;
+} py_yajl_numberstack;
+
+/* initialize a bytestack (or framestack, or numberstack) */
 #define py_yajl_ps_init(ops) {                  \
         (ops).stack = NULL;                     \
         (ops).size = 0;                         \
@@ -67,17 +124,55 @@ typedef struct py_yajl_bytestack_t
 
 #define py_yajl_ps_length(ops) ((ops).used)
 
-#define py_yajl_ps_push(ops, pointer) {                       \
-    if (((ops).size - (ops).used) == 0) {               \
-        (ops).size += PY_YAJL_PS_INC;                      \
-        (ops).stack = realloc((void *) (ops).stack, sizeof(PyObject *) * (ops).size); \
-    }                                                   \
-    (ops).stack[((ops).used)++] = (pointer);               \
+/*
+ * Make room for one more item of `itemsize` bytes on a full stack; returns
+ * 0 with MemoryError set, leaving the stack as it was, if that fails
+ */
+PY_YAJL_INLINE int py_yajl_ps_grow(void **stack, unsigned int *size,
+        size_t itemsize)
+{
+    unsigned int newsize = (*size) ? (*size) * 2 : PY_YAJL_PS_INC;
+    void *grown = NULL;
+
+    if (newsize > *size)
+        grown = realloc(*stack, itemsize * newsize);
+    if (!grown) {
+        PyErr_NoMemory();
+        return 0;
+    }
+    *stack = grown;
+    *size = newsize;
+    return 1;
 }
-    
+
+/* make sure there's room for pushing one more item, evaluating to 0 if not */
+#define py_yajl_ps_reserve(ops)                                        \
+    (((ops).used < (ops).size) ||                                      \
+     py_yajl_ps_grow((void **) &((ops).stack), &((ops).size),         \
+         sizeof(*((ops).stack))))
+
+/* pushes an item, evaluating to 0 with MemoryError set if out of memory */
+#define py_yajl_ps_push(ops, pointer)                                  \
+    (py_yajl_ps_reserve(ops) ?                                         \
+     ((ops).stack[((ops).used)++] = (pointer), 1) : 0)
+
+/* pushes a new frame onto a framestack, evaluating to 0 like the above */
+#define py_yajl_fs_push(ops, frame_base, frame_is_dict)                \
+    (py_yajl_ps_reserve(ops) ?                                         \
+     ((ops).stack[(ops).used].base = (frame_base),                     \
+      (ops).stack[(ops).used].shape = NULL,                            \
+      (ops).stack[(ops).used].packing = py_yajl_pack_off,              \
+      (ops).stack[(ops).used].numbers = 0,                             \
+      (ops).stack[((ops).used)++].is_dict = (frame_is_dict), 1) : 0)
+
 /* removes the top item of the stack, returns nothing */
 #define py_yajl_ps_pop(ops) { ((ops).used)--; }
 
+/* drops everything above the first `length` items, returns nothing */
+#define py_yajl_ps_truncate(ops, length) { (ops).used = (length); }
+
+#define py_yajl_ps_at(ops, index) ((ops).stack[(index)])
+
 #define py_yajl_ps_set(ops, pointer)                          \
     (ops).stack[((ops).used) - 1] = (pointer);             
     
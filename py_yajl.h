@@ -34,6 +34,7 @@
 #define _PY_YAJL_H_
 
 #include <Python.h>
+#include <yajl/yajl_parse.h>
 #include <yajl/yajl_gen.h>
 #include "ptrstack.h"
 
@@ -41,28 +42,354 @@
 #define IS_PYTHON3
 #define PyString_AsStringAndSize 	PyBytes_AsStringAndSize
 #define PyString_Check				PyBytes_Check
+#define PyString_FromStringAndSize	PyBytes_FromStringAndSize
+#define PyString_AS_STRING			PyBytes_AS_STRING
+#define PyString_GET_SIZE			PyBytes_GET_SIZE
 #endif
 
+/*
+ * From 3.11 on the module uses multi-phase initialization, with heap types
+ * and all of its state kept per module object (and so per interpreter);
+ * older Pythons get static types and a single static module state
+ */
+#if PY_VERSION_HEX >= 0x030B0000
+#define PY_YAJL_HEAP_TYPES
+#endif
+
+/*
+ * Counters behind yajl.stats(), kept unless the module is built with
+ * PY_YAJL_STATS=0 in the environment (see setup.py); on free-threaded
+ * builds they're updated atomically
+ */
+#ifdef PY_YAJL_STATS
+#ifdef Py_GIL_DISABLED
+typedef int64_t py_yajl_counter;
+#define PY_YAJL_COUNTER_ADD(p, n) _Py_atomic_add_int64((p), (n))
+#define PY_YAJL_COUNTER_LOAD(p) _Py_atomic_load_int64_relaxed(p)
+#define PY_YAJL_COUNTER_STORE(p, v) _Py_atomic_store_int64_relaxed((p), (v))
+#else
+typedef long long py_yajl_counter;
+#define PY_YAJL_COUNTER_ADD(p, n) (*(p) += (n))
+#define PY_YAJL_COUNTER_LOAD(p) (*(p))
+#define PY_YAJL_COUNTER_STORE(p, v) (*(p) = (v))
+#endif
+
+/* the kinds of objects the decoder creates */
+enum {
+    py_yajl_stat_null,
+    py_yajl_stat_bool,
+    py_yajl_stat_int,
+    py_yajl_stat_float,
+    py_yajl_stat_str,
+    py_yajl_stat_key,
+    py_yajl_stat_list,
+    py_yajl_stat_dict,
+    py_yajl_stat_record,
+    py_yajl_stat_array,
+    py_yajl_stat_kinds
+};
+
+/* Latencies are counted in buckets of [2**i, 2**(i+1)) nanoseconds */
+#define PY_YAJL_LATENCY_BUCKETS 40
+
+/* nothing but counters, so that they can be walked as an array */
+typedef struct {
+    py_yajl_counter decoded_documents;
+    py_yajl_counter decoded_bytes;
+    py_yajl_counter encoded_documents;
+    py_yajl_counter encoded_bytes;
+    py_yajl_counter objects[py_yajl_stat_kinds];
+    /* output buffers grown by py_yajl_printer() */
+    py_yajl_counter buffer_resizes;
+    /* objects handed to Encoder.default() */
+    py_yajl_counter default_calls;
+    py_yajl_counter decode_latency[PY_YAJL_LATENCY_BUCKETS];
+    py_yajl_counter encode_latency[PY_YAJL_LATENCY_BUCKETS];
+} py_yajl_stats;
+
+#define PY_YAJL_STAT(module, counter, n) \
+    PY_YAJL_COUNTER_ADD(&((module)->stats.counter), (n))
+#else
+#define PY_YAJL_STAT(module, counter, n) ((void)0)
+#endif
+
+typedef struct {
+    PyTypeObject *decoder_type;
+    PyTypeObject *encoder_type;
+    PyTypeObject *record_type;
+    PyTypeObject *iterator_type;
+    /*
+     * Maps types to the names of the fields their instances are encoded
+     * with when `native_objects` is enabled, or to None for types which
+     * aren't dataclasses, namedtuples or __slots__ classes
+     */
+    PyObject *fieldcache;
+    /* the output size estimate dumps() and friends pass from call to call */
+    Py_ssize_t size_estimate;
+    /*
+     * The number of decodes holding off the cyclic GC, and whether it was
+     * enabled before the first of them
+     */
+    int gc_pauses;
+    int gc_was_enabled;
+#ifdef Py_GIL_DISABLED
+    PyMutex gc_lock;
+#endif
+#ifdef PY_YAJL_STATS
+    py_yajl_stats stats;
+#endif
+} py_yajl_module_state;
+
+/*
+ * A slot in the decoder's direct-mapped cache of short string values,
+ * remembering the raw UTF-8 the string was created from
+ */
+#define PY_YAJL_INTERN_SLOTS 1024
+#define PY_YAJL_INTERN_MAX_LEN 32
+
+typedef struct {
+    PyObject *value;
+    unsigned int length;
+    char bytes[PY_YAJL_INTERN_MAX_LEN];
+} py_yajl_intern_slot;
+
+/*
+ * State for decoding an array of objects column by column, see
+ * yajl.loads_columnar(). Numeric columns are kept as raw C values until
+ * a value of any other kind shows up, at which point they are boxed into
+ * a list of objects.
+ */
+enum { py_yajl_col_int, py_yajl_col_float, py_yajl_col_object };
+
+typedef struct {
+    PyObject *name;
+    int kind;
+    Py_ssize_t count;
+    Py_ssize_t size;
+    /* long long or double values, depending on `kind` */
+    void *numbers;
+    PyObject *objects;
+} py_yajl_column;
+
+typedef struct {
+    /* tuple of the keys leading to the array of rows */
+    PyObject *segments;
+    /* 1 + the frame index of the array of rows, 0 until it's been found */
+    unsigned int target;
+    int found;
+    Py_ssize_t rows;
+    py_yajl_column *columns;
+    Py_ssize_t ncolumns;
+    Py_ssize_t size;
+    /* maps column names to their index in `columns` */
+    PyObject *index;
+    /* the column which followed the last one used, tried first */
+    Py_ssize_t next;
+    PyObject *result;
+} py_yajl_columnar;
+
+/*
+ * State for handing out the elements of an array as soon as each one is
+ * decoded, rather than adding them to the array, see yajl.iter_items()
+ */
+typedef struct {
+    /* tuple of the keys leading to the array */
+    PyObject *segments;
+    /* 1 + the frame index of the array while it's open, 0 otherwise */
+    unsigned int target;
+    int found;
+    /* the list elements are appended to */
+    PyObject *output;
+} py_yajl_items;
+
 typedef struct {
     PyObject_HEAD
 
-    py_yajl_bytestack elements;
-    py_yajl_bytestack keys;
+    /* children (and keys) of every open container, in document order */
+    py_yajl_bytestack values;
+    /* one frame per open container, marking where its children start */
+    py_yajl_framestack frames;
     PyObject *root;
 
+    /* 1 to hold off the cyclic GC while decoding, 0 not to, -1 for auto */
+    int disable_gc;
+    /* only allocated when short repeated string values should be shared */
+    py_yajl_intern_slot *interned;
+    /* decode objects within arrays to yajl.Record */
+    int records;
+    /* only set for the duration of a columnar decode */
+    py_yajl_columnar *columnar;
+    /* decode arrays of numbers of one kind to array.array */
+    int numeric_arrays;
+    PyObject *array_type;
+    /* the children of arrays which are still candidates for packing */
+    py_yajl_numberstack numbers;
+    /* the state of the decoder's module, only set while decoding */
+    py_yajl_module_state *module;
+    /* the parser of a document being decoded a chunk at a time */
+    yajl_handle parser;
+    /* some of a document fed to the decoder isn't decoded yet */
+    int partial;
+    /* only set while iterating over the items of an array */
+    py_yajl_items *items;
+
 } _YajlDecoder;
 
+typedef struct {
+    PyObject_VAR_HEAD
+    /* tuple of keys, shared by records of the same shape */
+    PyObject *keys;
+    PyObject *values[1];
+} _YajlRecord;
+
+/* the events yajl.parse_events() yields, named as by ijson */
+enum {
+    py_yajl_event_null,
+    py_yajl_event_boolean,
+    py_yajl_event_number,
+    py_yajl_event_string,
+    py_yajl_event_map_key,
+    py_yajl_event_start_map,
+    py_yajl_event_end_map,
+    py_yajl_event_start_array,
+    py_yajl_event_end_array,
+    py_yajl_event_kinds
+};
+
+/*
+ * An iterator over what's parsed from a document a chunk at a time, see
+ * yajl.parse_events() and yajl.iter_items()
+ */
+typedef struct {
+    PyObject_HEAD
+    yajl_handle parser;
+    /* the document's UTF-8 bytes and how much of them has been parsed */
+    PyObject *document;
+    Py_ssize_t offset;
+    /* or else the stream the document is read from */
+    PyObject *reader;
+    /* what's been parsed but not yet returned, from `position` on */
+    PyObject *pending;
+    Py_ssize_t position;
+    /* return lists of up to `batch` items at a time, or single items if 0 */
+    Py_ssize_t batch;
+    /* the document is complete, and has been parsed to the end */
+    int complete;
+    int done;
+    /* guards against read() going back into the iterator */
+    int running;
+    /* the Decoder which items are decoded by, NULL when iterating events */
+    PyObject *decoder;
+    py_yajl_items items;
+    /*
+     * The prefix of every open container, each one followed by that of
+     * the container's current child
+     */
+    PyObject *prefixes;
+    PyObject *names[py_yajl_event_kinds];
+    PyObject *item;
+    PyObject *dot;
+    PyObject *empty;
+} _YajlIterator;
+
+/*
+ * A container being encoded; `object` and `extra`, the iterator over the
+ * container or the tuple of its fields, are strong references
+ */
+enum {
+    py_yajl_enc_sequence,
+    py_yajl_enc_iterator,
+    py_yajl_enc_dict,
+    py_yajl_enc_record,
+    py_yajl_enc_fields
+};
+
+typedef struct {
+    PyObject *object;
+    PyObject *extra;
+    Py_ssize_t position;
+    int kind;
+} py_yajl_encframe;
+
+typedef struct {
+    py_yajl_encframe *stack;
+    unsigned int size;
+    unsigned int used;
+} py_yajl_encframestack;
+
 typedef struct {
     PyObject_HEAD
     /* type specifics */
-    void *_generator;
+    /* moving average of the output size, for sizing the next buffer */
+    Py_ssize_t _size_estimate;
+    /* encode dataclasses, namedtuples and __slots__ objects as objects */
+    int native_objects;
+    /* encode datetimes, UUIDs and Decimals, unless default() is overridden */
+    int native_types;
+    /* escape all non-ASCII characters, rather than emitting UTF-8 */
+    int ensure_ascii;
 } _YajlEncoder;
 
+/*
+ * The state of a single encode, so that encoders can be shared between
+ * threads and used again from within their own default()
+ */
+typedef struct {
+    _YajlEncoder *encoder;
+    py_yajl_module_state *module;
+    void *generator;
+    PyObject *keycache;
+    /* the containers currently open */
+    py_yajl_encframestack frames;
+    /* non-ASCII bytes have been output */
+    int nonascii;
+    /* uuid.UUID and decimal.Decimal, once looked up */
+    PyObject *uuid_type;
+    PyObject *decimal_type;
+} py_yajl_encstate;
+
 #define PYARGS PyObject *self, PyObject *args, PyObject *kwargs
 enum { failure, success };
 
 #define PY_YAJL_CHUNK_SZ 64
 
+/* Output buffers sized from past encodes are never made larger than this */
+#define PY_YAJL_ESTIMATE_MAX (16 * 1024 * 1024)
+
+/* How much of a document is parsed, or read from a stream, at a time */
+#define PY_YAJL_READ_SZ 65536
+
+/* Documents at least this large are decoded with the cyclic GC paused */
+#define PY_YAJL_GC_PAUSE_SZ 16384
+
+/* Objects with more keys than this are always decoded to dicts */
+#define PY_YAJL_RECORD_MAX_KEYS 64
+
+/* Upper bound on distinct dict keys remembered during a single encode */
+#define PY_YAJL_KEYCACHE_MAX 1024
+
+/* Upper bound on types whose fields are remembered for `native_objects` */
+#define PY_YAJL_FIELDCACHE_MAX 256
+
+/*
+ * A Decoder keeps the state of a decode on itself, so on free-threaded
+ * builds it's locked for the duration; critical sections only exist
+ * there (and are no-ops elsewhere) since 3.13
+ */
+#if PY_VERSION_HEX < 0x030D0000
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#endif
+
+/* Output size estimates are shared between threads, but only a heuristic */
+#ifdef Py_GIL_DISABLED
+#define PY_YAJL_LOAD_ESTIMATE(p) _Py_atomic_load_ssize_relaxed(p)
+#define PY_YAJL_STORE_ESTIMATE(p, v) _Py_atomic_store_ssize_relaxed(p, v)
+#else
+#define PY_YAJL_LOAD_ESTIMATE(p) (*(p))
+#define PY_YAJL_STORE_ESTIMATE(p, v) (*(p) = (v))
+#endif
+
 /* Defining the Py_SIZE macro for 2.4/2.5 compat */
 #ifndef Py_SIZE
 #define Py_SIZE(ob)     (((PyVarObject*)(ob))->ob_size)
@@ -89,19 +416,103 @@ enum { failure, success };
  * Methods defined for the YajlDecoder type in decoder.c
  */
 extern PyObject *py_yajldecoder_decode(PYARGS);
+extern PyObject *py_yajldecoder_feed(PYARGS);
+extern PyObject *py_yajldecoder_close(PyObject *self, PyObject *unused);
 extern int yajldecoder_init(PYARGS);
 extern void yajldecoder_dealloc(_YajlDecoder *self);
 extern PyObject *_internal_decode(_YajlDecoder *self, char *buffer, unsigned int buflen);
+extern PyObject *_internal_decode_columnar(_YajlDecoder *self, char *buffer,
+        unsigned int buflen, PyObject *path);
+extern PyObject *_internal_parse_path(PyObject *path);
+extern int _internal_decode_begin(_YajlDecoder *self);
+extern int _internal_decode_chunk(_YajlDecoder *self, const char *buffer,
+        unsigned int buflen);
+extern void _internal_decode_end(_YajlDecoder *self);
+extern PyObject *_internal_decode_feed(_YajlDecoder *self, const char *buffer,
+        unsigned int buflen);
+extern PyObject *_internal_number(const char *value, unsigned int length);
+extern int _internal_validate(char *buffer, unsigned int buflen, int max_depth);
+extern void _internal_parse_error(yajl_handle parser, const char *buffer,
+        unsigned int buflen);
+extern int _internal_check_trailing(const char *buffer, unsigned int buflen);
 
 
 /*
  * Methods defined for the YajlEncoder type in encoder.c
  */
 extern PyObject *py_yajlencoder_encode(PYARGS);
+extern PyObject *py_yajlencoder_encodeb(PYARGS);
 extern PyObject* py_yajlencoder_default(PYARGS);
+extern PyObject *yajlencoder_new(PyTypeObject *type, PyObject *args,
+        PyObject *kwargs);
 extern int yajlencoder_init(PYARGS);
 extern void yajlencoder_dealloc(_YajlEncoder *self);
-extern PyObject *_internal_encode(_YajlEncoder *self, PyObject *obj, yajl_gen_config config);
+extern PyObject *_internal_encode(_YajlEncoder *self, PyObject *obj,
+        yajl_gen_config config, int as_bytes, Py_ssize_t size_hint);
+#if PY_VERSION_HEX >= 0x02060000
+extern Py_ssize_t _internal_encode_into(_YajlEncoder *self, PyObject *obj,
+        yajl_gen_config config, PyObject *target, Py_ssize_t offset);
+#endif
+
+/*
+ * Methods defined for the YajlRecord type in record.c
+ */
+extern PyObject *yajlrecord_new(PyTypeObject *type, PyObject *keys,
+        PyObject **values, Py_ssize_t count);
+extern Py_ssize_t yajlrecord_length(PyObject *self);
+extern PyObject *yajlrecord_subscript(PyObject *self, PyObject *key);
+extern int yajlrecord_contains(PyObject *self, PyObject *key);
+extern PyObject *yajlrecord_iter(PyObject *self);
+extern PyObject *yajlrecord_repr(PyObject *self);
+extern PyObject *yajlrecord_richcompare(PyObject *self, PyObject *other, int op);
+extern PyObject *py_yajlrecord_keys(PyObject *self, PyObject *unused);
+extern PyObject *py_yajlrecord_values(PyObject *self, PyObject *unused);
+extern PyObject *py_yajlrecord_items(PyObject *self, PyObject *unused);
+extern PyObject *py_yajlrecord_get(PyObject *self, PyObject *args);
+extern PyObject *py_yajlrecord_reduce(PyObject *self, PyObject *unused);
+extern int yajlrecord_traverse(PyObject *self, visitproc visit, void *arg);
+extern void yajlrecord_dealloc(PyObject *self);
+
+/*
+ * Methods defined for the YajlIterator type in iterator.c
+ */
+extern PyObject *_internal_iter_events(PyTypeObject *type, PyObject *document,
+        PyObject *reader, Py_ssize_t batch);
+extern PyObject *_internal_iter_items(PyTypeObject *type, PyObject *decoder,
+        PyObject *document, PyObject *reader, PyObject *path);
+extern PyObject *yajliterator_next(PyObject *self);
+extern int yajliterator_traverse(PyObject *self, visitproc visit, void *arg);
+extern int yajliterator_clear(PyObject *self);
+extern void yajliterator_dealloc(PyObject *self);
+
+/*
+ * Defined in yajl.c: the state of the module which `type`, an Encoder or
+ * Decoder (sub)class, belongs to; NULL with an exception set if none
+ */
+extern py_yajl_module_state *_internal_module_state(PyTypeObject *type);
+
+/*
+ * Defined in reformat.c
+ */
+extern PyObject *_internal_reformat(PyObject *document, PyObject *reader,
+        yajl_gen_config config, PyObject *stream);
+extern int _internal_read_chunk(PyObject *reader, PyObject **chunk);
+
+/*
+ * Defined in stats.c; without PY_YAJL_STATS the statistics are always empty
+ */
+extern PyObject *_internal_stats_dict(py_yajl_module_state *module);
+extern void _internal_stats_reset(py_yajl_module_state *module);
+#ifdef PY_YAJL_STATS
+extern long long _internal_stats_clock(void);
+extern void _internal_stats_latency(py_yajl_counter *histogram, long long start);
+#define PY_YAJL_CLOCK() _internal_stats_clock()
+#define PY_YAJL_LATENCY(module, histogram, start) \
+    _internal_stats_latency((module)->stats.histogram, (start))
+#else
+#define PY_YAJL_CLOCK() 0
+#define PY_YAJL_LATENCY(module, histogram, start) ((void)(start))
+#endif
 
 #endif
 
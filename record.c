@@ -0,0 +1,301 @@
+/*
+ * Copyright 2010, R. Tyler Ballance <tyler@monkeypox.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  3. Neither the name of R. Tyler Ballance nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * yajl.Record, a compact read-only mapping used when decoding arrays of
+ * objects; the tuple of keys is shared between records of the same shape
+ * and the values are stored inline, much like a tuple's
+ */
+#include <Python.h>
+
+#include "py_yajl.h"
+
+PyObject *yajlrecord_new(PyTypeObject *type, PyObject *keys,
+        PyObject **values, Py_ssize_t count)
+{
+    _YajlRecord *record = NULL;
+    Py_ssize_t i;
+
+    record = PyObject_GC_NewVar(_YajlRecord, type, count);
+    if (!record)
+        return NULL;
+
+    Py_INCREF(keys);
+    record->keys = keys;
+    for (i = 0; i < count; i++) {
+        Py_INCREF(values[i]);
+        record->values[i] = values[i];
+    }
+
+    PyObject_GC_Track((PyObject *)(record));
+    return (PyObject *)(record);
+}
+
+/* Returns the (borrowed) value for `key`, or NULL if there is none */
+static PyObject *RecordLookup(_YajlRecord *self, PyObject *key)
+{
+    Py_ssize_t count = Py_SIZE(self);
+    Py_ssize_t i;
+    int rc;
+
+    /* keys decoded from the same document are usually the same objects */
+    for (i = 0; i < count; i++) {
+        if (PyTuple_GET_ITEM(self->keys, i) == key)
+            return self->values[i];
+    }
+    for (i = 0; i < count; i++) {
+        rc = PyObject_RichCompareBool(PyTuple_GET_ITEM(self->keys, i), key, Py_EQ);
+        if (rc < 0)
+            return NULL;
+        if (rc)
+            return self->values[i];
+    }
+    return NULL;
+}
+
+static PyObject *RecordAsDict(_YajlRecord *self)
+{
+    PyObject *dict = PyDict_New();
+    Py_ssize_t i;
+
+    if (!dict)
+        return NULL;
+
+    for (i = 0; i < Py_SIZE(self); i++) {
+        if (PyDict_SetItem(dict, PyTuple_GET_ITEM(self->keys, i), self->values[i])) {
+            Py_DECREF(dict);
+            return NULL;
+        }
+    }
+    return dict;
+}
+
+Py_ssize_t yajlrecord_length(PyObject *self)
+{
+    return Py_SIZE(self);
+}
+
+PyObject *yajlrecord_subscript(PyObject *self, PyObject *key)
+{
+    PyObject *value = RecordLookup((_YajlRecord *)(self), key);
+
+    if (!value) {
+        if (!PyErr_Occurred())
+            PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
+    }
+    Py_INCREF(value);
+    return value;
+}
+
+int yajlrecord_contains(PyObject *self, PyObject *key)
+{
+    if (RecordLookup((_YajlRecord *)(self), key))
+        return 1;
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+PyObject *yajlrecord_iter(PyObject *self)
+{
+    return PyObject_GetIter(((_YajlRecord *)(self))->keys);
+}
+
+PyObject *yajlrecord_repr(PyObject *self)
+{
+    PyObject *dict = RecordAsDict((_YajlRecord *)(self));
+    PyObject *result = NULL;
+
+    if (!dict)
+        return NULL;
+    result = PyObject_Repr(dict);
+    Py_DECREF(dict);
+    return result;
+}
+
+PyObject *yajlrecord_richcompare(PyObject *self, PyObject *other, int op)
+{
+    PyObject *dict = NULL;
+    PyObject *result = NULL;
+
+    if ( (op != Py_EQ) && (op != Py_NE) ) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+
+    dict = RecordAsDict((_YajlRecord *)(self));
+    if (!dict)
+        return NULL;
+
+    if (PyObject_TypeCheck(other, Py_TYPE(self))) {
+        other = RecordAsDict((_YajlRecord *)(other));
+        if (!other) {
+            Py_DECREF(dict);
+            return NULL;
+        }
+        result = PyObject_RichCompare(dict, other, op);
+        Py_DECREF(other);
+    } else {
+        result = PyObject_RichCompare(dict, other, op);
+    }
+    Py_DECREF(dict);
+    return result;
+}
+
+PyObject *py_yajlrecord_keys(PyObject *self, PyObject *unused)
+{
+    return PySequence_List(((_YajlRecord *)(self))->keys);
+}
+
+PyObject *py_yajlrecord_values(PyObject *self, PyObject *unused)
+{
+    _YajlRecord *record = (_YajlRecord *)(self);
+    PyObject *result = PyList_New(Py_SIZE(record));
+    Py_ssize_t i;
+
+    if (!result)
+        return NULL;
+
+    for (i = 0; i < Py_SIZE(record); i++) {
+        Py_INCREF(record->values[i]);
+        PyList_SET_ITEM(result, i, record->values[i]);
+    }
+    return result;
+}
+
+PyObject *py_yajlrecord_items(PyObject *self, PyObject *unused)
+{
+    _YajlRecord *record = (_YajlRecord *)(self);
+    PyObject *result = PyList_New(Py_SIZE(record));
+    PyObject *item = NULL;
+    Py_ssize_t i;
+
+    if (!result)
+        return NULL;
+
+    for (i = 0; i < Py_SIZE(record); i++) {
+        item = PyTuple_Pack(2, PyTuple_GET_ITEM(record->keys, i), record->values[i]);
+        if (!item) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_SET_ITEM(result, i, item);
+    }
+    return result;
+}
+
+PyObject *py_yajlrecord_get(PyObject *self, PyObject *args)
+{
+    PyObject *key = NULL;
+    PyObject *fallback = Py_None;
+    PyObject *value = NULL;
+
+    if (!PyArg_ParseTuple(args, "O|O", &key, &fallback))
+        return NULL;
+
+    value = RecordLookup((_YajlRecord *)(self), key);
+    if (!value) {
+        if (PyErr_Occurred())
+            return NULL;
+        value = fallback;
+    }
+    Py_INCREF(value);
+    return value;
+}
+
+/*
+ * Records are pickled (and copied) as their keys and values, which
+ * yajl._record() puts back together
+ */
+PyObject *py_yajlrecord_reduce(PyObject *self, PyObject *unused)
+{
+    _YajlRecord *record = (_YajlRecord *)(self);
+    PyObject *module = NULL;
+    PyObject *rebuild = NULL;
+    PyObject *values = NULL;
+    Py_ssize_t i;
+
+    module = PyImport_ImportModule("yajl");
+    if (!module)
+        return NULL;
+    rebuild = PyObject_GetAttrString(module, "_record");
+    Py_DECREF(module);
+    if (!rebuild)
+        return NULL;
+
+    values = PyTuple_New(Py_SIZE(record));
+    if (!values) {
+        Py_DECREF(rebuild);
+        return NULL;
+    }
+    for (i = 0; i < Py_SIZE(record); i++) {
+        Py_INCREF(record->values[i]);
+        PyTuple_SET_ITEM(values, i, record->values[i]);
+    }
+    return Py_BuildValue("(N(ON))", rebuild, record->keys, values);
+}
+
+int yajlrecord_traverse(PyObject *self, visitproc visit, void *arg)
+{
+    _YajlRecord *record = (_YajlRecord *)(self);
+    Py_ssize_t i;
+
+#ifdef PY_YAJL_HEAP_TYPES
+    Py_VISIT(Py_TYPE(self));
+#endif
+    Py_VISIT(record->keys);
+    for (i = 0; i < Py_SIZE(record); i++) {
+        Py_VISIT(record->values[i]);
+    }
+    return 0;
+}
+
+void yajlrecord_dealloc(PyObject *self)
+{
+    _YajlRecord *record = (_YajlRecord *)(self);
+    Py_ssize_t i;
+
+    PyObject_GC_UnTrack(self);
+    Py_XDECREF(record->keys);
+    for (i = 0; i < Py_SIZE(record); i++) {
+        Py_XDECREF(record->values[i]);
+    }
+#ifdef PY_YAJL_HEAP_TYPES
+    {
+        PyTypeObject *type = Py_TYPE(self);
+
+        PyObject_GC_Del(self);
+        Py_DECREF(type);
+    }
+#else
+    PyObject_GC_Del(self);
+#endif
+}
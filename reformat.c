@@ -0,0 +1,401 @@
+/*
+ * Copyright 2010, R. Tyler Ballance <tyler@monkeypox.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  3. Neither the name of R. Tyler Ballance nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Reformatting pipes the events of a yajl parser straight into a yajl
+ * generator, as yajl's json_reformat does, without any Python objects in
+ * between; the GIL is released while each chunk of input is parsed
+ */
+
+#include <Python.h>
+
+#include <string.h>
+
+#include <yajl/yajl_parse.h>
+#include <yajl/yajl_gen.h>
+
+#include "py_yajl.h"
+
+typedef struct {
+    yajl_gen generator;
+    yajl_gen_status status;
+    unsigned int depth;
+    int complete;
+    /* the output not yet returned or written to the stream */
+    char *output;
+    size_t used;
+    size_t size;
+    int nomem;
+    /* the stream written to takes bytes rather than str */
+    int binary;
+} py_yajl_reformatter;
+
+#define REFORMATTER(ctx) ((py_yajl_reformatter *)(ctx))
+
+static void reformat_printer(void *ctx, const char *str, unsigned int len)
+{
+    py_yajl_reformatter *r = REFORMATTER(ctx);
+    size_t newsize = r->size;
+    char *output;
+
+    if (r->nomem)
+        return;
+
+    if (r->used + len > r->size) {
+        if (!newsize)
+            newsize = PY_YAJL_READ_SZ;
+        while (r->used + len > newsize)
+            newsize *= 2;
+        output = (char *)(realloc(r->output, newsize));
+        if (!output) {
+            r->nomem = 1;
+            return;
+        }
+        r->output = output;
+        r->size = newsize;
+    }
+    memcpy(r->output + r->used, str, len);
+    r->used += len;
+}
+
+/* Note what the generator made of an event; a false return cancels the parse */
+static int Generated(py_yajl_reformatter *r, yajl_gen_status status)
+{
+    r->status = status;
+    if (!r->depth)
+        r->complete = 1;
+    return (status == yajl_gen_status_ok) && (!r->nomem);
+}
+
+static int reformat_null(void *ctx)
+{
+    return Generated(REFORMATTER(ctx), yajl_gen_null(REFORMATTER(ctx)->generator));
+}
+
+static int reformat_bool(void *ctx, int value)
+{
+    return Generated(REFORMATTER(ctx), yajl_gen_bool(REFORMATTER(ctx)->generator, value));
+}
+
+static int reformat_number(void *ctx, const char *value, unsigned int length)
+{
+    return Generated(REFORMATTER(ctx),
+            yajl_gen_number(REFORMATTER(ctx)->generator, value, length));
+}
+
+static int reformat_string(void *ctx, const unsigned char *value, unsigned int length)
+{
+    return Generated(REFORMATTER(ctx),
+            yajl_gen_string(REFORMATTER(ctx)->generator, value, length));
+}
+
+static int reformat_start_map(void *ctx)
+{
+    yajl_gen_status status = yajl_gen_map_open(REFORMATTER(ctx)->generator);
+
+    REFORMATTER(ctx)->depth++;
+    return Generated(REFORMATTER(ctx), status);
+}
+
+static int reformat_end_map(void *ctx)
+{
+    REFORMATTER(ctx)->depth--;
+    return Generated(REFORMATTER(ctx), yajl_gen_map_close(REFORMATTER(ctx)->generator));
+}
+
+static int reformat_start_array(void *ctx)
+{
+    yajl_gen_status status = yajl_gen_array_open(REFORMATTER(ctx)->generator);
+
+    REFORMATTER(ctx)->depth++;
+    return Generated(REFORMATTER(ctx), status);
+}
+
+static int reformat_end_array(void *ctx)
+{
+    REFORMATTER(ctx)->depth--;
+    return Generated(REFORMATTER(ctx), yajl_gen_array_close(REFORMATTER(ctx)->generator));
+}
+
+static yajl_callbacks reformat_callbacks = {
+    reformat_null,
+    reformat_bool,
+    NULL,
+    NULL,
+    reformat_number,
+    reformat_string,
+    reformat_start_map,
+    reformat_string,
+    reformat_end_map,
+    reformat_start_array,
+    reformat_end_array
+};
+
+#ifdef IS_PYTHON3
+/*
+ * The length of the UTF-8 in `buffer` up to a multi-byte sequence cut
+ * short at its end, if any, which can't be decoded until it's completed
+ */
+static size_t CompleteUTF8(const char *buffer, size_t length)
+{
+    size_t i = length;
+    unsigned char lead;
+    size_t needed;
+
+    while ( (i > 0) && (length - i < 3) &&
+            (((unsigned char)(buffer[i - 1]) & 0xC0) == 0x80) ) {
+        i--;
+    }
+    if (i == 0)
+        return length;
+
+    lead = (unsigned char)(buffer[i - 1]);
+    if (lead < 0xC0)
+        return length;
+    needed = (lead >= 0xF0) ? 4 : ((lead >= 0xE0) ? 3 : 2);
+    return (length - (i - 1) < needed) ? i - 1 : length;
+}
+#endif
+
+/* The first `length` bytes of output as a str, or bytes for binary streams */
+static PyObject *OutputString(py_yajl_reformatter *r, size_t length)
+{
+#ifdef IS_PYTHON3
+    if (r->binary)
+        return PyBytes_FromStringAndSize(r->output, (Py_ssize_t)(length));
+    return PyUnicode_DecodeUTF8(r->output, (Py_ssize_t)(length), "strict");
+#else
+    return PyString_FromStringAndSize(r->output, (Py_ssize_t)(length));
+#endif
+}
+
+/* Write what output there is to `stream`, all of it if `final` is set */
+static int Flush(py_yajl_reformatter *r, PyObject *stream, int final)
+{
+    size_t length = r->used;
+    PyObject *text = NULL;
+    PyObject *written = NULL;
+
+#ifdef IS_PYTHON3
+    if ( (!final) && (!r->binary) )
+        length = CompleteUTF8(r->output, length);
+#endif
+    if (!length)
+        return success;
+
+    text = OutputString(r, length);
+    if (!text)
+        return failure;
+    written = PyObject_CallMethod(stream, "write", "O", text);
+    Py_DECREF(text);
+    if (!written)
+        return failure;
+    Py_DECREF(written);
+
+    memmove(r->output, r->output + length, r->used - length);
+    r->used -= length;
+    return success;
+}
+
+#ifdef IS_PYTHON3
+/* isinstance(object, module.name), or -1 on error */
+static int IsInstance(PyObject *object, PyObject *module, const char *name)
+{
+    PyObject *type = PyObject_GetAttrString(module, name);
+    int rc;
+
+    if (!type)
+        return -1;
+    rc = PyObject_IsInstance(object, type);
+    Py_DECREF(type);
+    return rc;
+}
+
+/*
+ * Whether `stream` takes bytes rather than str: io's binary streams do, as
+ * do other files opened in a binary mode; returns -1 on error
+ */
+static int BinaryStream(PyObject *stream)
+{
+    PyObject *io = PyImport_ImportModule("io");
+    PyObject *mode = NULL;
+    int text, binary = 0;
+
+    if (!io)
+        return -1;
+    text = IsInstance(stream, io, "TextIOBase");
+    if (text == 0)
+        binary = IsInstance(stream, io, "BufferedIOBase");
+    if ( (text == 0) && (binary == 0) )
+        binary = IsInstance(stream, io, "RawIOBase");
+    Py_DECREF(io);
+    if ( (text < 0) || (binary < 0) )
+        return -1;
+    if ( (text) || (binary) )
+        return binary;
+
+    /* otherwise go by the mode it was opened in, if it has one */
+    mode = PyObject_GetAttrString(stream, "mode");
+    if (!mode) {
+        PyErr_Clear();
+        return 0;
+    }
+    binary = ( (PyUnicode_Check(mode)) &&
+            (PyUnicode_FindChar(mode, 'b', 0, PyUnicode_GET_LENGTH(mode), 1) >= 0) );
+    Py_DECREF(mode);
+    return binary;
+}
+#endif
+
+/*
+ * Read the next chunk of the document from `reader` into `chunk`, as UTF-8
+ * bytes; returns failure with an exception set if it couldn't be read
+ */
+int _internal_read_chunk(PyObject *reader, PyObject **chunk)
+{
+    PyObject *encoded = NULL;
+
+    *chunk = PyObject_CallMethod(reader, "read", "i", PY_YAJL_READ_SZ);
+    if (!*chunk)
+        return failure;
+
+    if (PyUnicode_Check(*chunk)) {
+        encoded = PyUnicode_AsUTF8String(*chunk);
+        Py_DECREF(*chunk);
+        *chunk = encoded;
+        if (!encoded)
+            return failure;
+    }
+    if (!PyString_Check(*chunk)) {
+        PyErr_SetString(PyExc_TypeError, "read() should return a string");
+        Py_CLEAR(*chunk);
+        return failure;
+    }
+    return success;
+}
+
+/*
+ * Reformat the JSON document held by the str or bytes `document`, or read
+ * from `reader` if that's NULL, according to `config`. The output is
+ * returned as a str, or written to `stream` as it's generated if given,
+ * in which case True is returned
+ */
+PyObject *_internal_reformat(PyObject *document, PyObject *reader,
+        yajl_gen_config config, PyObject *stream)
+{
+    yajl_handle parser = NULL;
+    yajl_parser_config parser_config = { 1, 1 };
+    yajl_status yrc = yajl_status_ok;
+    py_yajl_reformatter r;
+    PyObject *chunk = NULL;
+    PyObject *result = NULL;
+    char *buffer = NULL;
+    Py_ssize_t length = 0;
+    Py_ssize_t offset = 0;
+    unsigned int consumed = 0;
+    int done = 0;
+
+    memset(&r, 0, sizeof(py_yajl_reformatter));
+#ifdef IS_PYTHON3
+    if (stream) {
+        r.binary = BinaryStream(stream);
+        if (r.binary < 0)
+            return NULL;
+    }
+#endif
+    r.generator = yajl_gen_alloc2(reformat_printer, &config, NULL, (void *)(&r));
+    parser = yajl_alloc(&reformat_callbacks, &parser_config, NULL, (void *)(&r));
+
+    while (!done) {
+        if (reader) {
+            if (!_internal_read_chunk(reader, &chunk))
+                goto exit;
+            PyString_AsStringAndSize(chunk, &buffer, &length);
+        } else {
+            buffer = PyString_AS_STRING(document) + offset;
+            length = PyString_GET_SIZE(document) - offset;
+            if (length > PY_YAJL_READ_SZ)
+                length = PY_YAJL_READ_SZ;
+            offset += length;
+        }
+
+        /* an empty read, or the end of the document, completes the parse */
+        Py_BEGIN_ALLOW_THREADS
+        if (length)
+            yrc = yajl_parse(parser, (const unsigned char *)(buffer), (unsigned int)(length));
+        else
+            yrc = yajl_parse_complete(parser);
+        consumed = yajl_get_bytes_consumed(parser);
+        Py_END_ALLOW_THREADS
+        done = (!length) || (yrc == yajl_status_client_canceled) ||
+            (yrc == yajl_status_error);
+
+        if (yrc == yajl_status_error) {
+            _internal_parse_error(parser, buffer, (unsigned int)(length));
+            goto exit;
+        }
+        /* once the document is complete yajl leaves the rest unparsed */
+        if ( (length) && (yrc == yajl_status_ok) && (r.complete) &&
+                (!_internal_check_trailing(buffer + consumed,
+                                           (unsigned int)(length) - consumed)) ) {
+            goto exit;
+        }
+        Py_CLEAR(chunk);
+
+        if ( (stream) && (!r.nomem) && (!Flush(&r, stream, 0)) )
+            goto exit;
+    }
+
+    if (r.nomem) {
+        PyErr_NoMemory();
+    } else if (r.status == yajl_max_depth_exceeded) {
+        PyErr_SetString(PyExc_ValueError, "The document is nested too deeply to generate");
+    } else if (r.status != yajl_gen_status_ok) {
+        PyErr_SetString(PyExc_ValueError, "Failed to generate the document");
+    } else if ( (yrc != yajl_status_ok) || (!r.complete) ) {
+        PyErr_SetString(PyExc_ValueError, "The document is incomplete");
+    } else if (stream) {
+        if (Flush(&r, stream, 1)) {
+            Py_INCREF(Py_True);
+            result = Py_True;
+        }
+    } else {
+        result = OutputString(&r, r.used);
+    }
+
+  exit:
+    Py_XDECREF(chunk);
+    yajl_free(parser);
+    yajl_gen_free(r.generator);
+    free(r.output);
+    return result;
+}
@@ -19,12 +19,21 @@ if os.path.exists('.git'):
     except:
         pass
 
+# yajl.stats() counters cost a little on every decode and encode; building
+# with PY_YAJL_STATS=0 in the environment compiles them out
+define_macros = []
+if os.environ.get('PY_YAJL_STATS', '1') != '0':
+    define_macros.append(('PY_YAJL_STATS', '1'))
 
 base_modules = [
     Extension('yajl',  [
                 'yajl.c',
                 'encoder.c',
                 'decoder.c',
+                'record.c',
+                'stats.c',
+                'reformat.c',
+                'iterator.c',
                 'yajl_hacks.c',
                 'yajl/src/yajl_alloc.c',
                 'yajl/src/yajl_buf.c',
@@ -35,6 +44,7 @@ base_modules = [
                 'yajl/src/yajl_parser.c',
             ],
             include_dirs=('.', 'includes/', 'yajl/src'),
+            define_macros=define_macros,
             extra_compile_args=['-Wall', '-DMOD_VERSION="%s"' % version],
             language='c'),
         ]
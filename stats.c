@@ -0,0 +1,174 @@
+/*
+ * Copyright 2010, R. Tyler Ballance <tyler@monkeypox.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  3. Neither the name of R. Tyler Ballance nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Runtime statistics behind yajl.stats(), counted per module (and so per
+ * interpreter) on the decoding and encoding hot paths
+ */
+#include <Python.h>
+#include <time.h>
+
+#include "py_yajl.h"
+
+#ifdef PY_YAJL_STATS
+static const char *object_kinds[py_yajl_stat_kinds] = {
+    "null", "bool", "int", "float", "str", "key", "list", "dict", "record", "array"
+};
+
+/* Monotonic nanoseconds, or -1 where there's no clock to be had */
+long long _internal_stats_clock(void)
+{
+#if PY_VERSION_HEX >= 0x030D0000
+    PyTime_t now;
+
+    if (PyTime_PerfCounterRaw(&now) < 0) {
+        PyErr_Clear();
+        return -1;
+    }
+    return (long long)(now);
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now))
+        return -1;
+    return (long long)(now.tv_sec) * 1000000000LL + now.tv_nsec;
+#else
+    return -1;
+#endif
+}
+
+/* Count a call which began at `start` in its log2 bucket of `histogram` */
+void _internal_stats_latency(py_yajl_counter *histogram, long long start)
+{
+    long long elapsed;
+    int bucket = 0;
+
+    if (start < 0)
+        return;
+    elapsed = _internal_stats_clock() - start;
+    if (elapsed < 0)
+        return;
+    while ( (elapsed >>= 1) && (bucket < PY_YAJL_LATENCY_BUCKETS - 1) )
+        bucket++;
+    PY_YAJL_COUNTER_ADD(&histogram[bucket], 1);
+}
+
+static int SetCounter(PyObject *dict, const char *name, py_yajl_counter *counter)
+{
+    PyObject *value = PyLong_FromLongLong(PY_YAJL_COUNTER_LOAD(counter));
+    int rc = -1;
+
+    if (value) {
+        rc = PyDict_SetItemString(dict, name, value);
+        Py_DECREF(value);
+    }
+    return rc;
+}
+
+static int SetHistogram(PyObject *dict, const char *name, py_yajl_counter *histogram)
+{
+    PyObject *list = PyList_New(PY_YAJL_LATENCY_BUCKETS);
+    PyObject *value = NULL;
+    int rc = -1;
+    int i;
+
+    if (!list)
+        return -1;
+    for (i = 0; i < PY_YAJL_LATENCY_BUCKETS; i++) {
+        value = PyLong_FromLongLong(PY_YAJL_COUNTER_LOAD(&histogram[i]));
+        if (!value) {
+            Py_DECREF(list);
+            return -1;
+        }
+        PyList_SET_ITEM(list, i, value);
+    }
+    rc = PyDict_SetItemString(dict, name, list);
+    Py_DECREF(list);
+    return rc;
+}
+#endif
+
+/* Returns a new dict of the module's statistics, empty if they're compiled out */
+PyObject *_internal_stats_dict(py_yajl_module_state *module)
+{
+    PyObject *result = PyDict_New();
+#ifdef PY_YAJL_STATS
+    py_yajl_stats *stats = &(module->stats);
+    PyObject *objects = NULL;
+    int i;
+
+    if (!result)
+        return NULL;
+
+    objects = PyDict_New();
+    if (!objects)
+        goto error;
+    for (i = 0; i < py_yajl_stat_kinds; i++) {
+        if (SetCounter(objects, object_kinds[i], &(stats->objects[i])) < 0)
+            goto error;
+    }
+    if (PyDict_SetItemString(result, "objects", objects) < 0)
+        goto error;
+    Py_CLEAR(objects);
+
+    if ( (SetCounter(result, "decoded_documents", &(stats->decoded_documents)) < 0) ||
+            (SetCounter(result, "decoded_bytes", &(stats->decoded_bytes)) < 0) ||
+            (SetCounter(result, "encoded_documents", &(stats->encoded_documents)) < 0) ||
+            (SetCounter(result, "encoded_bytes", &(stats->encoded_bytes)) < 0) ||
+            (SetCounter(result, "buffer_resizes", &(stats->buffer_resizes)) < 0) ||
+            (SetCounter(result, "default_calls", &(stats->default_calls)) < 0) ||
+            (SetHistogram(result, "decode_latency", stats->decode_latency) < 0) ||
+            (SetHistogram(result, "encode_latency", stats->encode_latency) < 0) ) {
+        goto error;
+    }
+    return result;
+
+  error:
+    Py_XDECREF(objects);
+    Py_XDECREF(result);
+    return NULL;
+#else
+    return result;
+#endif
+}
+
+void _internal_stats_reset(py_yajl_module_state *module)
+{
+#ifdef PY_YAJL_STATS
+    py_yajl_counter *counters = (py_yajl_counter *)(&(module->stats));
+    size_t i;
+
+    for (i = 0; i < sizeof(py_yajl_stats) / sizeof(py_yajl_counter); i++) {
+        PY_YAJL_COUNTER_STORE(&counters[i], 0);
+    }
+#endif
+}
@@ -58,6 +58,15 @@ class BasicJSONDecodeTests(DecoderBase):
             {"key" : {"subkey" : [1, 2, 3]}}''',
                 {'key' : {'subkey' : [1,2,3]}})
 
+    def test_EmptyContainers(self):
+        self.assertDecodesTo('[[], {}, [{}]]', [[], {}, [{}]])
+
+    def test_LargeList(self):
+        self.assertDecodesTo('[%s]' % ','.join(['1'] * 1000), [1] * 1000)
+
+    def test_DuplicateKeys(self):
+        self.assertDecodesTo('{"a" : 1, "a" : 2}', {'a' : 2})
+
 
 class EncoderBase(unittest.TestCase):
     def encode(self, value):
@@ -110,6 +119,273 @@ class BasicJSONEncodeTests(EncoderBase):
         assert rc == '["foo"]', ('Failed to encode JSON correctly', locals())
         return True
 
+class RepeatedKeysEncodeTests(EncoderBase):
+    def test_ListOfDicts(self):
+        rows = [{'id' : i, 'na"me' : 'x'} for i in range(3)]
+        rc = yajl.loads(self.encode(rows))
+        self.assertEqual(rc, rows)
+
+    def test_EqualNumericKeys(self):
+        ''' Keys which compare equal but stringify differently '''
+        rc = self.encode([{1 : 'a'}, {1.0 : 'b'}, {True : 'c'}, {1 : 'd'}])
+        self.assertEqual(rc, '[{"1":"a"},{"1.0":"b"},{"True":"c"},{"1":"d"}]')
+
+class SlotsPoint(object):
+    __slots__ = ('x', 'y', '__weakref__')
+
+    def __init__(self, x, y=None):
+        self.x = x
+        if y is not None:
+            self.y = y
+
+class NativeObjectsEncodeTests(unittest.TestCase):
+    def encode(self, value):
+        return yajl.dumps(value, native_objects=True)
+
+    def test_Namedtuple(self):
+        if sys.version_info >= (2, 6):
+            from collections import namedtuple
+            Point = namedtuple('Point', 'x y')
+            self.assertEqual(self.encode([Point(1, 'a'), (2, 3)]), '[{"x":1,"y":"a"},[2,3]]')
+            self.assertEqual(yajl.dumps(Point(1, 2)), '[1,2]')
+
+    def test_Dataclass(self):
+        if sys.version_info >= (3, 7):
+            import dataclasses
+            Point = dataclasses.make_dataclass('Point', ['x', 'y'])
+            rc = self.encode({'p' : [Point(1, Point(2.5, None))]})
+            self.assertEqual(rc, '{"p":[{"x":1,"y":{"x":2.5,"y":null}}]}')
+
+    def test_Slots(self):
+        self.assertEqual(self.encode(SlotsPoint(1, [2])), '{"x":1,"y":[2]}')
+        self.assertEqual(self.encode(SlotsPoint(1)), '{"x":1}')
+
+    def test_Other(self):
+        self.failUnlessRaises(TypeError, self.encode, object())
+        self.failUnlessRaises(TypeError, yajl.dumps, SlotsPoint(1))
+
+    def test_Dump(self):
+        stream = StringIO()
+        yajl.dump(SlotsPoint(1), stream, native_objects=True)
+        self.assertEqual(stream.getvalue(), '{"x":1}')
+
+    def test_BadOption(self):
+        self.failUnlessRaises(TypeError, yajl.dumps, [], bogus=True)
+
+
+class NestingEncodeTests(EncoderBase):
+    def test_Deep(self):
+        value = []
+        for i in range(60):
+            value = [{'a' : value}]
+        self.assertEqual(yajl.loads(self.encode(value)), value)
+
+    def test_CircularList(self):
+        value = [1]
+        value.append([value])
+        self.failUnlessRaises(ValueError, self.encode, value)
+
+    def test_CircularDict(self):
+        value = {}
+        value['a'] = {'b' : value}
+        self.failUnlessRaises(ValueError, self.encode, value)
+
+    def test_SharedChild(self):
+        child = [1]
+        self.assertEqual(self.encode([child, {'a' : child}]), '[[1],{"a":[1]}]')
+
+    def test_DefaultLoop(self):
+        class MyEncode(yajl.Encoder):
+            def default(self, obj):
+                return obj
+        self.failUnlessRaises(RuntimeError, MyEncode().encode, [object()])
+
+    def test_NestedEncode(self):
+        class MyEncode(yajl.Encoder):
+            def default(self, obj):
+                return self.encode({'x' : [1]})
+        self.assertEqual(MyEncode().encode({'a' : [object()]}), '{"a":["{\\"x\\":[1]}"]}')
+
+    def test_FailingGenerator(self):
+        def f():
+            yield 1
+            raise KeyError('boom')
+        self.failUnlessRaises(KeyError, self.encode, [f()])
+
+
+class SharedEncoderTests(unittest.TestCase):
+    def test_ReentrantDefault(self):
+        class Nested(yajl.Encoder):
+            def default(self, obj):
+                return self.encode(sorted(obj))
+        self.assertEqual(Nested().encode({'a' : [set([2, 1])]}), '{"a":["[1,2]"]}')
+
+    def test_Threads(self):
+        import threading
+        encoder = yajl.Encoder()
+        decoder = yajl.Decoder()
+        obj = {'key' : [1, 2.5, 'three', None] * 50}
+        expected = yajl.dumps(obj)
+        failures = []
+
+        def work():
+            for i in range(200):
+                if (encoder.encode(obj) != expected) or (decoder.decode(expected) != obj):
+                    failures.append(i)
+
+        threads = [threading.Thread(target=work) for i in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(failures, [])
+
+class ModuleStateTests(unittest.TestCase):
+    def test_Subclasses(self):
+        class MyDecoder(yajl.Decoder):
+            pass
+        class MyEncoder(yajl.Encoder):
+            pass
+        rc = MyDecoder(records=True).decode('[{"a" : 1}]')
+        self.assertTrue(isinstance(rc[0], yajl.Record))
+        self.assertEqual(MyEncoder(native_objects=True).encode(rc), '[{"a":1}]')
+
+    def test_NoRecordInstances(self):
+        self.failUnlessRaises(TypeError, yajl.Record)
+
+    def test_Subinterpreter(self):
+        ''' The module loads into a sub-interpreter with a GIL of its own '''
+        if sys.version_info < (3, 13):
+            return
+        try:
+            import _interpreters
+        except ImportError:
+            return
+        code = '\n'.join(['import sys',
+            'sys.path[:0] = %r' % (sys.path,),
+            'import yajl',
+            'rows = yajl.loads(\'[{"a" : [1, 2.5]}]\', records=True)',
+            'assert yajl.dumps(rows) == \'[{"a":[1,2.5]}]\''])
+        interp = _interpreters.create()
+        try:
+            self.assertEqual(_interpreters.run_string(interp, code), None)
+        finally:
+            _interpreters.destroy(interp)
+
+class StatsTests(unittest.TestCase):
+    def setUp(self):
+        yajl.reset_stats()
+        # empty when built with PY_YAJL_STATS=0
+        self.enabled = bool(yajl.stats())
+
+    def test_Counts(self):
+        if not self.enabled:
+            return
+        json = '[{"a" : [1, 2.5, null, true, "x"]}]'
+        yajl.loads(json)
+        yajl.dumps({'a' : [1, 2]})
+        stats = yajl.stats()
+        self.assertEqual(stats['decoded_documents'], 1)
+        self.assertEqual(stats['decoded_bytes'], len(json))
+        self.assertEqual(stats['encoded_documents'], 1)
+        self.assertEqual(stats['encoded_bytes'], len('{"a":[1,2]}'))
+        self.assertEqual(stats['objects'], {'null' : 1, 'bool' : 1, 'int' : 1,
+                'float' : 1, 'str' : 1, 'key' : 1, 'list' : 2, 'dict' : 1,
+                'record' : 0, 'array' : 0})
+        self.assertEqual(sum(stats['decode_latency']), 1)
+        self.assertEqual(sum(stats['encode_latency']), 1)
+
+    def test_DefaultAndResizes(self):
+        if not self.enabled:
+            return
+        class MyEncoder(yajl.Encoder):
+            def default(self, obj):
+                return sorted(obj)
+        MyEncoder().encode(['x' * 10000, set([1])], size_hint=1)
+        stats = yajl.stats()
+        self.assertEqual(stats['default_calls'], 1)
+        self.assertTrue(stats['buffer_resizes'] > 0)
+
+    def test_Reset(self):
+        yajl.loads('[{"a" : 1}]', records=True)
+        yajl.reset_stats()
+        stats = yajl.stats()
+        if self.enabled:
+            self.assertEqual(stats['decoded_documents'], 0)
+            self.assertEqual(stats['objects']['record'], 0)
+            self.assertEqual(sum(stats['decode_latency']), 0)
+
+class NativeTypesEncodeTests(EncoderBase):
+    def test_Datetime(self):
+        import datetime
+        value = datetime.datetime(2010, 1, 2, 3, 4, 5)
+        self.assertEqual(self.encode([value]), '["2010-01-02T03:04:05"]')
+        value = datetime.datetime(987, 1, 2, 3, 4, 5, 60)
+        self.assertEqual(self.encode(value), '"%s"' % value.isoformat())
+
+    def test_DateAndTime(self):
+        import datetime
+        self.assertEqual(self.encode(datetime.date(2010, 12, 31)), '"2010-12-31"')
+        self.assertEqual(self.encode(datetime.time(23, 59)), '"23:59:00"')
+
+    def test_Timezones(self):
+        if sys.version_info >= (3, 2):
+            import datetime
+            tz = datetime.timezone(-datetime.timedelta(hours=5, minutes=30))
+            value = datetime.datetime(2010, 1, 2, 3, 4, 5, 6, tzinfo=tz)
+            self.assertEqual(self.encode(value), '"2010-01-02T03:04:05.000006-05:30"')
+            value = datetime.datetime(2010, 1, 2, tzinfo=datetime.timezone.utc)
+            self.assertEqual(self.encode(value), '"%s"' % value.isoformat())
+            self.assertEqual(self.encode(datetime.time(1, tzinfo=tz)), '"01:00:00-05:30"')
+
+    def test_UUID(self):
+        import uuid
+        value = uuid.UUID('12345678-9abc-def0-0fed-cba987654321')
+        self.assertEqual(self.encode({'id' : value}), '{"id":"12345678-9abc-def0-0fed-cba987654321"}')
+
+    def test_Decimal(self):
+        import decimal
+        self.assertEqual(self.encode([decimal.Decimal('1.10'), decimal.Decimal('-2E+3')]), '[1.10,-2E+3]')
+        self.failUnlessRaises(TypeError, self.encode, decimal.Decimal('NaN'))
+
+    def test_Default(self):
+        import datetime
+        class MyEncode(yajl.Encoder):
+            def default(self, obj):
+                return 'default'
+        self.assertEqual(MyEncode().encode(datetime.date(2010, 1, 1)), '"default"')
+
+
+class BufferEncodeTests(EncoderBase):
+    def test_Integers(self):
+        if is_python3():
+            import array
+            self.assertEqual(self.encode(array.array('h', [1, -2, 3])), '[1,-2,3]')
+            self.assertEqual(self.encode({'a' : array.array('L', [0, 7])}), '{"a":[0,7]}')
+            self.assertEqual(self.encode(array.array('i')), '[]')
+            self.assertEqual(self.encode(array.array('Q', [18446744073709551615])), '[18446744073709551615]')
+            self.assertEqual(self.encode(array.array('q', [-9223372036854775808])), '[-9223372036854775808]')
+
+    def test_Floats(self):
+        if is_python3():
+            import array
+            self.assertEqual(yajl.loads(self.encode(array.array('d', [1.5, -0.25]))), [1.5, -0.25])
+            self.assertEqual(yajl.loads(self.encode(array.array('f', [0.5]))), [0.5])
+
+    def test_Memoryview(self):
+        if sys.version_info >= (3, 3):
+            import array
+            view = memoryview(array.array('i', range(6))).cast('B').cast('i', [2, 3])
+            self.assertEqual(self.encode(view), '[[0,1,2],[3,4,5]]')
+            self.assertEqual(self.encode(view[::2]), '[[0,1,2]]')
+
+    def test_Bytearray(self):
+        if sys.version_info >= (2, 6):
+            self.failUnlessRaises(TypeError, self.encode, bytearray('ab'.encode('ascii')))
+
+    def test_LongIntegers(self):
+        self.assertEqual(self.encode([0, -1, 9223372036854775807]), '[0,-1,9223372036854775807]')
+
 
 
 class LoadsTest(BasicJSONDecodeTests):
@@ -130,6 +406,409 @@ class ErrorCasesTests(unittest.TestCase):
     def test_None(self):
         self.failUnlessRaises(ValueError, self.d.decode, None)
 
+    def test_ReuseAfterError(self):
+        self.failUnlessRaises(ValueError, self.d.decode, '{"a" : [1, 2, {"b" ]}')
+        self.assertEqual(self.d.decode('{"a" : [1]}'), {'a' : [1]})
+
+
+class DecoderGCTests(unittest.TestCase):
+    def setUp(self):
+        import gc
+        self.gc = gc
+        self.doc = '[%s]' % ','.join(['{"a" : [1, 2]}'] * 2000)
+
+    def tearDown(self):
+        self.gc.enable()
+
+    def test_disable_gc(self):
+        rc = yajl.Decoder(disable_gc=True).decode(self.doc)
+        self.assertEqual(len(rc), 2000)
+        self.assertTrue(self.gc.isenabled())
+
+    def test_auto(self):
+        rc = yajl.loads(self.doc)
+        self.assertEqual(rc[-1], {'a' : [1, 2]})
+        self.assertTrue(self.gc.isenabled())
+
+    def test_leaves_disabled_gc_alone(self):
+        self.gc.disable()
+        yajl.loads(self.doc, disable_gc=True)
+        self.assertFalse(self.gc.isenabled())
+
+    def test_error(self):
+        self.failUnlessRaises(ValueError, yajl.loads, self.doc[:-1], disable_gc=True)
+        self.assertTrue(self.gc.isenabled())
+
+    def test_threads(self):
+        import threading
+        doc = '[%s]' % ','.join(['{"a" : [1, 2]}'] * 20000)
+        threads = [threading.Thread(target=yajl.loads, args=(doc,),
+                kwargs={'disable_gc' : True}) for i in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertTrue(self.gc.isenabled())
+
+    def test_bad_option(self):
+        self.failUnlessRaises(TypeError, yajl.loads, '[]', bogus=True)
+
+
+class InternValuesTests(unittest.TestCase):
+    def test_shared(self):
+        rc = yajl.loads('[{"type" : "Bar"}, {"type" : "Bar"}, "Baz"]',
+                intern_values=True)
+        self.assertEqual(rc, [{'type' : 'Bar'}, {'type' : 'Bar'}, 'Baz'])
+        self.assertTrue(rc[0]['type'] is rc[1]['type'])
+
+    def test_long_values(self):
+        value = 'x' * 100
+        rc = yajl.Decoder(intern_values=True).decode('["%s", "%s"]' % (value, value))
+        self.assertEqual(rc, [value, value])
+
+    def test_reuse(self):
+        d = yajl.Decoder(intern_values=True)
+        self.assertEqual(d.decode('["\\u00e9", "a"]'), [u'\u00e9', 'a'])
+        self.assertEqual(d.decode('["\\u00e9", "b"]'), [u'\u00e9', 'b'])
+
+
+class NumericArraysTests(unittest.TestCase):
+    def decode(self, json):
+        return yajl.loads(json, numeric_arrays=True)
+
+    def test_floats(self):
+        rc = self.decode('{"a" : [1.5, -2e3, 0.25], "b" : [[0.5], []]}')
+        self.assertEqual(rc['a'].typecode, 'd')
+        self.assertEqual(list(rc['a']), [1.5, -2000.0, 0.25])
+        self.assertEqual(list(rc['b'][0]), [0.5])
+        self.assertEqual(rc['b'][1], [])
+
+    def test_integers(self):
+        rc = self.decode('[1, -2, 3]')
+        self.assertEqual(list(rc), [1, -2, 3])
+        if sys.version_info >= (3, 3):
+            self.assertEqual(rc.typecode, 'q')
+
+    def test_int64_limits(self):
+        values = [1600000000000000000, 9223372036854775807, -9223372036854775808]
+        rc = self.decode(yajl.dumps(values))
+        self.assertEqual(list(rc), values)
+        if sys.version_info >= (3, 3):
+            self.assertEqual(rc.typecode, 'q')
+        self.assertEqual(self.decode('[1, 9223372036854775808]'), [1, 9223372036854775808])
+        self.assertEqual(self.decode('[1, -9223372036854775809]'), [1, -9223372036854775809])
+
+    def test_mixed(self):
+        self.assertEqual(self.decode('[1, 2.5]'), [1, 2.5])
+        self.assertEqual(self.decode('[1.5, 2.5, "a"]'), [1.5, 2.5, 'a'])
+        self.assertEqual(self.decode('[0.5, [1.5], null]')[2], None)
+        self.assertEqual(self.decode('[1, 123456789012345678901]'), [1, 123456789012345678901])
+        rc = self.decode('[0.5, 1.5, {"a" : [2.5]}]')
+        self.assertEqual(rc[:2], [0.5, 1.5])
+        self.assertEqual(list(rc[2]['a']), [2.5])
+
+    def test_off(self):
+        self.assertEqual(yajl.loads('[1.5, 2.5]'), [1.5, 2.5])
+
+
+class RecordsDecodeTests(unittest.TestCase):
+    def decode(self, json):
+        return yajl.loads(json, records=True)
+
+    def test_records(self):
+        rc = self.decode('[{"a" : 1, "b" : [2]}, {"a" : 3, "b" : null}]')
+        self.assertEqual(rc, [{'a' : 1, 'b' : [2]}, {'a' : 3, 'b' : None}])
+        self.assertTrue(isinstance(rc[0], yajl.Record))
+        self.assertEqual(rc[1]['a'], 3)
+        self.assertEqual(rc[1].get('c', 4), 4)
+        self.assertEqual(list(rc[0]), ['a', 'b'])
+        self.assertEqual(rc[0].items(), [('a', 1), ('b', [2])])
+        self.assertEqual(dict(rc[1]), {'a' : 3, 'b' : None})
+        self.assertTrue('b' in rc[0])
+        self.failUnlessRaises(KeyError, lambda: rc[0]['c'])
+
+    def test_mixed_shapes(self):
+        rc = self.decode('[{"a" : 1}, {"b" : 2}, {"a" : 3}, 4, {}]')
+        self.assertEqual(rc, [{'a' : 1}, {'b' : 2}, {'a' : 3}, 4, {}])
+
+    def test_only_within_arrays(self):
+        rc = self.decode('{"rows" : [{"a" : {"b" : 1}}]}')
+        self.assertTrue(isinstance(rc, dict))
+        self.assertTrue(isinstance(rc['rows'][0], yajl.Record))
+        self.assertTrue(isinstance(rc['rows'][0]['a'], dict))
+
+    def test_duplicate_keys(self):
+        rc = self.decode('[{"a" : 1, "a" : 2}]')
+        self.assertEqual(rc, [{'a' : 2}])
+
+    def test_round_trip(self):
+        json = '[{"a":1,"b":"c"},{"a":2,"b":"d"}]'
+        self.assertEqual(yajl.dumps(self.decode(json)), json)
+
+    def test_pickle(self):
+        import pickle
+        rc = self.decode('[{"a" : 1, "b" : [2]}, {"a" : 3, "b" : null}, {}]')
+        for protocol in range(pickle.HIGHEST_PROTOCOL + 1):
+            copied = pickle.loads(pickle.dumps(rc, protocol))
+            self.assertEqual(copied, rc)
+            self.assertTrue(isinstance(copied[0], yajl.Record))
+            self.assertEqual(list(copied[1]), ['a', 'b'])
+
+    def test_copy(self):
+        import copy
+        rc = self.decode('[{"a" : 1, "b" : [2]}]')[0]
+        copied = copy.deepcopy(rc)
+        self.assertEqual(copied, rc)
+        self.assertTrue(isinstance(copied, yajl.Record))
+        self.failIf(copied['b'] is rc['b'])
+        self.assertTrue(copy.copy(rc)['b'] is rc['b'])
+
+
+class LoadsColumnarTests(unittest.TestCase):
+    def test_columns(self):
+        rc = yajl.loads_columnar('[{"a" : 1, "b" : 1.5, "c" : "x"}, {"a" : -2, "b" : 2e3, "c" : null}]')
+        self.assertEqual(sorted(rc.keys()), ['a', 'b', 'c'])
+        self.assertEqual(list(rc['a']), [1, -2])
+        self.assertEqual(list(rc['b']), [1.5, 2000.0])
+        self.assertEqual(rc['c'], ['x', None])
+        self.assertEqual(rc['b'].typecode, 'd')
+        if sys.version_info >= (3, 3):
+            self.assertEqual(rc['a'].typecode, 'q')
+        rc = yajl.loads_columnar('[{"ts" : 1600000000000000000}, {"ts" : -9223372036854775808}]')
+        self.assertEqual(list(rc['ts']), [1600000000000000000, -9223372036854775808])
+        if sys.version_info >= (3, 3):
+            self.assertEqual(rc['ts'].typecode, 'q')
+
+    def test_mixed_numbers(self):
+        rc = yajl.loads_columnar('[{"a" : 1}, {"a" : 2.5}, {"a" : 123456789012345678901}]')
+        self.assertEqual(rc['a'], [1, 2.5, 123456789012345678901])
+
+    def test_missing_keys(self):
+        rc = yajl.loads_columnar('[{"a" : 1}, {"b" : [2]}, {"a" : 3, "a" : 4}]')
+        self.assertEqual(rc, {'a' : [1, None, 4], 'b' : [None, [2], None]})
+
+    def test_path(self):
+        rc = yajl.loads_columnar('{"meta" : [1], "data" : {"rows" : [{"id" : 7}]}}', path='/data/rows')
+        self.assertEqual(list(rc['id']), [7])
+        self.assertEqual(yajl.loads_columnar('{"rows" : []}', path='/rows'), {})
+
+    def test_bad_rows(self):
+        self.failUnlessRaises(ValueError, yajl.loads_columnar, '[{"a" : 1}, 2]')
+        self.failUnlessRaises(ValueError, yajl.loads_columnar, '[[1]]')
+        self.failUnlessRaises(ValueError, yajl.loads_columnar, '{"rows" : {}}', path='/rows')
+        self.failUnlessRaises(ValueError, yajl.loads_columnar, '[{"a" : 1}', path='/')
+
+
+class ValidateTests(unittest.TestCase):
+    def test_valid(self):
+        self.assertEqual(yajl.validate('{"a" : [1, 2.5, "x", true, null]}'), True)
+        self.assertEqual(yajl.validate(u'["é中"]'), True)
+        self.assertEqual(yajl.validate('12345'), True)
+
+    def test_invalid(self):
+        for json in ('', ' ', '[1', '{"a" : }', '[1,]', '{1 : 2}', 'nul', '"abc',
+                '[1] x', '[1] [2]', '12 3'):
+            self.failUnlessRaises(ValueError, yajl.validate, json)
+        self.failUnlessRaises(ValueError, yajl.validate, None)
+        self.assertEqual(yajl.validate('[1] \n'), True)
+
+    def test_max_depth(self):
+        self.assertEqual(yajl.validate('[[{"a" : [1]}]]', max_depth=4), True)
+        self.failUnlessRaises(ValueError, yajl.validate, '[[{"a" : [1]}]]', max_depth=3)
+        self.assertEqual(yajl.validate('1', max_depth=0), True)
+        self.failUnlessRaises(ValueError, yajl.validate, '[]', max_depth=0)
+
+    def test_max_size(self):
+        self.assertEqual(yajl.validate('[1, 2]', max_size=6), True)
+        self.failUnlessRaises(ValueError, yajl.validate, '[1, 2]', max_size=5)
+        # the size counts UTF-8 bytes rather than characters
+        self.failUnlessRaises(ValueError, yajl.validate, u'"é"', max_size=3)
+
+
+class ReformatTests(unittest.TestCase):
+    def test_minify(self):
+        rc = yajl.reformat(' { "a" : [1, 2.50, "x\\ny"],\n "b" : {"c" : null, "d" : true} } ')
+        self.assertEqual(rc, '{"a":[1,2.50,"x\\ny"],"b":{"c":null,"d":true}}')
+
+    def test_indent(self):
+        json = '{"a":[1,{}],"b":false}'
+        self.assertEqual(yajl.reformat(json, indent=2), yajl.dumps(yajl.loads(json), indent=2))
+        self.assertEqual(yajl.reformat(json, indent=0), yajl.dumps(yajl.loads(json), indent=0))
+
+    def test_unicode(self):
+        rc = yajl.reformat(u'[ "é中" ]')
+        self.assertEqual(yajl.loads(rc), [u'é中'])
+
+    def test_invalid(self):
+        for json in ('', '[1', '{"a" : }', '[1,]', '[1] garbage', '[1] [2]'):
+            self.failUnlessRaises(ValueError, yajl.reformat, json)
+        self.assertEqual(yajl.reformat('[1] \n'), '[1]')
+        self.failUnlessRaises(ValueError, yajl.reformat, None)
+        self.failUnlessRaises(TypeError, yajl.reformat, '[]', indent='  ')
+        self.failUnlessRaises(TypeError, yajl.reformat, '[]', stream='no stream')
+
+    def test_streams(self):
+        # large enough to be parsed and written out in several chunks
+        obj = [{'id' : i, 'name' : u'récord %d' % i} for i in range(20000)]
+        output = StringIO()
+        self.assertEqual(yajl.reformat(StringIO(yajl.dumps(obj, indent=4)), stream=output), True)
+        self.assertEqual(yajl.loads(output.getvalue()), obj)
+        self.failIf('\n' in output.getvalue())
+        output = StringIO()
+        yajl.reformat(yajl.dumps(obj), indent=1, stream=output)
+        self.assertEqual(yajl.loads(output.getvalue()), obj)
+
+    def test_binary_stream(self):
+        try:
+            import io
+        except ImportError:
+            return
+        obj = [{'id' : i, 'name' : u'r\u00e9cord %d' % i} for i in range(20000)]
+        output = io.BytesIO()
+        self.assertEqual(yajl.reformat(yajl.dumps(obj, ensure_ascii=False), stream=output), True)
+        self.assertEqual(yajl.loads(output.getvalue().decode('utf-8')), obj)
+
+
+class ParseEventsTests(unittest.TestCase):
+    json = '{"a" : [1, {"b" : null}, 2.5], "c" : "x", "d" : {"e" : true}}'
+    events = [
+        ('', 'start_map', None),
+        ('', 'map_key', 'a'),
+        ('a', 'start_array', None),
+        ('a.item', 'number', 1),
+        ('a.item', 'start_map', None),
+        ('a.item', 'map_key', 'b'),
+        ('a.item.b', 'null', None),
+        ('a.item', 'end_map', None),
+        ('a.item', 'number', 2.5),
+        ('a', 'end_array', None),
+        ('', 'map_key', 'c'),
+        ('c', 'string', 'x'),
+        ('', 'map_key', 'd'),
+        ('d', 'start_map', None),
+        ('d', 'map_key', 'e'),
+        ('d.e', 'boolean', True),
+        ('d', 'end_map', None),
+        ('', 'end_map', None),
+    ]
+
+    def test_events(self):
+        self.assertEqual(list(yajl.parse_events(self.json)), self.events)
+        self.assertEqual(list(yajl.parse_events(StringIO(self.json))), self.events)
+        self.assertEqual(list(yajl.parse_events('12')), [('', 'number', 12)])
+
+    def test_batches(self):
+        batches = list(yajl.parse_events(self.json, batch=5))
+        self.assertEqual([len(b) for b in batches], [5, 5, 5, 3])
+        self.assertEqual(sum(batches, []), self.events)
+
+    def test_large(self):
+        obj = {'rows' : [{'id' : i, 'tags' : ['a', u'é']} for i in range(20000)]}
+        count = 0
+        for prefix, event, value in yajl.parse_events(StringIO(yajl.dumps(obj))):
+            if prefix == 'rows.item.id':
+                self.assertEqual(value, count)
+                count += 1
+        self.assertEqual(count, 20000)
+
+    def test_invalid(self):
+        for json in ('', '[1', '{"a" : }', '[1,]', '{"a":1} {"b"', '[1] garbage'):
+            self.failUnlessRaises(ValueError, list, yajl.parse_events(json))
+        # trailing data in a later chunk than the end of the document
+        self.failUnlessRaises(ValueError, list, yajl.parse_events(StringIO('[1]' + ' ' * 70000 + 'x')))
+        self.assertEqual(len(list(yajl.parse_events(StringIO('[1]' + ' ' * 70000)))), 3)
+        self.failUnlessRaises(ValueError, yajl.parse_events, None)
+        self.failUnlessRaises(ValueError, yajl.parse_events, '[]', batch=-1)
+
+
+class IterItemsTests(unittest.TestCase):
+    def test_top_level(self):
+        rc = list(yajl.iter_items('[1, "two", {"three" : [3]}, [4], null]'))
+        self.assertEqual(rc, [1, 'two', {'three' : [3]}, [4], None])
+        self.assertEqual(list(yajl.iter_items('[]')), [])
+
+    def test_path(self):
+        json = '{"meta" : [0], "data" : {"items" : [{"id" : 1}, {"id" : 2}], "more" : [3]}}'
+        self.assertEqual(list(yajl.iter_items(json, path='/data/items')), [{'id' : 1}, {'id' : 2}])
+        self.assertEqual(list(yajl.iter_items(json, path='/data/more')), [3])
+        self.failUnlessRaises(ValueError, list, yajl.iter_items(json, path='/nowhere'))
+        self.failUnlessRaises(ValueError, list, yajl.iter_items('{"data" : {}}', path='/data'))
+
+    def test_options(self):
+        rc = list(yajl.iter_items('[{"a" : 1}, {"a" : 2}]', records=True))
+        self.assertEqual(rc, [{'a' : 1}, {'a' : 2}])
+        self.failUnless(isinstance(rc[0], yajl.Record))
+        rc = list(yajl.iter_items('[[1, 2], 3, 4]', numeric_arrays=True))
+        self.assertEqual([list(rc[0]), rc[1], rc[2]], [[1, 2], 3, 4])
+
+    def test_stream(self):
+        obj = {'items' : [{'id' : i, 'name' : u'récord %d' % i} for i in range(20000)]}
+        count = 0
+        for item in yajl.iter_items(StringIO(yajl.dumps(obj)), path='/items'):
+            self.assertEqual(item, obj['items'][count])
+            count += 1
+        self.assertEqual(count, 20000)
+
+    def test_invalid(self):
+        self.failUnlessRaises(ValueError, list, yajl.iter_items('[1, 2'))
+        self.failUnlessRaises(ValueError, list, yajl.iter_items('[1, }'))
+        self.failUnlessRaises(ValueError, list, yajl.iter_items(''))
+        self.failUnlessRaises(ValueError, list, yajl.iter_items('[1] garbage'))
+        self.failUnlessRaises(ValueError, list, yajl.iter_items('[1] [2]'))
+        self.failUnlessRaises(ValueError, list, yajl.iter_items(StringIO('[1]' + ' ' * 70000 + 'x')))
+        self.assertEqual(list(yajl.iter_items('[1] \n')), [1])
+        self.failUnlessRaises(TypeError, yajl.iter_items, '[]', bad_option=True)
+
+
+class FeedTests(unittest.TestCase):
+    def setUp(self):
+        self.decoder = yajl.Decoder()
+
+    def test_chunks(self):
+        json = '{"foo" : ["bar", 1.5, true, null], "baz" : {"qux" : -12}}'
+        rc = []
+        for i in range(0, len(json), 3):
+            rc.extend(self.decoder.feed(json[i:i + 3]))
+        self.assertEqual(rc, [{'foo' : ['bar', 1.5, True, None], 'baz' : {'qux' : -12}}])
+        self.assertEqual(self.decoder.close(), [])
+
+    def test_several(self):
+        self.assertEqual(self.decoder.feed('{"a" : 1}\n[2]\n"th'), [{'a' : 1}, [2]])
+        self.assertEqual(self.decoder.feed('ree"\n4'), ['three'])
+        self.assertEqual(self.decoder.feed('5 '), [45])
+        self.assertEqual(self.decoder.feed('6'), [])
+        self.assertEqual(self.decoder.close(), [6])
+        self.assertEqual(self.decoder.close(), [])
+
+    def test_split_unicode(self):
+        encoded = u'["r\u00e9cord \u4e2d"]'.encode('utf-8')
+        rc = []
+        for i in range(len(encoded)):
+            rc.extend(self.decoder.feed(encoded[i:i + 1]))
+        self.assertEqual(rc, [[u'r\u00e9cord \u4e2d']])
+
+    def test_invalid(self):
+        self.failUnlessRaises(ValueError, self.decoder.feed, '[1, }')
+        self.assertEqual(self.decoder.feed('[1]'), [[1]])
+        self.assertEqual(self.decoder.feed('{"a" : '), [])
+        self.failUnlessRaises(ValueError, self.decoder.close)
+        self.assertEqual(self.decoder.feed(' [2] '), [[2]])
+        self.assertEqual(self.decoder.close(), [])
+        self.failUnlessRaises(ValueError, self.decoder.feed, None)
+
+    def test_reinit(self):
+        self.decoder.feed('[[1, {"a" : [')
+        self.decoder.__init__(intern_values=True)
+        self.assertEqual(self.decoder.feed('[2] '), [[2]])
+        self.assertEqual(self.decoder.decode('["x", "x"]'), ['x', 'x'])
+        self.assertEqual(self.decoder.close(), [])
+
+    def test_decode(self):
+        self.decoder.feed('[1, ')
+        self.failUnlessRaises(ValueError, self.decoder.decode, '[2]')
+        self.assertEqual(self.decoder.feed('3]'), [[1, 3]])
+        self.assertEqual(self.decoder.decode('[2]'), [2])
+
 
 class StreamBlockingDecodingTests(unittest.TestCase):
     def setUp(self):
@@ -167,6 +846,140 @@ class StreamEncodingTests(unittest.TestCase):
         buffer = yajl.dump(obj, stream)
         self.assertEquals(stream.getvalue(), '{"foo":["one","two",["three","four"]]}')
 
+class EnsureAsciiTests(unittest.TestCase):
+    def utf8(self, text):
+        if is_python3():
+            return text
+        return text.encode('utf-8')
+
+    def test_escaped_by_default(self):
+        self.assertEquals(yajl.dumps(u'caf\u00e9'), '"caf\\u00e9"')
+
+    def test_astral_surrogate_pair(self):
+        self.assertEquals(yajl.dumps(u'\U0001f600'), '"\\ud83d\\ude00"')
+        self.assertEquals(yajl.loads(yajl.dumps(u'\U0001f600')), u'\U0001f600')
+
+    def test_raw_utf8(self):
+        rc = yajl.dumps(u'caf\u00e9 \u20ac \U0001f600', ensure_ascii=False)
+        self.assertEquals(rc, self.utf8(u'"caf\u00e9 \u20ac \U0001f600"'))
+
+    def test_raw_keys(self):
+        rc = yajl.Encoder(ensure_ascii=False).encode({u'\u00e9' : 1})
+        self.assertEquals(rc, self.utf8(u'{"\u00e9":1}'))
+
+    def test_raw_still_escapes_ascii(self):
+        rc = yajl.dumps(u'"\u00e9\n\u0001', ensure_ascii=False)
+        self.assertEquals(rc, self.utf8(u'"\\"\u00e9\\n\\u0001"'))
+
+    def test_round_trip(self):
+        obj = {u'\u0105' : [u'\u00e9\u20ac', u'\U0001f600']}
+        self.assertEquals(yajl.loads(yajl.dumps(obj, ensure_ascii=False)), obj)
+
+    def test_subclass_without_init(self):
+        import datetime
+        class MyEncoder(yajl.Encoder):
+            def __init__(self):
+                pass
+        encoder = MyEncoder()
+        self.assertEquals(encoder.encode([u'\u00e9']), '["\\u00e9"]')
+        self.assertEquals(encoder.encode(datetime.date(2010, 1, 2)), '"2010-01-02"')
+
+class DumpbTests(unittest.TestCase):
+    def test_bytes(self):
+        rc = yajl.dumpb({'foo' : [1, 'two']})
+        self.assertEquals(rc, '{"foo":[1,"two"]}'.encode('ascii'))
+        if is_python3():
+            self.failUnless(isinstance(rc, bytes))
+            self.assertEquals(hash(rc), hash(bytes(rc)))
+
+    def test_indent(self):
+        rc = yajl.dumpb({'foo' : 'bar'}, indent=4)
+        self.assertEquals(rc, '{\n    "foo": "bar"\n}\n'.encode('ascii'))
+
+    def test_utf8(self):
+        rc = yajl.Encoder(ensure_ascii=False).encodeb([u'\u00e9\u20ac'])
+        self.assertEquals(rc, u'["\u00e9\u20ac"]'.encode('utf-8'))
+
+    def test_large(self):
+        obj = ['x' * 1000] * 100
+        self.assertEquals(yajl.dumpb(obj), yajl.dumps(obj).encode('ascii'))
+
+    def test_str_with_raw_bytes(self):
+        if is_python3():
+            self.assertEquals(yajl.dumps(['\u00e9'.encode('utf-8')]), '["\u00e9"]')
+
+    def test_invalid_raw_bytes(self):
+        if is_python3():
+            obj = ['ok', '\u00e9'.encode('latin-1')]
+            self.failUnlessRaises(UnicodeDecodeError, yajl.dumps, obj)
+            self.failUnlessRaises(UnicodeDecodeError, yajl.dumpb, obj)
+            self.failUnlessRaises(UnicodeDecodeError, yajl.dumps_into, obj, bytearray())
+            self.assertEquals(yajl.dumpb(['\u00e9'.encode('utf-8')]), '["\u00e9"]'.encode('utf-8'))
+
+class DumpsIntoTests(unittest.TestCase):
+    def setUp(self):
+        if sys.version_info < (2, 6):
+            self.skip = True
+            return
+        self.skip = False
+        self.obj = {'foo' : [1, 'two', None]}
+        self.expected = yajl.dumps(self.obj).encode('ascii')
+
+    def test_bytearray_grows(self):
+        if self.skip:
+            return
+        target = bytearray()
+        written = yajl.dumps_into(self.obj, target)
+        self.assertEquals(written, len(self.expected))
+        self.assertEquals(bytes(target), self.expected)
+
+    def test_offset(self):
+        if self.skip:
+            return
+        target = bytearray('ab'.encode('ascii'))
+        written = yajl.dumps_into(['x' * 1000], target, 2)
+        self.assertEquals(len(target), written + 2)
+        self.assertEquals(bytes(target[:3]), 'ab['.encode('ascii'))
+
+    def test_memoryview(self):
+        if self.skip or sys.version_info < (2, 7):
+            return
+        target = bytearray(100)
+        written = yajl.dumps_into(self.obj, memoryview(target), offset=10)
+        self.assertEquals(bytes(target[10:10 + written]), self.expected)
+        self.assertEquals(len(target), 100)
+
+    def test_out_of_room(self):
+        if self.skip or sys.version_info < (2, 7):
+            return
+        target = memoryview(bytearray(5))
+        self.failUnlessRaises(ValueError, yajl.dumps_into, self.obj, target)
+        self.failUnlessRaises(ValueError, yajl.dumps_into, self.obj, bytearray(5), 6)
+
+    def test_read_only(self):
+        if self.skip:
+            return
+        self.failUnlessRaises(BufferError, yajl.dumps_into, self.obj, self.expected)
+
+class SizeHintTests(unittest.TestCase):
+    def test_hint(self):
+        obj = {'foo' : ['bar'] * 100}
+        expected = yajl.dumps(obj)
+        self.assertEquals(yajl.dumps(obj, size_hint=10), expected)
+        self.assertEquals(yajl.dumps(obj, size_hint=100000), expected)
+        self.assertEquals(yajl.dumpb(obj, size_hint=1), expected.encode('ascii'))
+        self.assertEquals(yajl.Encoder().encode(obj, size_hint=4096), expected)
+
+    def test_learned(self):
+        encoder = yajl.Encoder()
+        for obj in (['x' * 5000], [1], ['y' * 20000], {'a' : None}):
+            self.assertEquals(encoder.encode(obj), yajl.dumps(obj))
+            self.assertEquals(encoder.encodeb(obj), yajl.dumpb(obj))
+
+    def test_negative(self):
+        self.failUnlessRaises(ValueError, yajl.dumps, [], size_hint=-1)
+        self.failUnlessRaises(ValueError, yajl.Encoder().encode, [], size_hint=-1)
+
 class DumpsOptionsTests(unittest.TestCase):
     def test_indent_four(self):
         rc = yajl.dumps({'foo' : 'bar'}, indent=4)
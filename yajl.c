@@ -35,15 +35,168 @@
 
 static PyMethodDef yajldecoder_methods[] = {
     {"decode", (PyCFunction)(py_yajldecoder_decode), METH_VARARGS, NULL},
+    {"feed", (PyCFunction)(py_yajldecoder_feed), METH_VARARGS, NULL},
+    {"close", (PyCFunction)(py_yajldecoder_close), METH_NOARGS, NULL},
     {NULL}
 };
 
 static PyMethodDef yajlencoder_methods[] = {
-    {"encode", (PyCFunction)(py_yajlencoder_encode), METH_VARARGS, NULL},
+    {"encode", (PyCFunction)(py_yajlencoder_encode), METH_VARARGS | METH_KEYWORDS, NULL},
+    {"encodeb", (PyCFunction)(py_yajlencoder_encodeb), METH_VARARGS | METH_KEYWORDS, NULL},
     {"default", (PyCFunction)(py_yajlencoder_default), METH_VARARGS, NULL},
     {NULL}
 };
 
+PyDoc_STRVAR(yajldecoder_doc,
+"Decoder([disable_gc=None, intern_values=False, records=False,\n\
+         numeric_arrays=False])\n\n\
+Yajl-based decoder\n\
+\n\
+If `disable_gc` is True the cyclic garbage collector is kept from running\n\
+while the decoded objects are being built, False leaves it alone, and None\n\
+(the default) only holds it off for large documents. The collector is\n\
+shared by all threads: it's re-enabled once the last of the decodes\n\
+holding it off at the same time is done, if it was enabled before the\n\
+first of them.\n\
+\n\
+If `intern_values` is True, short string values which repeat within a\n\
+document are decoded to one shared string object.\n\
+\n\
+If `records` is True, objects which are elements of an array are decoded\n\
+to compact read-only yajl.Record mappings, which share their keys with the\n\
+previous element when it has the same keys.\n\
+\n\
+If `numeric_arrays` is True, non-empty arrays holding nothing but integers\n\
+(or nothing but floats) are decoded to array.array('q') (or\n\
+array.array('d')) instead of lists; integers which don't fit in 64 bits\n\
+and arrays of integers on Pythons older than 3.3 still give lists.\n\
+\n\
+Besides decode(), documents can be fed to the decoder a chunk at a time as\n\
+they arrive: feed(chunk) returns a list of the documents the chunk\n\
+completed, keeping hold of the rest until later chunks complete it, and\n\
+close() returns those only the end of the stream completes (a number at\n\
+the very end), raising ValueError if a document is left incomplete. Any\n\
+number of documents may follow each other, separated by whitespace as in\n\
+newline-delimited JSON. Invalid input raises ValueError and drops what\n\
+was fed so far.\n\
+");
+
+PyDoc_STRVAR(yajlencoder_doc,
+"Encoder([native_objects=False, ensure_ascii=True])\n\n\
+Yajl-based encoder\n\
+\n\
+If `ensure_ascii` is False, non-ASCII characters are output as they are\n\
+(i.e. as UTF-8) rather than as \\uXXXX escapes; on Python 2 the result is\n\
+then a UTF-8 encoded str.\n\
+\n\
+If `native_objects` is True, dataclasses, namedtuples and objects of\n\
+__slots__ classes without a __dict__ are encoded as JSON objects of their\n\
+fields, without calling default(); the fields of each type are only\n\
+looked up once.\n\
+\n\
+Unless default() is overridden, datetime, date and time objects are\n\
+encoded as ISO 8601 strings (as by their isoformat() method), UUIDs as\n\
+strings of their canonical form and Decimals as numbers.\n\
+\n\
+encode(obj [, size_hint=0]) and encodeb() start out with an output buffer\n\
+of `size_hint` bytes, or else one sized after the encoder's recent output.\n\
+");
+
+PyDoc_STRVAR(yajlrecord_doc,
+"Read-only mapping decoded from a JSON object within an array, sharing\n\
+its tuple of keys with the other records of the same shape");
+
+static PyMethodDef yajlrecord_methods[] = {
+    {"keys", (PyCFunction)(py_yajlrecord_keys), METH_NOARGS, NULL},
+    {"values", (PyCFunction)(py_yajlrecord_values), METH_NOARGS, NULL},
+    {"items", (PyCFunction)(py_yajlrecord_items), METH_NOARGS, NULL},
+    {"get", (PyCFunction)(py_yajlrecord_get), METH_VARARGS, NULL},
+    {"__reduce__", (PyCFunction)(py_yajlrecord_reduce), METH_NOARGS, NULL},
+    {NULL}
+};
+
+PyDoc_STRVAR(yajliterator_doc,
+"Iterator over what's parsed from a JSON document a chunk at a time, as\n\
+returned by yajl.parse_events()");
+
+#ifdef PY_YAJL_HEAP_TYPES
+static PyType_Slot yajldecoder_slots[] = {
+    {Py_tp_dealloc, (void *)(yajldecoder_dealloc)},
+    {Py_tp_doc, (void *)(yajldecoder_doc)},
+    {Py_tp_methods, (void *)(yajldecoder_methods)},
+    {Py_tp_init, (void *)(yajldecoder_init)},
+    {Py_tp_new, (void *)(PyType_GenericNew)},
+    {0, NULL}
+};
+
+static PyType_Spec yajldecoder_spec = {
+    "yajl.YajlDecoder",
+    sizeof(_YajlDecoder),
+    0,
+    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE|Py_TPFLAGS_IMMUTABLETYPE,
+    yajldecoder_slots
+};
+
+static PyType_Slot yajlencoder_slots[] = {
+    {Py_tp_dealloc, (void *)(yajlencoder_dealloc)},
+    {Py_tp_doc, (void *)(yajlencoder_doc)},
+    {Py_tp_methods, (void *)(yajlencoder_methods)},
+    {Py_tp_init, (void *)(yajlencoder_init)},
+    {Py_tp_new, (void *)(yajlencoder_new)},
+    {0, NULL}
+};
+
+static PyType_Spec yajlencoder_spec = {
+    "yajl.YajlEncoder",
+    sizeof(_YajlEncoder),
+    0,
+    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE|Py_TPFLAGS_IMMUTABLETYPE,
+    yajlencoder_slots
+};
+
+static PyType_Slot yajlrecord_slots[] = {
+    {Py_tp_dealloc, (void *)(yajlrecord_dealloc)},
+    {Py_tp_repr, (void *)(yajlrecord_repr)},
+    {Py_mp_length, (void *)(yajlrecord_length)},
+    {Py_mp_subscript, (void *)(yajlrecord_subscript)},
+    {Py_sq_contains, (void *)(yajlrecord_contains)},
+    {Py_tp_doc, (void *)(yajlrecord_doc)},
+    {Py_tp_traverse, (void *)(yajlrecord_traverse)},
+    {Py_tp_richcompare, (void *)(yajlrecord_richcompare)},
+    {Py_tp_iter, (void *)(yajlrecord_iter)},
+    {Py_tp_methods, (void *)(yajlrecord_methods)},
+    {0, NULL}
+};
+
+/* like the static type, Records are only ever created by the decoder */
+static PyType_Spec yajlrecord_spec = {
+    "yajl.Record",
+    sizeof(_YajlRecord) - sizeof(PyObject *),
+    sizeof(PyObject *),
+    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_GC|Py_TPFLAGS_IMMUTABLETYPE|
+        Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    yajlrecord_slots
+};
+
+static PyType_Slot yajliterator_slots[] = {
+    {Py_tp_dealloc, (void *)(yajliterator_dealloc)},
+    {Py_tp_doc, (void *)(yajliterator_doc)},
+    {Py_tp_traverse, (void *)(yajliterator_traverse)},
+    {Py_tp_clear, (void *)(yajliterator_clear)},
+    {Py_tp_iter, (void *)(PyObject_SelfIter)},
+    {Py_tp_iternext, (void *)(yajliterator_next)},
+    {0, NULL}
+};
+
+static PyType_Spec yajliterator_spec = {
+    "yajl.ParseIterator",
+    sizeof(_YajlIterator),
+    0,
+    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_GC|Py_TPFLAGS_IMMUTABLETYPE|
+        Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    yajliterator_slots
+};
+#else
 static PyTypeObject YajlDecoderType = {
 #ifdef IS_PYTHON3
     PyVarObject_HEAD_INIT(NULL, 0)
@@ -70,7 +223,7 @@ static PyTypeObject YajlDecoderType = {
     0,                         /*tp_setattro*/
     0,                         /*tp_as_buffer*/
     Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,        /*tp_flags*/
-    "Yajl-based decoder",      /* tp_doc */
+    yajldecoder_doc,     /* tp_doc */
     0,                     /* tp_traverse */
     0,                     /* tp_clear */
     0,                     /* tp_richcompare */
@@ -115,7 +268,7 @@ static PyTypeObject YajlEncoderType = {
     0,                         /*tp_setattro*/
     0,                         /*tp_as_buffer*/
     Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,        /*tp_flags*/
-    "Yajl-based encoder",      /* tp_doc */
+    yajlencoder_doc,     /* tp_doc */
     0,                     /* tp_traverse */
     0,                     /* tp_clear */
     0,                     /* tp_richcompare */
@@ -134,31 +287,169 @@ static PyTypeObject YajlEncoderType = {
     0,                         /* tp_alloc */
 };
 
-static PyObject *py_loads(PYARGS)
+static PyMappingMethods yajlrecord_as_mapping = {
+    (lenfunc)(yajlrecord_length),          /* mp_length */
+    (binaryfunc)(yajlrecord_subscript),    /* mp_subscript */
+    0,                                     /* mp_ass_subscript */
+};
+
+static PySequenceMethods yajlrecord_as_sequence = {
+    0,                         /* sq_length */
+    0,                         /* sq_concat */
+    0,                         /* sq_repeat */
+    0,                         /* sq_item */
+    0,                         /* sq_slice */
+    0,                         /* sq_ass_item */
+    0,                         /* sq_ass_slice */
+    (objobjproc)(yajlrecord_contains), /* sq_contains */
+};
+
+static PyTypeObject YajlRecordType = {
+#ifdef IS_PYTHON3
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+#endif
+    "yajl.Record",             /*tp_name*/
+    sizeof(_YajlRecord) - sizeof(PyObject *),  /*tp_basicsize*/
+    sizeof(PyObject *),        /*tp_itemsize*/
+    (destructor)yajlrecord_dealloc,       /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    (reprfunc)yajlrecord_repr, /*tp_repr*/
+    0,                         /*tp_as_number*/
+    &yajlrecord_as_sequence,   /*tp_as_sequence*/
+    &yajlrecord_as_mapping,    /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_GC,        /*tp_flags*/
+    yajlrecord_doc,     /* tp_doc */
+    (traverseproc)yajlrecord_traverse, /* tp_traverse */
+    0,                     /* tp_clear */
+    (richcmpfunc)yajlrecord_richcompare, /* tp_richcompare */
+    0,                     /* tp_weaklistoffset */
+    (getiterfunc)yajlrecord_iter, /* tp_iter */
+    0,                     /* tp_iternext */
+    yajlrecord_methods,   /* tp_methods */
+    NULL,                 /* tp_members */
+};
+
+static PyTypeObject YajlIteratorType = {
+#ifdef IS_PYTHON3
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+#endif
+    "yajl.ParseIterator",      /*tp_name*/
+    sizeof(_YajlIterator),     /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)yajliterator_dealloc,     /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_GC,        /*tp_flags*/
+    yajliterator_doc,     /* tp_doc */
+    (traverseproc)yajliterator_traverse, /* tp_traverse */
+    (inquiry)yajliterator_clear, /* tp_clear */
+    0,                     /* tp_richcompare */
+    0,                     /* tp_weaklistoffset */
+    PyObject_SelfIter,     /* tp_iter */
+    (iternextfunc)yajliterator_next, /* tp_iternext */
+};
+#endif
+
+/*
+ * The state of the module `module`, holding its types and whatever else
+ * would otherwise be shared by all interpreters
+ */
+#ifdef PY_YAJL_HEAP_TYPES
+static struct PyModuleDef yajlmodule;
+
+static py_yajl_module_state *__state_of(PyObject *module)
+{
+    return (py_yajl_module_state *)(PyModule_GetState(module));
+}
+
+py_yajl_module_state *_internal_module_state(PyTypeObject *type)
+{
+    PyObject *module = PyType_GetModuleByDef(type, &yajlmodule);
+
+    if (!module)
+        return NULL;
+    return __state_of(module);
+}
+#else
+static py_yajl_module_state __module_state;
+
+static py_yajl_module_state *__state_of(PyObject *module)
+{
+    return &__module_state;
+}
+
+py_yajl_module_state *_internal_module_state(PyTypeObject *type)
+{
+    return &__module_state;
+}
+#endif
+
+/*
+ * Create a new Decoder, passing along any decoder options (keyword
+ * arguments) given to the module-level functions
+ */
+static PyObject *__new_decoder(PyObject *module, PyObject *kwargs)
 {
     PyObject *decoder = NULL;
-    PyObject *result = NULL;
-    PyObject *pybuffer = NULL;
-    char *buffer = NULL;
-    Py_ssize_t buflen = 0;
+    PyObject *empty = PyTuple_New(0);
 
-    if (!PyArg_ParseTuple(args, "O", &pybuffer))
+    if (!empty)
         return NULL;
+    decoder = PyObject_Call((PyObject *)(__state_of(module)->decoder_type),
+            empty, kwargs);
+    Py_DECREF(empty);
+    return decoder;
+}
+
+/*
+ * Get at the UTF-8 bytes of the document `pybuffer`, returning a new
+ * reference to the object owning them
+ */
+static PyObject *__string_from_object(PyObject *pybuffer, char **buffer,
+        Py_ssize_t *buflen)
+{
+    PyObject *encoded = NULL;
 
     Py_INCREF(pybuffer);
 
     if (PyUnicode_Check(pybuffer)) {
-        if (!(result = PyUnicode_AsUTF8String(pybuffer))) {
+        if (!(encoded = PyUnicode_AsUTF8String(pybuffer))) {
             Py_DECREF(pybuffer);
             return NULL;
         }
         Py_DECREF(pybuffer);
-        pybuffer = result;
-        result = NULL;
+        pybuffer = encoded;
     }
 
     if (PyString_Check(pybuffer)) {
-        if (PyString_AsStringAndSize(pybuffer, &buffer, &buflen)) {
+        if (PyString_AsStringAndSize(pybuffer, buffer, buflen)) {
             Py_DECREF(pybuffer);
             return NULL;
         }
@@ -169,9 +460,46 @@ static PyObject *py_loads(PYARGS)
         PyErr_SetString(PyExc_ValueError, "string or unicode expected");
         return NULL;
     }
+    return pybuffer;
+}
+
+/*
+ * Documents may also be read in chunks from a stream: if `*document` has a
+ * read() method it's moved to `*reader`, and otherwise replaced with (a new
+ * reference to) its UTF-8 bytes as by __string_from_object()
+ */
+static int __document_or_reader(PyObject **document, PyObject **reader)
+{
+    char *buffer = NULL;
+    Py_ssize_t buflen = 0;
+
+    if ( (!PyUnicode_Check(*document)) && (!PyString_Check(*document)) &&
+            (PyObject_HasAttrString(*document, "read")) ) {
+        *reader = *document;
+        *document = NULL;
+        return success;
+    }
+    *document = __string_from_object(*document, &buffer, &buflen);
+    return (*document) ? success : failure;
+}
+
+static PyObject *py_loads(PYARGS)
+{
+    PyObject *decoder = NULL;
+    PyObject *result = NULL;
+    PyObject *pybuffer = NULL;
+    char *buffer = NULL;
+    Py_ssize_t buflen = 0;
 
-    decoder = PyObject_Call((PyObject *)(&YajlDecoderType), NULL, NULL);
+    if (!PyArg_ParseTuple(args, "O", &pybuffer))
+        return NULL;
+
+    if (!(pybuffer = __string_from_object(pybuffer, &buffer, &buflen)))
+        return NULL;
+
+    decoder = __new_decoder(self, kwargs);
     if (decoder == NULL) {
+        Py_DECREF(pybuffer);
         return NULL;
     }
 
@@ -182,6 +510,79 @@ static PyObject *py_loads(PYARGS)
     return result;
 }
 
+static PyObject *py_loads_columnar(PYARGS)
+{
+    static char *kwlist[] = {"string", "path", NULL};
+    PyObject *decoder = NULL;
+    PyObject *result = NULL;
+    PyObject *pybuffer = NULL;
+    PyObject *path = NULL;
+    char *buffer = NULL;
+    Py_ssize_t buflen = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", kwlist, &pybuffer, &path))
+        return NULL;
+
+    if (!(pybuffer = __string_from_object(pybuffer, &buffer, &buflen)))
+        return NULL;
+
+    decoder = __new_decoder(self, NULL);
+    if (decoder == NULL) {
+        Py_DECREF(pybuffer);
+        return NULL;
+    }
+
+    if (path) {
+        Py_INCREF(path);
+    } else if (!(path = PyUnicode_FromString("/"))) {
+        Py_DECREF(pybuffer);
+        Py_DECREF(decoder);
+        return NULL;
+    }
+
+    result = _internal_decode_columnar(
+            (_YajlDecoder *)decoder, buffer, (unsigned int)buflen, path);
+    Py_DECREF(path);
+    Py_DECREF(pybuffer);
+    Py_XDECREF(decoder);
+    return result;
+}
+
+static PyObject *py_validate(PYARGS)
+{
+    static char *kwlist[] = {"string", "max_depth", "max_size", NULL};
+    PyObject *pybuffer = NULL;
+    char *buffer = NULL;
+    Py_ssize_t buflen = 0;
+    Py_ssize_t max_size = -1;
+    int max_depth = -1;
+    int rc;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|in", kwlist, &pybuffer,
+                &max_depth, &max_size)) {
+        return NULL;
+    }
+
+    if (!(pybuffer = __string_from_object(pybuffer, &buffer, &buflen)))
+        return NULL;
+
+    if ( (max_size >= 0) && (buflen > max_size) ) {
+        PyErr_Format(PyExc_ValueError,
+                "The document is %zd bytes, more than the maximum of %zd",
+                buflen, max_size);
+        Py_DECREF(pybuffer);
+        return NULL;
+    }
+
+    /* `pybuffer` is immutable, so may be read with the GIL released */
+    rc = _internal_validate(buffer, (unsigned int)buflen, max_depth);
+    Py_DECREF(pybuffer);
+    if (!rc)
+        return NULL;
+    Py_INCREF(Py_True);
+    return Py_True;
+}
+
 static char *__config_gen_config(PyObject *indent, yajl_gen_config *config)
 {
     long indentLevel = -1;
@@ -219,40 +620,306 @@ static char *__config_gen_config(PyObject *indent, yajl_gen_config *config)
     return spaces;
 }
 
-static PyObject *py_dumps(PYARGS)
+/*
+ * Split the keyword arguments of yajl.dumps() and friends into `own`, those
+ * named in the function's `kwlist`, and `options`, the rest of them which
+ * are passed along to yajl.Encoder()
+ */
+static int __split_kwargs(PyObject *kwargs, char **kwlist, PyObject **own,
+        PyObject **options)
+{
+    PyObject *value = NULL;
+
+    *own = NULL;
+    *options = NULL;
+    if (!kwargs)
+        return success;
+
+    *own = PyDict_New();
+    *options = PyDict_Copy(kwargs);
+    if ( (!*own) || (!*options) )
+        goto error;
+
+    for (; *kwlist; kwlist++) {
+        value = PyDict_GetItemString(kwargs, *kwlist);
+        if (!value)
+            continue;
+        if ( (PyDict_SetItemString(*own, *kwlist, value)) ||
+                (PyDict_DelItemString(*options, *kwlist)) ) {
+            goto error;
+        }
+    }
+    return success;
+
+  error:
+    Py_CLEAR(*own);
+    Py_CLEAR(*options);
+    return failure;
+}
+
+/*
+ * The encoders dumps() and friends create for each call pass on what they
+ * learned about the size of the output to the next one, through the
+ * module state
+ */
+static PyObject *__new_encoder(PyObject *module, PyObject *options)
+{
+    py_yajl_module_state *state = __state_of(module);
+    PyObject *encoder = NULL;
+    PyObject *empty = PyTuple_New(0);
+
+    if (!empty)
+        return NULL;
+    encoder = PyObject_Call((PyObject *)(state->encoder_type), empty, options);
+    Py_DECREF(empty);
+    if (encoder)
+        ((_YajlEncoder *)(encoder))->_size_estimate =
+            PY_YAJL_LOAD_ESTIMATE(&(state->size_estimate));
+    return encoder;
+}
+
+static void __release_encoder(PyObject *module, PyObject *encoder)
+{
+    PY_YAJL_STORE_ESTIMATE(&(__state_of(module)->size_estimate),
+            ((_YajlEncoder *)(encoder))->_size_estimate);
+    Py_DECREF(encoder);
+}
+
+static PyObject *_internal_dumps(PyObject *module, PyObject *args, PyObject *kwargs,
+        int as_bytes)
 {
     PyObject *encoder = NULL;
     PyObject *obj = NULL;
     PyObject *result = NULL;
     PyObject *indent = NULL;
+    PyObject *own = NULL;
+    PyObject *options = NULL;
     yajl_gen_config config = { 0, NULL };
-    static char *kwlist[] = {"object", "indent", NULL};
+    static char *kwlist[] = {"object", "indent", "size_hint", NULL};
     char *spaces = NULL;
+    Py_ssize_t size_hint = 0;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", kwlist, &obj, &indent)) {
+    if (!__split_kwargs(kwargs, kwlist, &own, &options))
         return NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, own, "O|On", kwlist, &obj, &indent,
+                &size_hint)) {
+        goto exit;
     }
 
     spaces = __config_gen_config(indent, &config);
     if (PyErr_Occurred()) {
-        return NULL;
+        goto exit;
     }
 
-    encoder = PyObject_Call((PyObject *)(&YajlEncoderType), NULL, NULL);
+    encoder = __new_encoder(module, options);
     if (encoder == NULL) {
+        goto exit;
+    }
+
+    result = _internal_encode((_YajlEncoder *)encoder, obj, config, as_bytes,
+            size_hint);
+    __release_encoder(module, encoder);
+
+  exit:
+    if (spaces) {
+        free(spaces);
+    }
+    Py_XDECREF(own);
+    Py_XDECREF(options);
+    return result;
+}
+
+static PyObject *py_dumps(PYARGS)
+{
+    return _internal_dumps(self, args, kwargs, 0);
+}
+
+static PyObject *py_dumpb(PYARGS)
+{
+    return _internal_dumps(self, args, kwargs, 1);
+}
+
+#if PY_VERSION_HEX >= 0x02060000
+static PyObject *py_dumps_into(PYARGS)
+{
+    PyObject *encoder = NULL;
+    PyObject *obj = NULL;
+    PyObject *target = NULL;
+    PyObject *result = NULL;
+    PyObject *indent = NULL;
+    PyObject *own = NULL;
+    PyObject *options = NULL;
+    yajl_gen_config config = { 0, NULL };
+    static char *kwlist[] = {"object", "buffer", "offset", "indent", NULL};
+    char *spaces = NULL;
+    Py_ssize_t offset = 0;
+    Py_ssize_t written;
+
+    if (!__split_kwargs(kwargs, kwlist, &own, &options))
         return NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, own, "OO|nO", kwlist, &obj, &target,
+                &offset, &indent)) {
+        goto exit;
+    }
+
+    spaces = __config_gen_config(indent, &config);
+    if (PyErr_Occurred()) {
+        goto exit;
+    }
+
+    encoder = __new_encoder(self, options);
+    if (encoder == NULL) {
+        goto exit;
     }
 
-    result = _internal_encode((_YajlEncoder *)encoder, obj, config);
-    Py_XDECREF(encoder);
+    written = _internal_encode_into((_YajlEncoder *)encoder, obj, config, target, offset);
+    __release_encoder(self, encoder);
+    if (written >= 0) {
+#ifdef IS_PYTHON3
+        result = PyLong_FromSsize_t(written);
+#else
+        result = PyInt_FromSsize_t(written);
+#endif
+    }
+
+  exit:
     if (spaces) {
         free(spaces);
     }
+    Py_XDECREF(own);
+    Py_XDECREF(options);
+    return result;
+}
+#endif
+
+static PyObject *py_reformat(PYARGS)
+{
+    static char *kwlist[] = {"string", "indent", "stream", NULL};
+    PyObject *document = NULL;
+    PyObject *reader = NULL;
+    PyObject *indent = NULL;
+    PyObject *stream = NULL;
+    PyObject *result = NULL;
+    yajl_gen_config config = { 0, NULL };
+    char *spaces = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OO", kwlist, &document,
+                &indent, &stream)) {
+        return NULL;
+    }
+
+    if ( (stream == Py_None) || (stream == NULL) ) {
+        stream = NULL;
+    } else if (!PyObject_HasAttrString(stream, "write")) {
+        PyErr_SetString(PyExc_TypeError, "`stream` must have a write() method");
+        return NULL;
+    }
+
+    spaces = __config_gen_config(indent, &config);
+    if (PyErr_Occurred())
+        return NULL;
+
+    if (!__document_or_reader(&document, &reader))
+        goto exit;
+
+    result = _internal_reformat(document, reader, config, stream);
+
+  exit:
+    Py_XDECREF(document);
+    if (spaces)
+        free(spaces);
+    return result;
+}
+
+static PyObject *py_parse_events(PYARGS)
+{
+    static char *kwlist[] = {"string", "batch", NULL};
+    PyObject *document = NULL;
+    PyObject *reader = NULL;
+    PyObject *result = NULL;
+    Py_ssize_t batch = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|n", kwlist, &document, &batch))
+        return NULL;
+
+    if (batch < 0) {
+        PyErr_SetString(PyExc_ValueError, "batch must not be negative");
+        return NULL;
+    }
+
+    if (!__document_or_reader(&document, &reader))
+        return NULL;
+
+    result = _internal_iter_events(__state_of(self)->iterator_type, document,
+            reader, batch);
+    Py_XDECREF(document);
+    return result;
+}
+
+/* Put a yajl.Record back together, see Record.__reduce__() */
+static PyObject *py_record(PyObject *self, PyObject *args)
+{
+    py_yajl_module_state *state = __state_of(self);
+    PyObject *keys = NULL;
+    PyObject *values = NULL;
+
+    if (!state)
+        return NULL;
+    if (!PyArg_ParseTuple(args, "O!O!", &PyTuple_Type, &keys, &PyTuple_Type, &values))
+        return NULL;
+    if (PyTuple_GET_SIZE(keys) != PyTuple_GET_SIZE(values)) {
+        PyErr_SetString(PyExc_ValueError, "A record needs as many keys as values");
+        return NULL;
+    }
+    return yajlrecord_new(state->record_type, keys,
+            &PyTuple_GET_ITEM(values, 0), PyTuple_GET_SIZE(values));
+}
+
+static PyObject *py_iter_items(PYARGS)
+{
+    static char *kwlist[] = {"string", "path", NULL};
+    PyObject *document = NULL;
+    PyObject *reader = NULL;
+    PyObject *path = NULL;
+    PyObject *decoder = NULL;
+    PyObject *result = NULL;
+    PyObject *own = NULL;
+    PyObject *options = NULL;
+
+    if (!__split_kwargs(kwargs, kwlist, &own, &options))
+        return NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, own, "O|O", kwlist, &document, &path))
+        goto exit;
+
+    if (path) {
+        Py_INCREF(path);
+    } else if (!(path = PyUnicode_FromString("/"))) {
+        goto exit;
+    }
+
+    if (!__document_or_reader(&document, &reader))
+        goto exit;
+
+    decoder = __new_decoder(self, options);
+    if (decoder) {
+        result = _internal_iter_items(__state_of(self)->iterator_type,
+                decoder, document, reader, path);
+    }
+
+  exit:
+    Py_XDECREF(decoder);
+    Py_XDECREF(document);
+    Py_XDECREF(path);
+    Py_XDECREF(own);
+    Py_XDECREF(options);
     return result;
 }
 
-static PyObject *__read = NULL;
-static PyObject *_internal_stream_load(PyObject *args, unsigned int blocking)
+static PyObject *_internal_stream_load(PyObject *module, PyObject *args, PyObject *kwargs,
+        unsigned int blocking)
 {
     PyObject *decoder = NULL;
     PyObject *stream = NULL;
@@ -266,15 +933,11 @@ static PyObject *_internal_stream_load(PyObject *args, unsigned int blocking)
         goto bad_type;
     }
 
-    if (__read == NULL) {
-        __read = PyUnicode_FromString("read");
-    }
-
-    if (!PyObject_HasAttr(stream, __read)) {
+    if (!PyObject_HasAttrString(stream, "read")) {
         goto bad_type;
     }
 
-    buffer = PyObject_CallMethodObjArgs(stream, __read, NULL);
+    buffer = PyObject_CallMethod(stream, "read", NULL);
 
     if (!buffer)
         return NULL;
@@ -285,7 +948,7 @@ static PyObject *_internal_stream_load(PyObject *args, unsigned int blocking)
         return NULL;
 #endif
 
-    decoder = PyObject_Call((PyObject *)(&YajlDecoderType), NULL, NULL);
+    decoder = __new_decoder(module, kwargs);
     if (decoder == NULL) {
         return NULL;
     }
@@ -309,37 +972,42 @@ bad_type:
 
 static PyObject *py_load(PYARGS)
 {
-    return _internal_stream_load(args, 1);
+    return _internal_stream_load(self, args, kwargs, 1);
 }
 static PyObject *py_iterload(PYARGS)
 {
-    return _internal_stream_load(args, 0);
+    return _internal_stream_load(self, args, kwargs, 0);
 }
 
-static PyObject *__write = NULL;
-static PyObject *_internal_stream_dump(PyObject *object, PyObject *stream, unsigned int blocking,
-            yajl_gen_config config)
+static PyObject *_internal_stream_dump(PyObject *module, PyObject *object, PyObject *stream,
+            unsigned int blocking, yajl_gen_config config, PyObject *options,
+            Py_ssize_t size_hint)
 {
     PyObject *encoder = NULL;
     PyObject *buffer = NULL;
+    PyObject *written = NULL;
 
-    if (__write == NULL) {
-        __write = PyUnicode_FromString("write");
-    }
-
-    if (!PyObject_HasAttr(stream, __write)) {
+    if (!PyObject_HasAttrString(stream, "write")) {
         goto bad_type;
     }
 
-    encoder = PyObject_Call((PyObject *)(&YajlEncoderType), NULL, NULL);
+    encoder = __new_encoder(module, options);
     if (encoder == NULL) {
         return NULL;
     }
 
-    buffer = _internal_encode((_YajlEncoder *)encoder, object, config);
-    PyObject_CallMethodObjArgs(stream, __write, buffer, NULL);
-    Py_XDECREF(encoder);
-    Py_XDECREF(buffer);
+    buffer = _internal_encode((_YajlEncoder *)encoder, object, config, 0, size_hint);
+    __release_encoder(module, encoder);
+    if (!buffer)
+        return NULL;
+
+    written = PyObject_CallMethod(stream, "write", "O", buffer);
+    Py_DECREF(buffer);
+    if (!written)
+        return NULL;
+    Py_DECREF(written);
+
+    Py_INCREF(Py_True);
     return Py_True;
 
 bad_type:
@@ -353,22 +1021,33 @@ static PyObject *py_dump(PYARGS)
     PyObject *indent = NULL;
     PyObject *stream = NULL;
     PyObject *result = NULL;
+    PyObject *own = NULL;
+    PyObject *options = NULL;
     yajl_gen_config config = { 0, NULL };
-    static char *kwlist[] = {"object", "stream", "indent", NULL};
+    static char *kwlist[] = {"object", "stream", "indent", "size_hint", NULL};
     char *spaces = NULL;
+    Py_ssize_t size_hint = 0;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|O", kwlist, &object, &stream, &indent)) {
+    if (!__split_kwargs(kwargs, kwlist, &own, &options))
         return NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, own, "OO|On", kwlist, &object, &stream,
+                &indent, &size_hint)) {
+        goto exit;
     }
 
     spaces = __config_gen_config(indent, &config);
     if (PyErr_Occurred()) {
-        return NULL;
+        goto exit;
     }
-    result = _internal_stream_dump(object, stream, 0, config);
+    result = _internal_stream_dump(self, object, stream, 0, config, options, size_hint);
+
+  exit:
     if (spaces) {
         free(spaces);
     }
+    Py_XDECREF(own);
+    Py_XDECREF(options);
     return result;
 }
 
@@ -379,6 +1058,9 @@ static PyObject *py_monkeypatch(PYARGS)
     PyObject *yajl = PyDict_GetItemString(modules, "yajl");
 
     if (!yajl) {
+        Py_XDECREF(sys);
+        Py_XDECREF(modules);
+        Py_INCREF(Py_False);
         return Py_False;
     }
 
@@ -387,28 +1069,132 @@ static PyObject *py_monkeypatch(PYARGS)
 
     Py_XDECREF(sys);
     Py_XDECREF(modules);
+    Py_INCREF(Py_True);
     return Py_True;
 }
 
+static PyObject *py_stats(PYARGS)
+{
+    return _internal_stats_dict(__state_of(self));
+}
+
+static PyObject *py_reset_stats(PYARGS)
+{
+    _internal_stats_reset(__state_of(self));
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
 static struct PyMethodDef yajl_methods[] = {
     {"dumps", (PyCFunctionWithKeywords)(py_dumps), METH_VARARGS | METH_KEYWORDS,
-"yajl.dumps(obj [, indent=None])\n\n\
+"yajl.dumps(obj [, indent=None, size_hint=0, **options])\n\n\
 Returns an encoded JSON string of the specified `obj`\n\
 \n\
 If `indent` is a non-negative integer, then JSON array elements \n\
 and object members will be pretty-printed with that indent level. \n\
 An indent level of 0 will only insert newlines. None (the default) \n\
 selects the most compact representation.\n\
+\n\
+A positive `size_hint` is the number of bytes to set aside for the output\n\
+up front; by default that's based on the size of recent output.\n\
+\n\
+Any other keyword `options` are passed along to yajl.Encoder()\n\
+"},
+    {"dumpb", (PyCFunction)(void (*)(void))(py_dumpb), METH_VARARGS | METH_KEYWORDS,
+"yajl.dumpb(obj [, indent=None, size_hint=0, **options])\n\n\
+Returns the encoded JSON of the specified `obj` as UTF-8 bytes (a str on\n\
+Python 2), as yajl.dumps() would but without decoding it\n\
+"},
+#if PY_VERSION_HEX >= 0x02060000
+    {"dumps_into", (PyCFunction)(void (*)(void))(py_dumps_into), METH_VARARGS | METH_KEYWORDS,
+"yajl.dumps_into(obj, buffer [, offset=0, indent=None, **options])\n\n\
+Encodes the given `obj` as UTF-8 straight into the writable `buffer`\n\
+(a bytearray, or a memoryview of shared memory or an mmap, ...) starting\n\
+`offset` bytes in, and returns the number of bytes written\n\
+\n\
+A bytearray is grown as need be; for other buffers ValueError is raised\n\
+if the output doesn't fit, in which case they may have been partly\n\
+written to.\n\
+\n\
+Any other keyword `options` are passed along to yajl.Encoder()\n\
+"},
+#endif
+    {"loads", (PyCFunction)(py_loads), METH_VARARGS | METH_KEYWORDS,
+"yajl.loads(string [, **options])\n\n\
+Returns a decoded object based on the given JSON `string`\n\
+\n\
+Any keyword `options` are passed along to yajl.Decoder()\n\
+"},
+    {"loads_columnar", (PyCFunction)(py_loads_columnar), METH_VARARGS | METH_KEYWORDS,
+"yajl.loads_columnar(string [, path='/'])\n\n\
+Decodes the array of objects found at `path` in the JSON `string` into\n\
+a dict of columns, one per key, without building the objects themselves;\n\
+`path` lists the object keys leading to the array, e.g. \"/data/rows\"\n\
+\n\
+Columns holding only integers (or only floats) are returned as\n\
+array.array('q') (or array.array('d')), all others as lists; objects\n\
+lacking a key get None in that column\n\
 "},
-    {"loads", (PyCFunction)(py_loads), METH_VARARGS,
-"yajl.loads(string)\n\n\
-Returns a decoded object based on the given JSON `string`"},
-    {"load", (PyCFunction)(py_load), METH_VARARGS,
-"yajl.load(fp)\n\n\
+    {"validate", (PyCFunction)(py_validate), METH_VARARGS | METH_KEYWORDS,
+"yajl.validate(string [, max_depth=-1, max_size=-1])\n\n\
+Checks that the JSON `string` is well-formed without decoding it, returning\n\
+True if so and raising ValueError otherwise; the GIL is released while it's\n\
+parsed\n\
+\n\
+Unless negative, `max_depth` limits how deeply objects and arrays may nest\n\
+and `max_size` the size of the document in (UTF-8) bytes\n\
+"},
+    {"reformat", (PyCFunction)(py_reformat), METH_VARARGS | METH_KEYWORDS,
+"yajl.reformat(string [, indent=None, stream=None])\n\n\
+Returns the JSON `string` (or the JSON read from the stream-like object\n\
+`string`) reformatted, without decoding it; the GIL is released while\n\
+it's parsed and generated, a chunk at a time\n\
+\n\
+`indent` is as for yajl.dumps(): None (the default) minifies the JSON, a\n\
+non-negative integer pretty-prints it with that indent level. If `stream`\n\
+is given, the output is written to it as it's generated and True returned;\n\
+binary streams (such as io.BytesIO or files opened in 'wb' mode) are\n\
+written UTF-8 bytes, and others str\n\
+"},
+    {"parse_events", (PyCFunction)(py_parse_events), METH_VARARGS | METH_KEYWORDS,
+"yajl.parse_events(string [, batch=0])\n\n\
+Returns an iterator over the parser's events for the JSON `string` (or the\n\
+JSON read from the stream-like object `string`), as (prefix, event, value)\n\
+tuples like ijson's, without building the document; it's parsed a chunk\n\
+at a time, as the events are asked for\n\
+\n\
+`event` is one of \"null\", \"boolean\", \"number\", \"string\", \"map_key\",\n\
+\"start_map\", \"end_map\", \"start_array\" and \"end_array\", and `value` the\n\
+decoded scalar or key (None for the others). `prefix` is the path to the\n\
+value, its object keys joined by dots, with \"item\" for array elements.\n\
+\n\
+If `batch` is positive, lists of up to that many events are returned\n\
+instead of single events, to save on the cost of iterating\n\
+"},
+    {"iter_items", (PyCFunction)(py_iter_items), METH_VARARGS | METH_KEYWORDS,
+"yajl.iter_items(string [, path='/', **options])\n\n\
+Returns an iterator over the elements of the array found at `path` in the\n\
+JSON `string` (or the JSON read from the stream-like object `string`),\n\
+each one decoded as yajl.loads() would and returned as soon as it's\n\
+complete; only the largest of the elements, rather than the whole\n\
+document, ever needs to fit in memory. `path` lists the object keys\n\
+leading to the array, e.g. \"/data/items\"\n\
+\n\
+Any other keyword `options` are passed along to yajl.Decoder()\n\
+"},
+    {"_record", (PyCFunction)(py_record), METH_VARARGS,
+"yajl._record(keys, values)\n\n\
+Returns a yajl.Record of the given tuples of keys and values, for unpickling\n\
+"},
+    {"load", (PyCFunction)(py_load), METH_VARARGS | METH_KEYWORDS,
+"yajl.load(fp [, **options])\n\n\
 Returns a decoded object based on the JSON read from the `fp` stream-like\n\
-object; *Note:* It is expected that `fp` supports the `read()` method"},
+object; *Note:* It is expected that `fp` supports the `read()` method\n\
+\n\
+Any keyword `options` are passed along to yajl.Decoder()\n\
+"},
     {"dump", (PyCFunctionWithKeywords)(py_dump), METH_VARARGS | METH_KEYWORDS,
-"yajl.dump(obj, fp [, indent=None])\n\n\
+"yajl.dump(obj, fp [, indent=None, size_hint=0, **options])\n\n\
 Encodes the given `obj` and writes it to the `fp` stream-like object. \n\
 *Note*: It is expected that `fp` supports the `write()` method\n\
 \n\
@@ -416,6 +1202,11 @@ If `indent` is a non-negative integer, then JSON array elements \n\
 and object members will be pretty-printed with that indent level. \n\
 An indent level of 0 will only insert newlines. None (the default) \n\
 selects the most compact representation.\n\
+\n\
+A positive `size_hint` is the number of bytes to set aside for the output\n\
+up front; by default that's based on the size of recent output.\n\
+\n\
+Any other keyword `options` are passed along to yajl.Encoder()\n\
 "},
     /*
      {"iterload", (PyCFunction)(py_iterload), METH_VARARGS, NULL},
@@ -423,21 +1214,27 @@ selects the most compact representation.\n\
     {"monkeypatch", (PyCFunction)(py_monkeypatch), METH_NOARGS,
 "yajl.monkeypatch()\n\n\
 Monkey-patches the yajl module into sys.modules as \"json\"\n\
+"},
+    {"stats", (PyCFunction)(py_stats), METH_NOARGS,
+"yajl.stats()\n\n\
+Returns a dict of what this module (in this interpreter) has done since it\n\
+was loaded or reset_stats() was last called: the number of documents\n\
+and bytes decoded and encoded, the number of objects the decoder created\n\
+of each kind, the number of times encoders grew their output buffer and\n\
+called default(), and histograms of decode and encode latencies, whose\n\
+i-th bucket counts the calls which took 2**i up to 2**(i+1) nanoseconds\n\
+\n\
+The dict is empty if the module was built with PY_YAJL_STATS=0\n\
+"},
+    {"reset_stats", (PyCFunction)(py_reset_stats), METH_NOARGS,
+"yajl.reset_stats()\n\n\
+Sets all of the counters returned by yajl.stats() back to zero\n\
 "},
     {NULL}
 };
 
 
-#ifdef IS_PYTHON3
-static struct PyModuleDef yajlmodule = {
-    PyModuleDef_HEAD_INIT,
-    "yajl",
-#else
-PyMODINIT_FUNC inityajl(void)
-{
-
-    PyObject *module = Py_InitModule3("yajl", yajl_methods,
-#endif
+PyDoc_STRVAR(yajl_doc,
 "Providing a pythonic interface to the yajl (Yet Another JSON Library) parser\n\n\
 The interface is similar to that of simplejson or jsonlib providing a consistent syntax for JSON\n\
 encoding and decoding. Unlike simplejson or jsonlib, yajl is **fast** :)\n\n\
@@ -448,46 +1245,183 @@ yajl.loads():\t\t502.4572ms\n\
 \n\
 json.dumps():\t\t7760.6348ms\n\
 simplejson.dumps():\t930.9748ms\n\
-yajl.dumps():\t\t681.0221ms"
-#ifdef IS_PYTHON3
-    , -1, yajl_methods, NULL, NULL, NULL, NULL
-};
+yajl.dumps():\t\t681.0221ms");
 
-PyMODINIT_FUNC PyInit_yajl(void)
+static int __add_type(PyObject *module, const char *name, PyTypeObject *type)
 {
-    PyObject *module = PyModule_Create(&yajlmodule);
-#else
-);
-#endif
+    Py_INCREF(type);
+    if (PyModule_AddObject(module, name, (PyObject *)(type)) < 0) {
+        Py_DECREF(type);
+        return failure;
+    }
+    return success;
+}
 
-    PyObject *version = PyUnicode_FromString(MOD_VERSION);
-    PyModule_AddObject(module, "__version__", version);
+/*
+ * Fill in a freshly created module; returns 0, or -1 with an exception set
+ */
+static int __exec_module(PyObject *module)
+{
+    py_yajl_module_state *state = __state_of(module);
+    PyObject *version = NULL;
+    PyObject *abc = NULL;
+    PyObject *mapping = NULL;
+    PyObject *registered = NULL;
 
-    YajlDecoderType.tp_new = PyType_GenericNew;
-    if (PyType_Ready(&YajlDecoderType) < 0) {
-        goto bad_exit;
+    version = PyUnicode_FromString(MOD_VERSION);
+    if ( (!version) || (PyModule_AddObject(module, "__version__", version) < 0) ) {
+        Py_XDECREF(version);
+        return -1;
     }
 
-    Py_INCREF(&YajlDecoderType);
-    PyModule_AddObject(module, "Decoder", (PyObject *)(&YajlDecoderType));
+#ifdef PY_YAJL_HEAP_TYPES
+    state->decoder_type = (PyTypeObject *)(PyType_FromModuleAndSpec(module,
+                &yajldecoder_spec, NULL));
+    state->encoder_type = (PyTypeObject *)(PyType_FromModuleAndSpec(module,
+                &yajlencoder_spec, NULL));
+    state->record_type = (PyTypeObject *)(PyType_FromModuleAndSpec(module,
+                &yajlrecord_spec, NULL));
+    state->iterator_type = (PyTypeObject *)(PyType_FromModuleAndSpec(module,
+                &yajliterator_spec, NULL));
+    if ( (!state->decoder_type) || (!state->encoder_type) ||
+            (!state->record_type) || (!state->iterator_type) ) {
+        return -1;
+    }
+#else
+    YajlDecoderType.tp_new = PyType_GenericNew;
+    YajlEncoderType.tp_new = yajlencoder_new;
+    if ( (PyType_Ready(&YajlDecoderType) < 0) ||
+            (PyType_Ready(&YajlEncoderType) < 0) ||
+            (PyType_Ready(&YajlRecordType) < 0) ||
+            (PyType_Ready(&YajlIteratorType) < 0) ) {
+        return -1;
+    }
+    state->decoder_type = &YajlDecoderType;
+    state->encoder_type = &YajlEncoderType;
+    state->record_type = &YajlRecordType;
+    state->iterator_type = &YajlIteratorType;
+#endif
 
-    YajlEncoderType.tp_new = PyType_GenericNew;
-    if (PyType_Ready(&YajlEncoderType) < 0) {
-        goto bad_exit;
+    if ( (!__add_type(module, "Decoder", state->decoder_type)) ||
+            (!__add_type(module, "Encoder", state->encoder_type)) ||
+            (!__add_type(module, "Record", state->record_type)) ) {
+        return -1;
     }
 
-    Py_INCREF(&YajlEncoderType);
-    PyModule_AddObject(module, "Encoder", (PyObject *)(&YajlEncoderType));
+    /*
+     * Created along with the module rather than lazily, so that threads
+     * can't race to do so
+     */
+    if (!state->fieldcache)
+        state->fieldcache = PyDict_New();
+    if (!state->fieldcache)
+        return -1;
 
+    /* Records should pass isinstance() checks against Mapping */
 #ifdef IS_PYTHON3
-    return module;
+    abc = PyImport_ImportModule("collections.abc");
+#else
+    abc = PyImport_ImportModule("collections");
 #endif
+    if (abc) {
+        mapping = PyObject_GetAttrString(abc, "Mapping");
+        if (mapping) {
+            registered = PyObject_CallMethod(mapping, "register", "O",
+                    (PyObject *)(state->record_type));
+            Py_XDECREF(registered);
+            Py_DECREF(mapping);
+        }
+        Py_DECREF(abc);
+    }
+    PyErr_Clear();
+    return 0;
+}
 
-bad_exit:
-#ifdef IS_PYTHON3
-    return NULL;
-#else
-    return;
+#ifdef PY_YAJL_HEAP_TYPES
+static int __traverse_module(PyObject *module, visitproc visit, void *arg)
+{
+    py_yajl_module_state *state = __state_of(module);
+
+    Py_VISIT(state->decoder_type);
+    Py_VISIT(state->encoder_type);
+    Py_VISIT(state->record_type);
+    Py_VISIT(state->iterator_type);
+    Py_VISIT(state->fieldcache);
+    return 0;
+}
+
+static int __clear_module(PyObject *module)
+{
+    py_yajl_module_state *state = __state_of(module);
+
+    Py_CLEAR(state->decoder_type);
+    Py_CLEAR(state->encoder_type);
+    Py_CLEAR(state->record_type);
+    Py_CLEAR(state->iterator_type);
+    Py_CLEAR(state->fieldcache);
+    return 0;
+}
+
+static void __free_module(void *module)
+{
+    __clear_module((PyObject *)(module));
+}
+
+static PyModuleDef_Slot yajl_slots[] = {
+    {Py_mod_exec, (void *)(__exec_module)},
+#if PY_VERSION_HEX >= 0x030C0000
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
 #endif
+#if PY_VERSION_HEX >= 0x030D0000
+    /* all state is per call or per module, and safe to share between threads */
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}
+};
+
+static struct PyModuleDef yajlmodule = {
+    PyModuleDef_HEAD_INIT,
+    "yajl",
+    yajl_doc,
+    sizeof(py_yajl_module_state),
+    yajl_methods,
+    yajl_slots,
+    __traverse_module,
+    __clear_module,
+    __free_module
+};
+
+PyMODINIT_FUNC PyInit_yajl(void)
+{
+    return PyModuleDef_Init(&yajlmodule);
+}
+#elif defined(IS_PYTHON3)
+static struct PyModuleDef yajlmodule = {
+    PyModuleDef_HEAD_INIT,
+    "yajl",
+    yajl_doc,
+    -1, yajl_methods, NULL, NULL, NULL, NULL
+};
+
+PyMODINIT_FUNC PyInit_yajl(void)
+{
+    PyObject *module = PyModule_Create(&yajlmodule);
+
+    if (!module)
+        return NULL;
+    if (__exec_module(module) < 0) {
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
 }
+#else
+PyMODINIT_FUNC inityajl(void)
+{
+    PyObject *module = Py_InitModule3("yajl", yajl_methods, yajl_doc);
 
+    if (!module)
+        return;
+    __exec_module(module);
+}
+#endif